@@ -1,48 +1,360 @@
 /*----------------------------------------------------------------------------80
     Copyright 2022 Zheyong Fan
 Compile:
-    g++ md2.cpp -O3 -o md2
+    g++ md2.cpp -O3 -pthread -o md2
+    # or as a library with the C interface in md2.h; see there
 Run:
     path/to/md2.out # Linux
     path\to\md2.exe # Windows
 Inputs:
-    xyz.in and run.in
+    xyz.in and run.in (no xyz.in if run.in has a lattice line)
+Outputs:
+    thermo.out (and rdf.out, sk.out, sed.out with sed_q.out, msd.out or
+    hac.out for the plugin lines); with an ipi line, md2 is a force client of
+    an i-PI server instead; with "monitor name [interval]", live metrics for
+    tools/mdtop.cpp
 ------------------------------------------------------------------------------*/
 
+#include <algorithm> // std::sort, std::min
+#include <atomic>   // std::atomic
+#include <chrono>   // std::chrono::duration
 #include <cmath>    // sqrt() function
+#include <complex>  // std::complex
+#include <csignal>  // std::signal
+#include <cstdio>   // snprintf
+#include <cstdint>  // int8_t and int16_t
+#include <cstring>  // std::memcpy
 #include <ctime>    // for timing
 #include <fstream>  // file
 #include <iomanip>  // std::setprecision
 #include <iostream> // input/output
 #include <iterator>
+#include <memory>  // std::shared_ptr
+#include <mutex>   // std::mutex
 #include <sstream> // std::istringstream
 #include <string>  // string
+#include <thread>  // std::thread
+#include <unordered_map> // std::unordered_map
 #include <vector>  // vector
 
+#ifndef _WIN32 // for the i-PI client and the monitor
+#include <fcntl.h>       // O_CREAT
+#include <netdb.h>       // getaddrinfo
+#include <netinet/in.h>  // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <sys/mman.h>    // shm_open
+#include <sys/socket.h>  // socket
+#include <sys/un.h>      // sockaddr_un
+#include <unistd.h>      // close
+#endif
+
+#include "../../common/async_writer.h" // AsyncWriter and handleSignal
+#include "../../common/fast_exp.h"     // fastExp and fastExpInRange
+#include "../../common/md_monitor.h"  // MonitorRecord and MonitorHeader
+#include "md2.h"
+
 const int Ns = 100;             // output frequency
+const int Nrecheck = 1000;      // recheck frequency of neighbor_flag auto
+const int NmaxON2 = 10000;      // neighbor_flag auto skips 0 and 2 above this
+const double LJ_EPSILON = 1.032e-2; // of argon, in eV
+const double LJ_SIGMA = 3.405;      // of argon, in A
+const double LJ_CUTOFF = 9.0;       // of the LJ force, in A
 const double K_B = 8.617343e-5; // Boltzmann's constant in natural unit
 const double TIME_UNIT_CONVERSION = 1.018051e+1; // from natural unit to fs
+const double KAPPA_UNIT_CONVERSION = 1.573769e+5; // to W/(mK)
+const double PRESSURE_UNIT_CONVERSION = 1.602177e+2; // from eV/A^3 to GPa
+
+// Invalid input prints a message and ends the program; in the library it
+// ends the call of the C interface instead, which then returns an error.
+struct InputError {};
+#ifdef MD2_LIBRARY
+[[noreturn]] void fail() { throw InputError(); }
+#else
+[[noreturn]] void fail() { exit(1); }
+#endif
+
+// crystal built from the lattice and basis keywords of run.in instead of
+// reading xyz.in; see readLattice and buildLattice
+struct Lattice {
+  std::string name; // empty to read xyz.in
+  double cell[9];   // the cell vectors a, b and c, one per row
+  int size[3];      // number of cells along a, b and c
+  int pbc[3] = {1, 1, 1};
+  std::vector<std::string> elements; // of the basis atoms
+  std::vector<double> masses, basis; // basis in fractional coordinates
+  double displacement = 0.0;         // largest random displacement
+  double vacancyFraction = 0.0;
+  double alloyFraction = 0.0; // of the atoms that become alloyElement
+  std::string alloyElement;
+  double alloyMass;
+  unsigned long long seed = 0; // from the clock if 0, unless DEBUG
+};
+
+// read-only view of the elements of a vector, without a copy
+template <typename T>
+struct Span {
+  const T* data = nullptr;
+  int size = 0;
+  Span() = default;
+  Span(const std::vector<T>& v) : data(v.data()), size(v.size()) {}
+  const T& operator[](const int i) const { return data[i]; }
+};
+
+// the run as seen by the plugins in begin
+struct Run {
+  int number;
+  int numSteps;
+  double timeStep;    // in natural units
+  double temperature; // of the initial velocities
+  bool isAdaptive;    // the steps differ in time
+  const double* box;
+  const int* pbc;
+  Span<std::string> elements; // in the order of their first atoms
+  const double* cell;         // of the lattice line, one vector per row
+};
+
+// the state after a step as seen by the plugins in on_step; the spans point
+// into Atom and are valid only during the call
+struct State {
+  int number;
+  double time;       // since the start of the run, in natural units
+  const double* box; // H and its inverse, see applyMic
+  const int* pbc;
+  double pe;
+  Span<double> mass, x, y, z, vx, vy, vz, fx, fy, fz, energy;
+  Span<int> type; // index in Run::elements
+  // the pairs within cutoffList, with j > i in the list of i; empty for
+  // neighbor_flag 0 and 4; read them with forEachNeighbor
+  Span<int> NN, NL;
+  int MN;
+  bool isCompressed = false;
+  Span<int8_t> NL8;
+  Span<int16_t> NL16;
+  Span<int> NL32, offsetNL, widthNL;
+  double cutoffList;
+  const double* hc = nullptr; // heat current, if a plugin needs it
+};
+
+// In-situ analysis registered with a plugin line in run.in. begin is called
+// before the first step, on_step after each step that is a multiple of
+// interval and end after the last step. The heat current is only found at
+// the steps sampled by a plugin that needs it.
+struct Plugin {
+  int interval = 1;
+  bool needsHeatCurrent = false;
+  virtual ~Plugin() = default;
+  virtual void begin(const Run&) {}
+  virtual void on_step(const int step, const State& state) = 0;
+  virtual void end() {}
+};
 
 struct Atom {
   int number;
   int numUpdates = 0;
   int neighbor_flag = 2;
+  int numRepairs = 0;
+  double rebuildFraction = 0.2;
+  double maxDisplacement = 0.0; // adaptive time step if > 0
+  double maxEnergyChange = 0.0;
+  double flushInterval = 1.0; // s
+  double asyncFraction = 0.0;
+  bool isCompressed = false; // NL8, NL16 and NL32 instead of NL
+  bool isAutoNeighbor = false;
+  double buildTime[5], forceTime[5];
   const int MN = 1000;
   double cutoffNeighbor = 10.0;
   double box[18];
+  int pbc[3] = {1, 1, 1};
   double pe;
+  int reductionBlock = 256; // atoms per block in sumAtoms
+  bool isCompensated = false;
+  std::vector<double> energy; // of each atom
   std::vector<int> NN, NL;
+  int numCells[4];
+  std::vector<int> cellCount, cellCountSum, cellContents, cellIndex;
+  std::vector<int> isDirty, dirtyAtoms;
+  std::vector<double> pad, xs, ys, zs, fxs, fys, fzs, es, ws;
+  std::vector<int8_t> NL8;
+  std::vector<int16_t> NL16;
+  std::vector<int> NL32, offsetNL, widthNL, rowNL;
   std::vector<double> mass, x0, y0, z0, x, y, z, vx, vy, vz, fx, fy, fz;
+  Lattice lattice;
+  int numThreads = 1;
+  std::vector<std::shared_ptr<Plugin>> plugins;
+  std::vector<double> hx, hy, hz; // heat current of each atom
+  bool isVirial = false;
+  std::vector<double> virial; // W of each atom, row-major
+  std::vector<std::string> ipiAddress; // unix name, or inet host and port
+  std::string monitorName;
+  int monitorInterval = Ns;
+  std::vector<std::string> elements; // only used by plugins
+  std::vector<int> type;
+  int nhcLength = 0; // massive Nose-Hoover chains if > 0
+  double nhcTau;
+  std::vector<double> etaPos, etaVel; // [m * number + n]
 };
 
+// list B of the double buffer, built from a position snapshot in a helper
+// thread while the forces are still evaluated with list A in atom
+struct NeighborBuilder {
+  Atom snapshot;
+  std::thread worker;
+  std::atomic<bool> isReady{false};
+  bool isBusy = false;
+  ~NeighborBuilder()
+  {
+    if (worker.joinable())
+      worker.join();
+  }
+};
+
+// Sum of value(n) over the atoms in an order that only depends on the number
+// of atoms and atom.reductionBlock: each block of reductionBlock atoms is
+// summed in turn, with Kahan compensation if atom.isCompensated, and the block
+// sums are added pairwise in a binary tree. The kernels write per-atom values
+// rather than share one accumulator, so the sums are bit-identical for any
+// number of threads.
+template <typename Value>
+double sumAtoms(const Atom& atom, const Value& value)
+{
+  const int blockSize = atom.reductionBlock;
+  const int numBlocks = (atom.number + blockSize - 1) / blockSize;
+  std::vector<double> sums(numBlocks, 0.0);
+  for (int b = 0; b < numBlocks; ++b) {
+    const int end = std::min(atom.number, (b + 1) * blockSize);
+    double sum = 0.0;
+    double error = 0.0;
+    for (int n = b * blockSize; n < end; ++n) {
+      if (atom.isCompensated) {
+        const double y = value(n) - error;
+        const double s = sum + y;
+        error = (s - sum) - y;
+        sum = s;
+      } else {
+        sum += value(n);
+      }
+    }
+    sums[b] = sum;
+  }
+  for (int stride = 1; stride < numBlocks; stride *= 2)
+    for (int b = 0; b + stride < numBlocks; b += 2 * stride)
+      sums[b] += sums[b + stride];
+  return numBlocks > 0 ? sums[0] : 0.0;
+}
+
+// run task(begin, end) on atom.numThreads threads, each with a contiguous
+// range of atoms
+template <typename Task>
+void runOnAtoms(const Atom& atom, const Task& task)
+{
+  const int numThreads = std::min(atom.numThreads, atom.number);
+  if (numThreads <= 1) {
+    task(0, atom.number);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; ++t) {
+    const int begin = long(atom.number) * t / numThreads;
+    const int end = long(atom.number) * (t + 1) / numThreads;
+    threads.emplace_back(task, begin, end);
+  }
+  for (auto& thread : threads)
+    thread.join();
+}
+
+const int NHC_BLOCK = 64;      // atoms of a block in applyMassiveNhc
+const int NHC_MAX_LENGTH = 10; // longest chain
+
+// Massive Nose-Hoover chains: a chain of atom.nhcLength thermostats for each
+// atom, with etaPos[m * number + n] and etaVel[m * number + n] for level m of
+// atom n, so that each level is contiguous over the atoms. This is nhc() of
+// chapter-4-ensembles/nhc/md_ho_nhc.c with dN = 3 for each atom, applied to a
+// block of atoms at a time: the kinetic energies of the block are found in
+// the same pass, and the loops over a block have no branches or libm calls,
+// so that the compiler vectorizes them (wider with -march=native). Each call
+// integrates the chains over dt2 and scales the velocities.
+void applyMassiveNhc(Atom& atom, const double T0, const double dt2)
+{
+  const int M = atom.nhcLength;
+  const int N = atom.number;
+  if (int(atom.etaVel.size()) != M * N) { // chains start at rest
+    atom.etaPos.assign(M * N, 0.0);
+    atom.etaVel.assign(M * N, 0.0);
+  }
+  const double kT = K_B * T0;
+  const double dN = 3.0;
+  double Qinv[NHC_MAX_LENGTH]; // 1 / mass of each level
+  for (int m = 0; m < M; ++m)
+    Qinv[m] = 1.0 / (kT * atom.nhcTau * atom.nhcTau * (m == 0 ? dN : 1.0));
+  const double dt4 = dt2 * 0.5;
+  const double dt8 = dt4 * 0.5;
+
+  runOnAtoms(atom, [&](const int begin, const int end) {
+    double ek2[NHC_BLOCK], factor[NHC_BLOCK], G[NHC_BLOCK];
+    for (int b = begin; b < end; b += NHC_BLOCK) {
+      const int L = std::min(NHC_BLOCK, end - b);
+      double* vx = atom.vx.data() + b;
+      double* vy = atom.vy.data() + b;
+      double* vz = atom.vz.data() + b;
+      const double* mass = atom.mass.data() + b;
+      double* eta[NHC_MAX_LENGTH];
+      double* v[NHC_MAX_LENGTH];
+      for (int m = 0; m < M; ++m) {
+        eta[m] = atom.etaPos.data() + m * N + b;
+        v[m] = atom.etaVel.data() + m * N + b;
+      }
+      for (int n = 0; n < L; ++n)
+        ek2[n] = mass[n] * (vx[n] * vx[n] + vy[n] * vy[n] + vz[n] * vz[n]);
+
+      // level m driven by the kinetic energy of level m - 1 or of the atom
+      const auto update = [&](const int m) {
+        if (m == 0) {
+          for (int n = 0; n < L; ++n)
+            G[n] = ek2[n] - dN * kT;
+        } else {
+          for (int n = 0; n < L; ++n)
+            G[n] = v[m - 1][n] * v[m - 1][n] * Qinv[m - 1] - kT;
+        }
+        for (int n = 0; n < L; ++n) {
+          const double s = fastExpInRange(-dt8 * v[m + 1][n] * Qinv[m + 1]);
+          v[m][n] = s * (s * v[m][n] + dt4 * G[n]);
+        }
+      };
+      const auto updateLast = [&]() {
+        for (int n = 0; n < L; ++n)
+          v[M - 1][n] +=
+            dt4 * (v[M - 2][n] * v[M - 2][n] * Qinv[M - 2] - kT);
+      };
+
+      updateLast();
+      for (int m = M - 2; m >= 0; --m)
+        update(m);
+      for (int m = 0; m < M; ++m)
+        for (int n = 0; n < L; ++n)
+          eta[m][n] += dt2 * v[m][n] * Qinv[m];
+      for (int n = 0; n < L; ++n) {
+        factor[n] = fastExpInRange(-dt2 * v[0][n] * Qinv[0]);
+        ek2[n] *= factor[n] * factor[n];
+      }
+      for (int m = 0; m < M - 1; ++m)
+        update(m);
+      updateLast();
+      for (int n = 0; n < L; ++n) {
+        vx[n] *= factor[n];
+        vy[n] *= factor[n];
+        vz[n] *= factor[n];
+      }
+    }
+  });
+}
+
 double findKineticEnergy(const Atom& atom)
 {
-  double kineticEnergy = 0.0;
-  for (int n = 0; n < atom.number; ++n) {
+  const double kineticEnergy = sumAtoms(atom, [&](const int n) {
     double v2 = atom.vx[n] * atom.vx[n] + atom.vy[n] * atom.vy[n] +
                 atom.vz[n] * atom.vz[n];
-    kineticEnergy += atom.mass[n] * v2;
-  }
+    return atom.mass[n] * v2;
+  });
   return kineticEnergy * 0.5;
 }
 
@@ -136,14 +448,18 @@ void applyMicOne(double& x12)
     x12 -= 1.0;
 }
 
-void applyMic(const double* box, double& x12, double& y12, double& z12)
+void applyMic(
+  const double* box, const int* pbc, double& x12, double& y12, double& z12)
 {
   double sx12 = box[9] * x12 + box[10] * y12 + box[11] * z12;
   double sy12 = box[12] * x12 + box[13] * y12 + box[14] * z12;
   double sz12 = box[15] * x12 + box[16] * y12 + box[17] * z12;
-  applyMicOne(sx12);
-  applyMicOne(sy12);
-  applyMicOne(sz12);
+  if (pbc[0])
+    applyMicOne(sx12);
+  if (pbc[1])
+    applyMicOne(sy12);
+  if (pbc[2])
+    applyMicOne(sz12);
   x12 = box[0] * sx12 + box[1] * sy12 + box[2] * sz12;
   y12 = box[3] * sx12 + box[4] * sy12 + box[5] * sz12;
   z12 = box[6] * sx12 + box[7] * sy12 + box[8] * sz12;
@@ -173,21 +489,29 @@ void applyPbcOne(double& sx)
   }
 }
 
-void applyPbc(Atom& atom)
+void applyPbc(Atom& atom, const int n)
 {
-  for (int n = 0; n < atom.number; ++n) {
-    double sx = atom.box[9] * atom.x[n] + atom.box[10] * atom.y[n] +
-                atom.box[11] * atom.z[n];
-    double sy = atom.box[12] * atom.x[n] + atom.box[13] * atom.y[n] +
-                atom.box[14] * atom.z[n];
-    double sz = atom.box[15] * atom.x[n] + atom.box[16] * atom.y[n] +
-                atom.box[17] * atom.z[n];
+  double sx = atom.box[9] * atom.x[n] + atom.box[10] * atom.y[n] +
+              atom.box[11] * atom.z[n];
+  double sy = atom.box[12] * atom.x[n] + atom.box[13] * atom.y[n] +
+              atom.box[14] * atom.z[n];
+  double sz = atom.box[15] * atom.x[n] + atom.box[16] * atom.y[n] +
+              atom.box[17] * atom.z[n];
+  if (atom.pbc[0])
     applyPbcOne(sx);
+  if (atom.pbc[1])
     applyPbcOne(sy);
+  if (atom.pbc[2])
     applyPbcOne(sz);
-    atom.x[n] = atom.box[0] * sx + atom.box[1] * sy + atom.box[2] * sz;
-    atom.y[n] = atom.box[3] * sx + atom.box[4] * sy + atom.box[5] * sz;
-    atom.z[n] = atom.box[6] * sx + atom.box[7] * sy + atom.box[8] * sz;
+  atom.x[n] = atom.box[0] * sx + atom.box[1] * sy + atom.box[2] * sz;
+  atom.y[n] = atom.box[3] * sx + atom.box[4] * sy + atom.box[5] * sz;
+  atom.z[n] = atom.box[6] * sx + atom.box[7] * sy + atom.box[8] * sz;
+}
+
+void applyPbc(Atom& atom)
+{
+  for (int n = 0; n < atom.number; ++n) {
+    applyPbc(atom, n);
   }
 }
 
@@ -200,30 +524,112 @@ void updateXyz0(Atom& atom)
   }
 }
 
+// With neighbor_compress, NL is not allocated: a builder writes the
+// neighbors of atom n to the scratch row rowNL and storeNeighborRow appends
+// them, sorted, to NL8, NL16 or NL32 as offsets j - n, with 1, 2 or 4 bytes
+// per neighbor depending on the largest offset of that atom.
+void clearNeighbor(Atom& atom)
+{
+  std::fill(atom.NN.begin(), atom.NN.end(), 0);
+  if (atom.isCompressed) {
+    atom.NL8.clear();
+    atom.NL16.clear();
+    atom.NL32.clear();
+    atom.offsetNL.assign(atom.number, 0);
+    atom.widthNL.assign(atom.number, 1);
+    atom.rowNL.resize(atom.MN + 1);
+  }
+}
+
+int* getNeighborRow(Atom& atom, const int n)
+{
+  return atom.isCompressed ? atom.rowNL.data() : atom.NL.data() + n * atom.MN;
+}
+
+void storeNeighborRow(Atom& atom, const int n)
+{
+  if (!atom.isCompressed)
+    return;
+  int* neighbors = atom.rowNL.data();
+  const int numNeighbors = atom.NN[n];
+  std::sort(neighbors, neighbors + numNeighbors);
+  int maxOffset = 0;
+  for (int k = 0; k < numNeighbors; ++k)
+    maxOffset = std::max(maxOffset, abs(neighbors[k] - n));
+  if (maxOffset <= INT8_MAX) {
+    atom.widthNL[n] = 1;
+    atom.offsetNL[n] = atom.NL8.size();
+    for (int k = 0; k < numNeighbors; ++k)
+      atom.NL8.push_back(neighbors[k] - n);
+  } else if (maxOffset <= INT16_MAX) {
+    atom.widthNL[n] = 2;
+    atom.offsetNL[n] = atom.NL16.size();
+    for (int k = 0; k < numNeighbors; ++k)
+      atom.NL16.push_back(neighbors[k] - n);
+  } else {
+    atom.widthNL[n] = 4;
+    atom.offsetNL[n] = atom.NL32.size();
+    for (int k = 0; k < numNeighbors; ++k)
+      atom.NL32.push_back(neighbors[k] - n);
+  }
+}
+
+// visit(j) for each neighbor j of atom i of an Atom or a State, read in place
+// from NL or from the compressed rows
+template <typename Lists, typename Visit>
+inline void forEachNeighbor(const Lists& lists, const int i, const Visit& visit)
+{
+  const int numNeighbors = lists.NN[i];
+  if (numNeighbors == 0)
+    return;
+  if (!lists.isCompressed) {
+    const int* neighbors = &lists.NL[i * lists.MN];
+    for (int k = 0; k < numNeighbors; ++k)
+      visit(neighbors[k]);
+    return;
+  }
+  const int offset = lists.offsetNL[i];
+  if (lists.widthNL[i] == 1) {
+    const int8_t* delta = &lists.NL8[offset];
+    for (int k = 0; k < numNeighbors; ++k)
+      visit(i + delta[k]);
+  } else if (lists.widthNL[i] == 2) {
+    const int16_t* delta = &lists.NL16[offset];
+    for (int k = 0; k < numNeighbors; ++k)
+      visit(i + delta[k]);
+  } else {
+    const int* delta = &lists.NL32[offset];
+    for (int k = 0; k < numNeighbors; ++k)
+      visit(i + delta[k]);
+  }
+}
+
 void findNeighborON2(Atom& atom)
 {
   const double cutoffSquare = atom.cutoffNeighbor * atom.cutoffNeighbor;
-  std::fill(atom.NN.begin(), atom.NN.end(), 0);
+  clearNeighbor(atom);
 
   for (int i = 0; i < atom.number - 1; ++i) {
     const double x1 = atom.x[i];
     const double y1 = atom.y[i];
     const double z1 = atom.z[i];
+    int* neighbors = getNeighborRow(atom, i);
     for (int j = i + 1; j < atom.number; ++j) {
       double xij = atom.x[j] - x1;
       double yij = atom.y[j] - y1;
       double zij = atom.z[j] - z1;
-      applyMic(atom.box, xij, yij, zij);
+      applyMic(atom.box, atom.pbc, xij, yij, zij);
       const double distanceSquare = xij * xij + yij * yij + zij * zij;
       if (distanceSquare < cutoffSquare) {
-        atom.NL[i * atom.MN + atom.NN[i]++] = j;
+        neighbors[atom.NN[i]++] = j;
         if (atom.NN[i] > atom.MN) {
           std::cout << "Error: number of neighbors for atom " << i
                     << " exceeds " << atom.MN << std::endl;
-          exit(1);
+          fail();
         }
       }
     }
+    storeNeighborRow(atom, i);
   }
 }
 
@@ -249,8 +655,119 @@ void findCell(
   cell[3] = cell[0] + numCells[0] * (cell[1] + numCells[1] * cell[2]);
 }
 
+long long getCellKey(const int* cell)
+{
+  const long long offset = 1 << 20; // cells may have negative indices
+  return ((cell[0] + offset) << 42) | ((cell[1] + offset) << 21) |
+         (cell[2] + offset);
+}
+
+// Used for boxes that are open in at least one direction. Only occupied cells
+// are stored (keyed by their integer coordinates), so vacuum padding around a
+// slab or a cluster costs neither memory nor loop time.
+void findNeighborHashed(Atom& atom)
+{
+  const double cutoffInverse = 1.0 / atom.cutoffNeighbor;
+  const double cutoffSquare = atom.cutoffNeighbor * atom.cutoffNeighbor;
+  double thickness[3];
+  getThickness(atom, thickness);
+  int numCells[3];
+  for (int d = 0; d < 3; ++d) {
+    numCells[d] = floor(thickness[d] * cutoffInverse);
+    if (atom.pbc[d] && numCells[d] < 3) {
+      std::cout << "Error: box is too thin in periodic direction " << d
+                << " for the cell list." << std::endl;
+      fail();
+    }
+  }
+
+  std::vector<int> atomCell(atom.number * 3);
+  std::vector<int> cellIndex(atom.number);
+  std::vector<int> cellCount;
+  std::unordered_map<long long, int> cellMap;
+  cellMap.reserve(atom.number);
+  for (int n = 0; n < atom.number; ++n) {
+    const double r[3] = {atom.x[n], atom.y[n], atom.z[n]};
+    int* cell = atomCell.data() + n * 3;
+    for (int d = 0; d < 3; ++d) {
+      const double* g = atom.box + 9 + d * 3;
+      const double s = g[0] * r[0] + g[1] * r[1] + g[2] * r[2];
+      cell[d] = floor(s * thickness[d] * cutoffInverse);
+      if (atom.pbc[d] && cell[d] < 0)
+        cell[d] += numCells[d];
+      if (atom.pbc[d] && cell[d] >= numCells[d])
+        cell[d] -= numCells[d];
+    }
+    auto result = cellMap.emplace(getCellKey(cell), cellCount.size());
+    if (result.second)
+      cellCount.push_back(0);
+    cellIndex[n] = result.first->second;
+    ++cellCount[cellIndex[n]];
+  }
+
+  std::vector<int> cellCountSum(cellCount.size(), 0);
+  for (int i = 1; i < int(cellCount.size()); ++i) {
+    cellCountSum[i] = cellCountSum[i - 1] + cellCount[i - 1];
+  }
+  std::fill(cellCount.begin(), cellCount.end(), 0);
+  std::vector<int> cellContents(atom.number, 0);
+  for (int n = 0; n < atom.number; ++n) {
+    const int c = cellIndex[n];
+    cellContents[cellCountSum[c] + cellCount[c]++] = n;
+  }
+
+  clearNeighbor(atom);
+
+  for (int n1 = 0; n1 < atom.number; ++n1) {
+    const double r1[3] = {atom.x[n1], atom.y[n1], atom.z[n1]};
+    const int* cell = atomCell.data() + n1 * 3;
+    int* neighbors = getNeighborRow(atom, n1);
+    for (int offset = 0; offset < 27; ++offset) {
+      int neighborCell[3] = {
+        cell[0] + offset % 3 - 1, cell[1] + offset / 3 % 3 - 1,
+        cell[2] + offset / 9 - 1};
+      for (int d = 0; d < 3; ++d) {
+        if (atom.pbc[d] && neighborCell[d] < 0)
+          neighborCell[d] += numCells[d];
+        if (atom.pbc[d] && neighborCell[d] >= numCells[d])
+          neighborCell[d] -= numCells[d];
+      }
+      const auto found = cellMap.find(getCellKey(neighborCell));
+      if (found == cellMap.end())
+        continue;
+      const int c = found->second;
+      for (int m = 0; m < cellCount[c]; ++m) {
+        const int n2 = cellContents[cellCountSum[c] + m];
+        if (n1 < n2) {
+          double x12 = atom.x[n2] - r1[0];
+          double y12 = atom.y[n2] - r1[1];
+          double z12 = atom.z[n2] - r1[2];
+          applyMic(atom.box, atom.pbc, x12, y12, z12);
+          const double d2 = x12 * x12 + y12 * y12 + z12 * z12;
+          if (d2 < cutoffSquare) {
+            neighbors[atom.NN[n1]++] = n2;
+            if (atom.NN[n1] > atom.MN) {
+              std::cout << "Error: number of neighbors for atom " << n1
+                        << " exceeds " << atom.MN << std::endl;
+              fail();
+            }
+          }
+        }
+      }
+    }
+    storeNeighborRow(atom, n1);
+  }
+}
+
+// The 27 cells around a cell are distinct only with at least 3 cells along
+// each direction, i.e. a thickness of 3 * cutoffNeighbor (30 A by default);
+// in a thinner periodic box some pairs are counted more than once.
 void findNeighborON1(Atom& atom)
 {
+  if (!atom.pbc[0] || !atom.pbc[1] || !atom.pbc[2]) {
+    findNeighborHashed(atom);
+    return;
+  }
   const double cutoffInverse = 1.0 / atom.cutoffNeighbor;
   double cutoffSquare = atom.cutoffNeighbor * atom.cutoffNeighbor;
   double thickness[3];
@@ -289,11 +806,12 @@ void findNeighborON1(Atom& atom)
     ++cellCount[cell[3]];
   }
 
-  std::fill(atom.NN.begin(), atom.NN.end(), 0);
+  clearNeighbor(atom);
 
   for (int n1 = 0; n1 < atom.number; ++n1) {
     const double r1[3] = {atom.x[n1], atom.y[n1], atom.z[n1]};
     findCell(atom.box, thickness, r1, cutoffInverse, numCells, cell);
+    int* neighbors = getNeighborRow(atom, n1);
     for (int k = -1; k <= 1; ++k) {
       for (int j = -1; j <= 1; ++j) {
         for (int i = -1; i <= 1; ++i) {
@@ -317,14 +835,14 @@ void findNeighborON1(Atom& atom)
               double x12 = atom.x[n2] - r1[0];
               double y12 = atom.y[n2] - r1[1];
               double z12 = atom.z[n2] - r1[2];
-              applyMic(atom.box, x12, y12, z12);
+              applyMic(atom.box, atom.pbc, x12, y12, z12);
               const double d2 = x12 * x12 + y12 * y12 + z12 * z12;
               if (d2 < cutoffSquare) {
-                atom.NL[n1 * atom.MN + atom.NN[n1]++] = n2;
+                neighbors[atom.NN[n1]++] = n2;
                 if (atom.NN[n1] > atom.MN) {
                   std::cout << "Error: number of neighbors for atom " << n1
                             << " exceeds " << atom.MN << std::endl;
-                  exit(1);
+                  fail();
                 }
               }
             }
@@ -332,11 +850,181 @@ void findNeighborON1(Atom& atom)
         }
       }
     }
+    storeNeighborRow(atom, n1);
+  }
+}
+
+void removeNeighbor(Atom& atom, const int n1, const int n2)
+{
+  const int offset = n1 * atom.MN;
+  for (int k = 0; k < atom.NN[n1]; ++k) {
+    if (atom.NL[offset + k] == n2) {
+      atom.NL[offset + k] = atom.NL[offset + --atom.NN[n1]];
+      return;
+    }
+  }
+}
+
+void addNeighbor(Atom& atom, const int n1, const int n2)
+{
+  atom.NL[n1 * atom.MN + atom.NN[n1]++] = n2;
+  if (atom.NN[n1] > atom.MN) {
+    std::cout << "Error: number of neighbors for atom " << n1 << " exceeds "
+              << atom.MN << std::endl;
+    fail();
+  }
+}
+
+void binAtoms(Atom& atom, const double cellSize)
+{
+  const double cellSizeInverse = 1.0 / cellSize;
+  double thickness[3];
+  getThickness(atom, thickness);
+  for (int d = 0; d < 3; ++d) {
+    atom.numCells[d] = floor(thickness[d] * cellSizeInverse);
+    if (atom.numCells[d] < 3) {
+      std::cout << "Error: box is too thin for the cell grid." << std::endl;
+      fail();
+    }
+  }
+  atom.numCells[3] = atom.numCells[0] * atom.numCells[1] * atom.numCells[2];
+  atom.cellCount.assign(atom.numCells[3], 0);
+  atom.cellCountSum.assign(atom.numCells[3], 0);
+  atom.cellContents.resize(atom.number);
+
+  int cell[4];
+  for (int n = 0; n < atom.number; ++n) {
+    const double r[3] = {atom.x[n], atom.y[n], atom.z[n]};
+    findCell(atom.box, thickness, r, cellSizeInverse, atom.numCells, cell);
+    ++atom.cellCount[cell[3]];
+  }
+  for (int i = 1; i < atom.numCells[3]; ++i) {
+    atom.cellCountSum[i] = atom.cellCountSum[i - 1] + atom.cellCount[i - 1];
+  }
+  std::fill(atom.cellCount.begin(), atom.cellCount.end(), 0);
+  for (int n = 0; n < atom.number; ++n) {
+    const double r[3] = {atom.x[n], atom.y[n], atom.z[n]};
+    findCell(atom.box, thickness, r, cellSizeInverse, atom.numCells, cell);
+    atom.cellContents[atom.cellCountSum[cell[3]] + atom.cellCount[cell[3]]] = n;
+    ++atom.cellCount[cell[3]];
+  }
+}
+
+// Only the atoms that moved more than half of the skin since their own last
+// list build get new lists. A clean atom n2 may have moved up to pad[n2]
+// since then, so a pair is kept if it is within cutoffNeighbor + pad[n2].
+// The lists are half lists as for neighbor_flag 1, with each pair in the row
+// of min(n1, n2), so a dirty atom n1 is also removed from the rows of the
+// clean atoms n2 < n1 within a cell size of it. An entry left in a row
+// because the two atoms are farther apart does no harm, as the force loop
+// checks the cutoff and the pair is only added again after a removal.
+void findNeighborIncremental(Atom& atom)
+{
+  const double halfSkin = 0.5; // consistent with checkIfNeedUpdate
+  atom.dirtyAtoms.clear();
+  for (int n = 0; n < atom.number; ++n) {
+    const double dx = atom.x[n] - atom.x0[n];
+    const double dy = atom.y[n] - atom.y0[n];
+    const double dz = atom.z[n] - atom.z0[n];
+    const double d2 = dx * dx + dy * dy + dz * dz;
+    if (d2 > halfSkin * halfSkin) {
+      atom.dirtyAtoms.push_back(n);
+    }
+    atom.pad[n] = sqrt(d2);
+  }
+  const int numDirty = atom.dirtyAtoms.size();
+  if (numDirty == 0) {
+    return;
+  }
+
+  const bool isFullRebuild = numDirty > atom.rebuildFraction * atom.number;
+  if (isFullRebuild) {
+    atom.numUpdates++;
+    applyPbc(atom);
+    updateXyz0(atom);
+    atom.dirtyAtoms.resize(atom.number);
+    for (int n = 0; n < atom.number; ++n) {
+      atom.dirtyAtoms[n] = n;
+      atom.isDirty[n] = 1;
+      atom.pad[n] = 0.0;
+      atom.NN[n] = 0;
+    }
+  } else {
+    atom.numRepairs++;
+    for (int n1 : atom.dirtyAtoms) {
+      atom.isDirty[n1] = 1;
+      atom.NN[n1] = 0;
+      applyPbc(atom, n1);
+      atom.x0[n1] = atom.x[n1];
+      atom.y0[n1] = atom.y[n1];
+      atom.z0[n1] = atom.z[n1];
+      atom.pad[n1] = 0.0;
+    }
+  }
+
+  const double cellSize = atom.cutoffNeighbor + halfSkin;
+  binAtoms(atom, cellSize);
+  const int* numCells = atom.numCells;
+  double thickness[3];
+  getThickness(atom, thickness);
+  const double cellSizeInverse = 1.0 / cellSize;
+  int cell[4];
+
+  for (int n1 : atom.dirtyAtoms) {
+    const double r1[3] = {atom.x[n1], atom.y[n1], atom.z[n1]};
+    findCell(atom.box, thickness, r1, cellSizeInverse, numCells, cell);
+    for (int k = -1; k <= 1; ++k) {
+      for (int j = -1; j <= 1; ++j) {
+        for (int i = -1; i <= 1; ++i) {
+          int neighborCell = cell[3] + (k * numCells[1] + j) * numCells[0] + i;
+          if (cell[0] + i < 0)
+            neighborCell += numCells[0];
+          if (cell[0] + i >= numCells[0])
+            neighborCell -= numCells[0];
+          if (cell[1] + j < 0)
+            neighborCell += numCells[1] * numCells[0];
+          if (cell[1] + j >= numCells[1])
+            neighborCell -= numCells[1] * numCells[0];
+          if (cell[2] + k < 0)
+            neighborCell += numCells[3];
+          if (cell[2] + k >= numCells[2])
+            neighborCell -= numCells[3];
+
+          for (int m = 0; m < atom.cellCount[neighborCell]; ++m) {
+            const int n2 =
+              atom.cellContents[atom.cellCountSum[neighborCell] + m];
+            if (n2 == n1 || (n2 < n1 && atom.isDirty[n2])) {
+              continue;
+            }
+            double x12 = atom.x[n2] - r1[0];
+            double y12 = atom.y[n2] - r1[1];
+            double z12 = atom.z[n2] - r1[2];
+            applyMic(atom.box, atom.pbc, x12, y12, z12);
+            const double d2 = x12 * x12 + y12 * y12 + z12 * z12;
+            if (n2 < n1 && !isFullRebuild && d2 < cellSize * cellSize) {
+              removeNeighbor(atom, n2, n1);
+            }
+            const double cutoff = atom.cutoffNeighbor + atom.pad[n2];
+            if (d2 < cutoff * cutoff) {
+              addNeighbor(atom, std::min(n1, n2), std::max(n1, n2));
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for (int n1 : atom.dirtyAtoms) {
+    atom.isDirty[n1] = 0;
   }
 }
 
 void findNeighbor(Atom& atom)
 {
+  if (atom.neighbor_flag == 3) {
+    findNeighborIncremental(atom);
+    return;
+  }
   if (checkIfNeedUpdate(atom)) {
     atom.numUpdates++;
     applyPbc(atom);
@@ -348,83 +1036,359 @@ void findNeighbor(Atom& atom)
   }
 }
 
-void findForce(Atom& atom)
+double findMaxDisplacementSquare(const Atom& atom)
 {
-  const double epsilon = 1.032e-2;
-  const double sigma = 3.405;
-  const double cutoff = 9.0;
-  const double cutoffSquare = cutoff * cutoff;
-  const double sigma3 = sigma * sigma * sigma;
-  const double sigma6 = sigma3 * sigma3;
-  const double sigma12 = sigma6 * sigma6;
-  const double e24s6 = 24.0 * epsilon * sigma6;
-  const double e48s12 = 48.0 * epsilon * sigma12;
-  const double e4s6 = 4.0 * epsilon * sigma6;
-  const double e4s12 = 4.0 * epsilon * sigma12;
-  atom.pe = 0.0;
+  double d2max = 0.0;
   for (int n = 0; n < atom.number; ++n) {
-    atom.fx[n] = atom.fy[n] = atom.fz[n] = 0.0;
+    double dx = atom.x[n] - atom.x0[n];
+    double dy = atom.y[n] - atom.y0[n];
+    double dz = atom.z[n] - atom.z0[n];
+    applyMic(atom.box, atom.pbc, dx, dy, dz);
+    const double d2 = dx * dx + dy * dy + dz * dz;
+    if (d2 > d2max)
+      d2max = d2;
   }
+  return d2max;
+}
 
-  for (int i = 0; i < atom.number; ++i) {
-    const double xi = atom.x[i];
-    const double yi = atom.y[i];
-    const double zi = atom.z[i];
+void startNeighborBuilder(const Atom& atom, NeighborBuilder& builder)
+{
+  Atom& snapshot = builder.snapshot;
+  snapshot.number = atom.number;
+  snapshot.neighbor_flag = atom.neighbor_flag;
+  snapshot.cutoffNeighbor = atom.cutoffNeighbor;
+  std::copy(atom.box, atom.box + 18, snapshot.box);
+  std::copy(atom.pbc, atom.pbc + 3, snapshot.pbc);
+  snapshot.x = atom.x;
+  snapshot.y = atom.y;
+  snapshot.z = atom.z;
+  snapshot.isCompressed = atom.isCompressed;
+  snapshot.NN.resize(atom.number);
+  snapshot.NL.resize(atom.NL.size());
+  applyPbc(snapshot);
 
-    if (atom.neighbor_flag == 0) {
-      for (int j = i + 1; j < atom.number; ++j) {
-        double xij = atom.x[j] - xi;
-        double yij = atom.y[j] - yi;
-        double zij = atom.z[j] - zi;
-        applyMic(atom.box, xij, yij, zij);
-        const double r2 = xij * xij + yij * yij + zij * zij;
-        if (r2 > cutoffSquare)
-          continue;
+  builder.isBusy = true;
+  builder.isReady = false;
+  builder.worker = std::thread([&builder]() {
+    if (builder.snapshot.neighbor_flag == 1)
+      findNeighborON1(builder.snapshot);
+    else
+      findNeighborON2(builder.snapshot);
+    builder.isReady = true;
+  });
+}
 
-        const double r2inv = 1.0 / r2;
-        const double r4inv = r2inv * r2inv;
-        const double r6inv = r2inv * r4inv;
-        const double r8inv = r4inv * r4inv;
-        const double r12inv = r4inv * r8inv;
-        const double r14inv = r6inv * r8inv;
-        const double f_ij = e24s6 * r8inv - e48s12 * r14inv;
-        atom.pe += e4s12 * r12inv - e4s6 * r6inv;
-        atom.fx[i] += f_ij * xij;
-        atom.fx[j] -= f_ij * xij;
-        atom.fy[i] += f_ij * yij;
-        atom.fy[j] -= f_ij * yij;
-        atom.fz[i] += f_ij * zij;
-        atom.fz[j] -= f_ij * zij;
-      }
-    } else {
-      for (int jj = 0; jj < atom.NN[i]; ++jj) {
-        const int j = atom.NL[i * atom.MN + jj];
-        double xij = atom.x[j] - xi;
-        double yij = atom.y[j] - yi;
-        double zij = atom.z[j] - zi;
-        applyMic(atom.box, xij, yij, zij);
-        const double r2 = xij * xij + yij * yij + zij * zij;
-        if (r2 > cutoffSquare)
-          continue;
+// The list in use stays valid while no atom has moved more than half of the
+// skin since x0. A rebuild from a snapshot is started early, at a fraction
+// asyncFraction of that, and swapped in when it is ready. After a swap the
+// same check is made against the snapshot positions.
+void findNeighborAsync(Atom& atom, NeighborBuilder& builder)
+{
+  const double halfSkin = 0.5; // consistent with checkIfNeedUpdate
+  double d2max = findMaxDisplacementSquare(atom);
 
-        const double r2inv = 1.0 / r2;
-        const double r4inv = r2inv * r2inv;
-        const double r6inv = r2inv * r4inv;
-        const double r8inv = r4inv * r4inv;
-        const double r12inv = r4inv * r8inv;
-        const double r14inv = r6inv * r8inv;
-        const double f_ij = e24s6 * r8inv - e48s12 * r14inv;
-        atom.pe += e4s12 * r12inv - e4s6 * r6inv;
-        atom.fx[i] += f_ij * xij;
-        atom.fx[j] -= f_ij * xij;
-        atom.fy[i] += f_ij * yij;
-        atom.fy[j] -= f_ij * yij;
-        atom.fz[i] += f_ij * zij;
-        atom.fz[j] -= f_ij * zij;
-      }
-    }
+  if (builder.isBusy && (builder.isReady || d2max > halfSkin * halfSkin)) {
+    builder.worker.join();
+    builder.isBusy = false;
+    atom.numUpdates++;
+    std::swap(atom.NN, builder.snapshot.NN);
+    std::swap(atom.NL, builder.snapshot.NL);
+    std::swap(atom.NL8, builder.snapshot.NL8);
+    std::swap(atom.NL16, builder.snapshot.NL16);
+    std::swap(atom.NL32, builder.snapshot.NL32);
+    std::swap(atom.offsetNL, builder.snapshot.offsetNL);
+    std::swap(atom.widthNL, builder.snapshot.widthNL);
+    std::swap(atom.x0, builder.snapshot.x);
+    std::swap(atom.y0, builder.snapshot.y);
+    std::swap(atom.z0, builder.snapshot.z);
+    applyPbc(atom);
+    d2max = findMaxDisplacementSquare(atom);
   }
-}
+
+  if (builder.isBusy)
+    return;
+
+  if (d2max > halfSkin * halfSkin) {
+    atom.numUpdates++;
+    applyPbc(atom);
+    if (atom.neighbor_flag == 1)
+      findNeighborON1(atom);
+    else
+      findNeighborON2(atom);
+    updateXyz0(atom);
+  } else if (d2max > atom.asyncFraction * atom.asyncFraction * 0.25) {
+    startNeighborBuilder(atom, builder);
+  }
+}
+
+// W_i -= f_ij r_ij (x) r_ij, with the pair given to atom i as its energy
+inline void addPairVirial(
+  double* w, const double f_ij, const double xij, const double yij,
+  const double zij)
+{
+  const double r[3] = {xij, yij, zij};
+  for (int a = 0; a < 3; ++a)
+    for (int b = 0; b < 3; ++b)
+      w[a * 3 + b] -= f_ij * r[a] * r[b];
+}
+
+// The link-cell algorithm: no neighbor list is stored. Atoms are sorted by
+// cell into xs, ys, zs, wrapped into the box, and each cell interacts with
+// itself and 13 of its 26 neighbor cells, so that every pair is visited once.
+// Periodic images are handled by shifting whole neighbor cells.
+void findForceLinkCell(Atom& atom)
+{
+  const double cutoffSquare = LJ_CUTOFF * LJ_CUTOFF;
+  const double sigma3 = LJ_SIGMA * LJ_SIGMA * LJ_SIGMA;
+  const double sigma6 = sigma3 * sigma3;
+  const double sigma12 = sigma6 * sigma6;
+  const double e24s6 = 24.0 * LJ_EPSILON * sigma6;
+  const double e48s12 = 48.0 * LJ_EPSILON * sigma12;
+  const double e4s6 = 4.0 * LJ_EPSILON * sigma6;
+  const double e4s12 = 4.0 * LJ_EPSILON * sigma12;
+
+  double thickness[3];
+  getThickness(atom, thickness);
+  int* numCells = atom.numCells;
+  for (int d = 0; d < 3; ++d) {
+    numCells[d] = floor(thickness[d] / LJ_CUTOFF);
+    if (numCells[d] < 3) {
+      std::cout << "Error: box is too thin for the cell grid." << std::endl;
+      fail();
+    }
+  }
+  numCells[3] = numCells[0] * numCells[1] * numCells[2];
+  atom.cellCount.assign(numCells[3], 0);
+  atom.cellCountSum.assign(numCells[3], 0);
+  atom.cellContents.resize(atom.number);
+  atom.xs.resize(atom.number);
+  atom.ys.resize(atom.number);
+  atom.zs.resize(atom.number);
+  atom.fxs.assign(atom.number, 0.0);
+  atom.fys.assign(atom.number, 0.0);
+  atom.fzs.assign(atom.number, 0.0);
+  atom.es.assign(atom.number, 0.0);
+  if (atom.isVirial)
+    atom.ws.assign(atom.number * 9, 0.0);
+
+  atom.cellIndex.resize(atom.number);
+  for (int n = 0; n < atom.number; ++n) {
+    const double r[3] = {atom.x[n], atom.y[n], atom.z[n]};
+    int cell[3];
+    for (int d = 0; d < 3; ++d) {
+      double s = atom.box[9 + d * 3] * r[0] + atom.box[10 + d * 3] * r[1] +
+                 atom.box[11 + d * 3] * r[2];
+      s -= floor(s);
+      cell[d] = s * numCells[d];
+      if (cell[d] >= numCells[d])
+        cell[d] = numCells[d] - 1;
+    }
+    atom.cellIndex[n] =
+      cell[0] + numCells[0] * (cell[1] + numCells[1] * cell[2]);
+    ++atom.cellCount[atom.cellIndex[n]];
+  }
+  for (int i = 1; i < numCells[3]; ++i) {
+    atom.cellCountSum[i] = atom.cellCountSum[i - 1] + atom.cellCount[i - 1];
+  }
+  std::fill(atom.cellCount.begin(), atom.cellCount.end(), 0);
+  for (int n = 0; n < atom.number; ++n) {
+    const int c = atom.cellIndex[n];
+    const int k = atom.cellCountSum[c] + atom.cellCount[c]++;
+    atom.cellContents[k] = n;
+    double sx = atom.box[9] * atom.x[n] + atom.box[10] * atom.y[n] +
+                atom.box[11] * atom.z[n];
+    double sy = atom.box[12] * atom.x[n] + atom.box[13] * atom.y[n] +
+                atom.box[14] * atom.z[n];
+    double sz = atom.box[15] * atom.x[n] + atom.box[16] * atom.y[n] +
+                atom.box[17] * atom.z[n];
+    sx -= floor(sx);
+    sy -= floor(sy);
+    sz -= floor(sz);
+    atom.xs[k] = atom.box[0] * sx + atom.box[1] * sy + atom.box[2] * sz;
+    atom.ys[k] = atom.box[3] * sx + atom.box[4] * sy + atom.box[5] * sz;
+    atom.zs[k] = atom.box[6] * sx + atom.box[7] * sy + atom.box[8] * sz;
+  }
+
+  const double* xs = atom.xs.data();
+  const double* ys = atom.ys.data();
+  const double* zs = atom.zs.data();
+  double* fxs = atom.fxs.data();
+  double* fys = atom.fys.data();
+  double* fzs = atom.fzs.data();
+  double* es = atom.es.data();
+
+  for (int cz = 0; cz < numCells[2]; ++cz) {
+    for (int cy = 0; cy < numCells[1]; ++cy) {
+      for (int cx = 0; cx < numCells[0]; ++cx) {
+        const int c1 = cx + numCells[0] * (cy + numCells[1] * cz);
+        const int begin1 = atom.cellCountSum[c1];
+        const int end1 = begin1 + atom.cellCount[c1];
+
+        for (int offset = 0; offset < 14; ++offset) {
+          // offset 0 is the cell itself and 1-13 form the half stencil
+          const int t = offset + 13;
+          int c[3] = {cx + t % 3 - 1, cy + t / 3 % 3 - 1, cz + t / 9 - 1};
+          int wrap[3] = {0, 0, 0};
+          for (int d = 0; d < 3; ++d) {
+            if (c[d] < 0) {
+              c[d] += numCells[d];
+              wrap[d] = -1;
+            } else if (c[d] >= numCells[d]) {
+              c[d] -= numCells[d];
+              wrap[d] = 1;
+            }
+          }
+          double shift[3];
+          for (int d = 0; d < 3; ++d) {
+            shift[d] = atom.box[d * 3] * wrap[0] +
+                       atom.box[d * 3 + 1] * wrap[1] +
+                       atom.box[d * 3 + 2] * wrap[2];
+          }
+          const int c2 = c[0] + numCells[0] * (c[1] + numCells[1] * c[2]);
+          const int begin2 = atom.cellCountSum[c2];
+          const int end2 = begin2 + atom.cellCount[c2];
+
+          for (int i = begin1; i < end1; ++i) {
+            const double xi = xs[i] - shift[0];
+            const double yi = ys[i] - shift[1];
+            const double zi = zs[i] - shift[2];
+            double fxi = 0.0;
+            double fyi = 0.0;
+            double fzi = 0.0;
+            double ei = 0.0;
+            for (int j = (offset == 0 ? i + 1 : begin2); j < end2; ++j) {
+              const double xij = xs[j] - xi;
+              const double yij = ys[j] - yi;
+              const double zij = zs[j] - zi;
+              const double r2 = xij * xij + yij * yij + zij * zij;
+              if (r2 > cutoffSquare)
+                continue;
+
+              const double r2inv = 1.0 / r2;
+              const double r4inv = r2inv * r2inv;
+              const double r6inv = r2inv * r4inv;
+              const double r8inv = r4inv * r4inv;
+              const double r12inv = r4inv * r8inv;
+              const double r14inv = r6inv * r8inv;
+              const double f_ij = e24s6 * r8inv - e48s12 * r14inv;
+              ei += e4s12 * r12inv - e4s6 * r6inv;
+              fxi += f_ij * xij;
+              fxs[j] -= f_ij * xij;
+              fyi += f_ij * yij;
+              fys[j] -= f_ij * yij;
+              fzi += f_ij * zij;
+              fzs[j] -= f_ij * zij;
+              if (atom.isVirial)
+                addPairVirial(atom.ws.data() + i * 9, f_ij, xij, yij, zij);
+            }
+            fxs[i] += fxi;
+            fys[i] += fyi;
+            fzs[i] += fzi;
+            es[i] += ei;
+          }
+        }
+      }
+    }
+  }
+
+  for (int k = 0; k < atom.number; ++k) {
+    const int n = atom.cellContents[k];
+    atom.fx[n] = fxs[k];
+    atom.fy[n] = fys[k];
+    atom.fz[n] = fzs[k];
+    atom.energy[n] = es[k];
+    if (atom.isVirial)
+      std::copy(
+        atom.ws.begin() + k * 9, atom.ws.begin() + k * 9 + 9,
+        atom.virial.begin() + n * 9);
+  }
+  atom.pe = sumAtoms(atom, [&](const int n) { return atom.energy[n]; });
+}
+
+void findForce(Atom& atom)
+{
+  if (atom.neighbor_flag == 4) {
+    findForceLinkCell(atom);
+    return;
+  }
+
+  const double cutoffSquare = LJ_CUTOFF * LJ_CUTOFF;
+  const double sigma3 = LJ_SIGMA * LJ_SIGMA * LJ_SIGMA;
+  const double sigma6 = sigma3 * sigma3;
+  const double sigma12 = sigma6 * sigma6;
+  const double e24s6 = 24.0 * LJ_EPSILON * sigma6;
+  const double e48s12 = 48.0 * LJ_EPSILON * sigma12;
+  const double e4s6 = 4.0 * LJ_EPSILON * sigma6;
+  const double e4s12 = 4.0 * LJ_EPSILON * sigma12;
+  for (int n = 0; n < atom.number; ++n) {
+    atom.fx[n] = atom.fy[n] = atom.fz[n] = atom.energy[n] = 0.0;
+  }
+  if (atom.isVirial)
+    std::fill(atom.virial.begin(), atom.virial.end(), 0.0);
+
+  for (int i = 0; i < atom.number; ++i) {
+    const double xi = atom.x[i];
+    const double yi = atom.y[i];
+    const double zi = atom.z[i];
+
+    if (atom.neighbor_flag == 0) {
+      for (int j = i + 1; j < atom.number; ++j) {
+        double xij = atom.x[j] - xi;
+        double yij = atom.y[j] - yi;
+        double zij = atom.z[j] - zi;
+        applyMic(atom.box, atom.pbc, xij, yij, zij);
+        const double r2 = xij * xij + yij * yij + zij * zij;
+        if (r2 > cutoffSquare)
+          continue;
+
+        const double r2inv = 1.0 / r2;
+        const double r4inv = r2inv * r2inv;
+        const double r6inv = r2inv * r4inv;
+        const double r8inv = r4inv * r4inv;
+        const double r12inv = r4inv * r8inv;
+        const double r14inv = r6inv * r8inv;
+        const double f_ij = e24s6 * r8inv - e48s12 * r14inv;
+        atom.energy[i] += e4s12 * r12inv - e4s6 * r6inv;
+        atom.fx[i] += f_ij * xij;
+        atom.fx[j] -= f_ij * xij;
+        atom.fy[i] += f_ij * yij;
+        atom.fy[j] -= f_ij * yij;
+        atom.fz[i] += f_ij * zij;
+        atom.fz[j] -= f_ij * zij;
+        if (atom.isVirial)
+          addPairVirial(atom.virial.data() + i * 9, f_ij, xij, yij, zij);
+      }
+    } else {
+      forEachNeighbor(atom, i, [&](const int j) {
+        double xij = atom.x[j] - xi;
+        double yij = atom.y[j] - yi;
+        double zij = atom.z[j] - zi;
+        applyMic(atom.box, atom.pbc, xij, yij, zij);
+        const double r2 = xij * xij + yij * yij + zij * zij;
+        if (r2 > cutoffSquare)
+          return;
+
+        const double r2inv = 1.0 / r2;
+        const double r4inv = r2inv * r2inv;
+        const double r6inv = r2inv * r4inv;
+        const double r8inv = r4inv * r4inv;
+        const double r12inv = r4inv * r8inv;
+        const double r14inv = r6inv * r8inv;
+        const double f_ij = e24s6 * r8inv - e48s12 * r14inv;
+        atom.energy[i] += e4s12 * r12inv - e4s6 * r6inv;
+        atom.fx[i] += f_ij * xij;
+        atom.fx[j] -= f_ij * xij;
+        atom.fy[i] += f_ij * yij;
+        atom.fy[j] -= f_ij * yij;
+        atom.fz[i] += f_ij * zij;
+        atom.fz[j] -= f_ij * zij;
+        if (atom.isVirial)
+          addPairVirial(atom.virial.data() + i * 9, f_ij, xij, yij, zij);
+      });
+    }
+  }
+  atom.pe = sumAtoms(atom, [&](const int n) { return atom.energy[n]; });
+}
 
 void integrate(const bool isStepOne, const double timeStep, Atom& atom)
 {
@@ -445,6 +1409,159 @@ void integrate(const bool isStepOne, const double timeStep, Atom& atom)
   }
 }
 
+// Largest step (not above timeStepMax) for which no atom moves more than
+// maxDisplacement and no atom changes its kinetic energy by more than
+// maxEnergyChange, estimated from the current velocities and forces.
+double findTimeStep(const Atom& atom, const double timeStepMax)
+{
+  double v2max = 0.0;
+  double a2max = 0.0;
+  double powerMax = 0.0;
+  for (int n = 0; n < atom.number; ++n) {
+    const double v2 = atom.vx[n] * atom.vx[n] + atom.vy[n] * atom.vy[n] +
+                      atom.vz[n] * atom.vz[n];
+    const double f2 = atom.fx[n] * atom.fx[n] + atom.fy[n] * atom.fy[n] +
+                      atom.fz[n] * atom.fz[n];
+    const double power = std::abs(
+      atom.fx[n] * atom.vx[n] + atom.fy[n] * atom.vy[n] +
+      atom.fz[n] * atom.vz[n]);
+    v2max = std::max(v2max, v2);
+    a2max = std::max(a2max, f2 / (atom.mass[n] * atom.mass[n]));
+    powerMax = std::max(powerMax, power);
+  }
+  double timeStep = timeStepMax;
+  if (v2max > 0.0)
+    timeStep = std::min(timeStep, atom.maxDisplacement / sqrt(v2max));
+  if (a2max > 0.0)
+    timeStep =
+      std::min(timeStep, sqrt(2.0 * atom.maxDisplacement / sqrt(a2max)));
+  if (atom.maxEnergyChange > 0.0 && powerMax > 0.0)
+    timeStep = std::min(timeStep, atom.maxEnergyChange / powerMax);
+  return timeStep;
+}
+
+double getCpuTime(const clock_t tStart)
+{
+  return double(clock() - tStart) / CLOCKS_PER_SEC;
+}
+
+// steps between two rebuilds if the fastest atom moves ballistically through
+// half of the 1 A skin
+double estimateUpdateInterval(const Atom& atom, const double timeStep)
+{
+  double v2max = 0.0;
+  for (int n = 0; n < atom.number; ++n) {
+    const double v2 = atom.vx[n] * atom.vx[n] + atom.vy[n] * atom.vy[n] +
+                      atom.vz[n] * atom.vz[n];
+    v2max = std::max(v2max, v2);
+  }
+  if (v2max == 0.0)
+    return 1.0e10;
+  return std::max(1.0, 0.5 / (sqrt(v2max) * timeStep));
+}
+
+// time each feasible builder once and its force kernel twice (keep the
+// faster one) on the actual input; a negative time marks an infeasible flag.
+// Above NmaxON2 atoms, the O(N^2) flags 0 and 2 are not timed (their one-off
+// cost would exceed the run) unless no other flag is feasible.
+void calibrateNeighbor(Atom& atom)
+{
+  const std::vector<double> fx = atom.fx, fy = atom.fy, fz = atom.fz;
+  const int numUpdates = atom.numUpdates;
+  double thickness[3];
+  getThickness(atom, thickness);
+  double minThickness = 1.0e10; // over the periodic directions
+  for (int d = 0; d < 3; ++d) {
+    if (atom.pbc[d])
+      minThickness = std::min(minThickness, thickness[d]);
+  }
+  const bool isPeriodic = atom.pbc[0] && atom.pbc[1] && atom.pbc[2];
+  const bool canON1 = minThickness >= 3.0 * atom.cutoffNeighbor;
+  const bool canLinkCell = isPeriodic && minThickness >= 3.0 * LJ_CUTOFF &&
+                           atom.asyncFraction == 0.0;
+  const bool skipON2 = atom.number > NmaxON2 && (canON1 || canLinkCell);
+
+  applyPbc(atom);
+  for (int flag = 0; flag < 5; ++flag) {
+    atom.buildTime[flag] = atom.forceTime[flag] = -1.0;
+    if ((flag == 0 || flag == 2) && skipON2)
+      continue;
+    if (flag == 1 && !canON1)
+      continue;
+    if (flag == 3) // its cost depends on how many atoms move
+      continue;
+    if (flag == 4 && !canLinkCell)
+      continue;
+    if (atom.asyncFraction > 0 && flag != 1 && flag != 2)
+      continue;
+    atom.neighbor_flag = flag;
+    clock_t tStart = clock();
+    if (flag == 1)
+      findNeighborON1(atom);
+    else if (flag == 2)
+      findNeighborON2(atom);
+    atom.buildTime[flag] = getCpuTime(tStart);
+    for (int repeat = 0; repeat < 2; ++repeat) {
+      tStart = clock();
+      findForce(atom);
+      const double t = getCpuTime(tStart);
+      if (repeat == 0 || t < atom.forceTime[flag])
+        atom.forceTime[flag] = t;
+    }
+    std::cout << "neighbor_flag " << flag << ": build "
+              << atom.buildTime[flag] << " s, force " << atom.forceTime[flag]
+              << " s" << std::endl;
+  }
+
+  atom.fx = fx;
+  atom.fy = fy;
+  atom.fz = fz;
+  atom.numUpdates = numUpdates;
+}
+
+int chooseNeighborFlag(const Atom& atom, const double updateInterval)
+{
+  int bestFlag = -1;
+  double bestTime = 0.0;
+  for (int flag = 0; flag < 5; ++flag) {
+    if (atom.forceTime[flag] < 0.0)
+      continue;
+    const double t =
+      atom.forceTime[flag] + atom.buildTime[flag] / updateInterval;
+    if (bestFlag < 0 || t < bestTime) {
+      bestFlag = flag;
+      bestTime = t;
+    }
+  }
+  return bestFlag;
+}
+
+void setNeighborFlag(Atom& atom, const int flag)
+{
+  atom.neighbor_flag = flag;
+  if (flag == 1 || flag == 2) {
+    atom.numUpdates++;
+    applyPbc(atom);
+    if (flag == 1)
+      findNeighborON1(atom);
+    else
+      findNeighborON2(atom);
+    updateXyz0(atom);
+  }
+}
+
+void chooseNeighborAuto(Atom& atom, const double timeStep, const int step)
+{
+  const double updateInterval = estimateUpdateInterval(atom, timeStep);
+  const int flag = chooseNeighborFlag(atom, updateInterval);
+  if (step == 0 || flag != atom.neighbor_flag) {
+    std::cout << "step " << step << ": neighbor_flag auto chooses " << flag
+              << " (about " << updateInterval << " steps between updates)"
+              << std::endl;
+    setNeighborFlag(atom, flag);
+  }
+}
+
 std::vector<std::string> getTokens(std::ifstream& input)
 {
   std::string line;
@@ -463,21 +1580,1078 @@ int getInt(std::string& token)
     value = std::stoi(token);
   } catch (const std::exception& e) {
     std::cout << "Standard exception:" << e.what() << std::endl;
-    exit(1);
+    fail();
   }
   return value;
 }
 
 double getDouble(std::string& token)
 {
-  float value = 0;
+  double value = 0;
   try {
     value = std::stod(token);
   } catch (const std::exception& e) {
     std::cout << "Standard exception:" << e.what() << std::endl;
-    exit(1);
+    fail();
+  }
+  return value;
+}
+
+// lattice fcc|bcc|diamond|hcp|graphene a nx ny nz element mass [options]
+// lattice custom ax ay az bx by bz cx cy cz nx ny nz [options]
+// where the basis atoms of custom come from basis element mass sa sb sc
+// lines; the options are c (of hcp and graphene), displace amplitude,
+// vacancy fraction, alloy element mass fraction and seed
+void readLattice(std::vector<std::string>& tokens, Lattice& lattice)
+{
+  const int numTokens = tokens.size();
+  if (numTokens < 2) {
+    std::cout << "lattice needs a name." << std::endl;
+    fail();
+  }
+  lattice.name = tokens[1];
+  const bool isCustom = lattice.name == "custom";
+  const int numFixed = isCustom ? 14 : 8;
+  if (numTokens < numFixed) {
+    std::cout << "lattice " << lattice.name << " should have " << numFixed - 2
+              << " parameters." << std::endl;
+    fail();
+  }
+  double a = 0.0;
+  if (isCustom) {
+    for (int k = 0; k < 9; ++k)
+      lattice.cell[k] = getDouble(tokens[2 + k]);
+  } else {
+    a = getDouble(tokens[2]);
+  }
+  for (int d = 0; d < 3; ++d) {
+    lattice.size[d] = getInt(tokens[(isCustom ? 11 : 3) + d]);
+    if (lattice.size[d] < 1) {
+      std::cout << "lattice sizes should >= 1." << std::endl;
+      fail();
+    }
+  }
+
+  double c = 0.0;
+  for (int k = numFixed; k < numTokens && tokens[k][0] != '#';) {
+    const std::string& option = tokens[k];
+    const int numValues = option == "alloy" ? 3 : 1;
+    if (k + numValues >= numTokens) {
+      std::cout << "lattice option " << option << " needs " << numValues
+                << " values." << std::endl;
+      fail();
+    }
+    if (option == "c") {
+      c = getDouble(tokens[k + 1]);
+    } else if (option == "displace") {
+      lattice.displacement = getDouble(tokens[k + 1]);
+    } else if (option == "vacancy") {
+      lattice.vacancyFraction = getDouble(tokens[k + 1]);
+    } else if (option == "alloy") {
+      lattice.alloyElement = tokens[k + 1];
+      lattice.alloyMass = getDouble(tokens[k + 2]);
+      lattice.alloyFraction = getDouble(tokens[k + 3]);
+    } else if (option == "seed") {
+      lattice.seed = getInt(tokens[k + 1]);
+    } else {
+      std::cout << option << " is not a valid lattice option." << std::endl;
+      fail();
+    }
+    k += numValues + 1;
+  }
+  if (
+    lattice.vacancyFraction < 0 || lattice.vacancyFraction >= 1 ||
+    lattice.alloyFraction < 0 || lattice.alloyFraction > 1) {
+    std::cout << "vacancy should be in [0, 1) and alloy in [0, 1]."
+              << std::endl;
+    fail();
+  }
+  if (isCustom)
+    return;
+
+  const double cubic[9] = {a, 0.0, 0.0, 0.0, a, 0.0, 0.0, 0.0, a};
+  const double hexagonal[9] = {a, 0.0, 0.0, a * 0.5, a * sqrt(3.0) * 0.5, 0.0,
+                               0.0, 0.0, 1.0};
+  const double third = 1.0 / 3.0;
+  if (lattice.name == "fcc" || lattice.name == "diamond") {
+    std::copy(cubic, cubic + 9, lattice.cell);
+    lattice.basis = {
+      0.0, 0.0, 0.0, 0.0, 0.5, 0.5, 0.5, 0.0, 0.5, 0.5, 0.5, 0.0};
+    if (lattice.name == "diamond") {
+      for (int k = 0; k < 12; ++k)
+        lattice.basis.push_back(lattice.basis[k] + 0.25);
+    }
+  } else if (lattice.name == "bcc") {
+    std::copy(cubic, cubic + 9, lattice.cell);
+    lattice.basis = {0.0, 0.0, 0.0, 0.5, 0.5, 0.5};
+  } else if (lattice.name == "hcp") {
+    std::copy(hexagonal, hexagonal + 9, lattice.cell);
+    lattice.cell[8] = c > 0.0 ? c : a * sqrt(8.0 / 3.0); // ideal c / a
+    lattice.basis = {0.0, 0.0, 0.0, third, third, 0.5};
+  } else if (lattice.name == "graphene") {
+    // a sheet in the xy plane, with a free z direction
+    std::copy(hexagonal, hexagonal + 9, lattice.cell);
+    lattice.cell[8] = c > 0.0 ? c : 10.0;
+    lattice.basis = {0.0, 0.0, 0.5, third, third, 0.5};
+    lattice.pbc[2] = 0;
+  } else {
+    std::cout << "lattice can only be fcc, bcc, diamond, hcp, graphene or "
+                 "custom."
+              << std::endl;
+    fail();
+  }
+  if (c > 0.0 && lattice.name != "hcp" && lattice.name != "graphene") {
+    std::cout << "c is only for hcp and graphene." << std::endl;
+    fail();
+  }
+  const int numBasis = lattice.basis.size() / 3;
+  lattice.elements.assign(numBasis, tokens[6]);
+  lattice.masses.assign(numBasis, getDouble(tokens[7]));
+}
+
+State getState(const Atom& atom, const double time)
+{
+  State state;
+  state.number = atom.number;
+  state.time = time;
+  state.box = atom.box;
+  state.pbc = atom.pbc;
+  state.pe = atom.pe;
+  state.mass = atom.mass;
+  state.x = atom.x;
+  state.y = atom.y;
+  state.z = atom.z;
+  state.vx = atom.vx;
+  state.vy = atom.vy;
+  state.vz = atom.vz;
+  state.fx = atom.fx;
+  state.fy = atom.fy;
+  state.fz = atom.fz;
+  state.energy = atom.energy;
+  state.type = atom.type;
+  if (atom.neighbor_flag >= 1 && atom.neighbor_flag <= 3) {
+    state.NN = atom.NN;
+    state.NL = atom.NL;
+    state.isCompressed = atom.isCompressed;
+    state.NL8 = atom.NL8;
+    state.NL16 = atom.NL16;
+    state.NL32 = atom.NL32;
+    state.offsetNL = atom.offsetNL;
+    state.widthNL = atom.widthNL;
+  }
+  state.MN = atom.MN;
+  state.cutoffList = atom.cutoffNeighbor - 1.0; // 0.5 A of each atom
+  return state;
+}
+
+// pair(i, j, xij, yij, zij, r2) for each pair within cutoff, in the order of
+// i; from the neighbor list if it has all of them and from all pairs if not
+template <typename Pair>
+void forEachPair(const State& state, const double cutoff, const Pair& pair)
+{
+  const double cutoffSquare = cutoff * cutoff;
+  const bool useList = state.NN.size > 0 && cutoff <= state.cutoffList;
+  for (int i = 0; i < state.number; ++i) {
+    const auto visit = [&](const int j) {
+      if (j <= i)
+        return;
+      double xij = state.x[j] - state.x[i];
+      double yij = state.y[j] - state.y[i];
+      double zij = state.z[j] - state.z[i];
+      applyMic(state.box, state.pbc, xij, yij, zij);
+      const double r2 = xij * xij + yij * yij + zij * zij;
+      if (r2 < cutoffSquare)
+        pair(i, j, xij, yij, zij, r2);
+    };
+    if (useList) {
+      forEachNeighbor(state, i, visit);
+    } else {
+      for (int j = i + 1; j < state.number; ++j)
+        visit(j);
+    }
+  }
+}
+
+// the potential part of the heat current of the LJ potential, as in
+// kappa_emd, summed per atom and then with sumAtoms
+void findHeatCurrent(Atom& atom, const State& state, double* hc)
+{
+  const double sigma3 = LJ_SIGMA * LJ_SIGMA * LJ_SIGMA;
+  const double sigma6 = sigma3 * sigma3;
+  const double sigma12 = sigma6 * sigma6;
+  const double e24s6 = 24.0 * LJ_EPSILON * sigma6;
+  const double e48s12 = 48.0 * LJ_EPSILON * sigma12;
+  atom.hx.assign(atom.number, 0.0);
+  atom.hy.assign(atom.number, 0.0);
+  atom.hz.assign(atom.number, 0.0);
+  forEachPair(
+    state, LJ_CUTOFF,
+    [&](
+      const int i, const int j, const double xij, const double yij,
+      const double zij, const double r2) {
+      const double r2inv = 1.0 / r2;
+      const double r4inv = r2inv * r2inv;
+      const double r8inv = r4inv * r4inv;
+      const double r14inv = r2inv * r4inv * r8inv;
+      const double f_ij = e24s6 * r8inv - e48s12 * r14inv;
+      double f_dot_v = xij * (atom.vx[i] + atom.vx[j]) +
+                       yij * (atom.vy[i] + atom.vy[j]) +
+                       zij * (atom.vz[i] + atom.vz[j]);
+      f_dot_v *= f_ij * 0.5;
+      atom.hx[i] -= xij * f_dot_v;
+      atom.hy[i] -= yij * f_dot_v;
+      atom.hz[i] -= zij * f_dot_v;
+    });
+  hc[0] = sumAtoms(atom, [&](const int n) { return atom.hx[n]; });
+  hc[1] = sumAtoms(atom, [&](const int n) { return atom.hy[n]; });
+  hc[2] = sumAtoms(atom, [&](const int n) { return atom.hz[n]; });
+}
+
+void runPlugins(Atom& atom, const int step, const double time)
+{
+  bool isSampled = false;
+  bool needsHeatCurrent = false;
+  for (const auto& plugin : atom.plugins) {
+    if (step % plugin->interval == 0) {
+      isSampled = true;
+      needsHeatCurrent = needsHeatCurrent || plugin->needsHeatCurrent;
+    }
+  }
+  if (!isSampled)
+    return;
+
+  State state = getState(atom, time);
+  double hc[3];
+  if (needsHeatCurrent) {
+    findHeatCurrent(atom, state, hc);
+    state.hc = hc;
+  }
+  for (const auto& plugin : atom.plugins) {
+    if (step % plugin->interval == 0)
+      plugin->on_step(step, state);
+  }
+}
+
+// columns of %25.15e as in the output files of the chapter 5 drivers
+void writeColumns(std::ofstream& output, const double* values, const int n)
+{
+  char text[32];
+  for (int k = 0; k < n; ++k) {
+    snprintf(text, sizeof(text), "%25.15e", values[k]);
+    output << text;
+  }
+  output << "\n";
+}
+
+// plugin rdf interval rmax numBins: g(r) in rdf.out
+struct RdfPlugin : Plugin {
+  double rmax;
+  std::vector<double> histogram;
+  double volume;
+  int number;
+  int numSamples = 0;
+
+  RdfPlugin(const int numBins, const double rmax)
+    : rmax(rmax), histogram(numBins, 0.0)
+  {
+  }
+
+  void begin(const Run& run) override
+  {
+    volume = std::abs(getDet(run.box));
+    number = run.number;
+  }
+
+  void on_step(const int, const State& state) override
+  {
+    const double binSize = rmax / histogram.size();
+    forEachPair(
+      state, rmax,
+      [&](
+        const int, const int, const double, const double, const double,
+        const double r2) {
+        const int bin =
+          std::min(int(sqrt(r2) / binSize), int(histogram.size()) - 1);
+        histogram[bin] += 2.0;
+      });
+    ++numSamples;
+  }
+
+  void end() override
+  {
+    std::ofstream output("rdf.out");
+    const double binSize = rmax / histogram.size();
+    const double density = number / volume;
+    for (int k = 0; k < int(histogram.size()); ++k) {
+      const double r1 = k * binSize;
+      const double r2 = r1 + binSize;
+      const double shell = 4.0 / 3.0 * M_PI * (r2 * r2 * r2 - r1 * r1 * r1);
+      const double values[2] = {
+        r1 + 0.5 * binSize,
+        histogram[k] / (numSamples * number * density * shell)};
+      writeColumns(output, values, 2);
+    }
+  }
+};
+
+// time correlations of a quantity q sampled at the plugin interval: the last
+// numCorrelations samples are kept and correlated with each new sample
+struct CorrelationPlugin : Plugin {
+  int numCorrelations;
+  int numSamples = 0;
+  double timeInterval; // in natural units
+  std::vector<double> sums[3];
+  std::vector<int> counts;
+
+  CorrelationPlugin(const int numCorrelations)
+    : numCorrelations(numCorrelations), counts(numCorrelations, 0)
+  {
+    for (int d = 0; d < 3; ++d)
+      sums[d].assign(numCorrelations, 0.0);
+  }
+
+  void begin(const Run& run) override
+  {
+    if (run.isAdaptive) {
+      std::cout << "Correlation plugins need a fixed time step." << std::endl;
+      fail();
+    }
+    timeInterval = run.timeStep * interval;
+  }
+};
+
+// plugin msd interval numCorrelations: the mean square displacement in
+// msd.out, as in md_diffusion; the positions are unwrapped with the minimum
+// image displacements between samples, which should be below half the box
+struct MsdPlugin : CorrelationPlugin {
+  std::vector<double> lastSample, unwrapped, history;
+
+  using CorrelationPlugin::CorrelationPlugin;
+
+  void on_step(const int, const State& state) override
+  {
+    const int N = state.number;
+    if (numSamples == 0) {
+      lastSample.resize(N * 3);
+      unwrapped.resize(N * 3);
+      history.resize(N * 3 * numCorrelations);
+      for (int n = 0; n < N; ++n) {
+        unwrapped[n] = state.x[n];
+        unwrapped[n + N] = state.y[n];
+        unwrapped[n + N * 2] = state.z[n];
+      }
+    } else {
+      for (int n = 0; n < N; ++n) {
+        double dx = state.x[n] - lastSample[n];
+        double dy = state.y[n] - lastSample[n + N];
+        double dz = state.z[n] - lastSample[n + N * 2];
+        applyMic(state.box, state.pbc, dx, dy, dz);
+        unwrapped[n] += dx;
+        unwrapped[n + N] += dy;
+        unwrapped[n + N * 2] += dz;
+      }
+    }
+    for (int n = 0; n < N; ++n) {
+      lastSample[n] = state.x[n];
+      lastSample[n + N] = state.y[n];
+      lastSample[n + N * 2] = state.z[n];
+    }
+    std::copy(
+      unwrapped.begin(), unwrapped.end(),
+      history.begin() + numSamples % numCorrelations * N * 3);
+
+    for (int nc = 0; nc < std::min(numSamples + 1, numCorrelations); ++nc) {
+      const double* old =
+        history.data() + (numSamples - nc) % numCorrelations * N * 3;
+      for (int d = 0; d < 3; ++d) {
+        double sum = 0.0;
+        for (int n = 0; n < N; ++n) {
+          const double dr = unwrapped[n + N * d] - old[n + N * d];
+          sum += dr * dr;
+        }
+        sums[d][nc] += sum / N;
+      }
+      ++counts[nc];
+    }
+    ++numSamples;
+  }
+
+  void end() override
+  {
+    std::ofstream output("msd.out");
+    for (int nc = 0; nc < numCorrelations && counts[nc] > 0; ++nc) {
+      const double values[4] = {
+        nc * timeInterval * TIME_UNIT_CONVERSION / 1000.0, // ps
+        sums[0][nc] / counts[nc], sums[1][nc] / counts[nc],
+        sums[2][nc] / counts[nc]};
+      writeColumns(output, values, 4);
+    }
+  }
+};
+
+// plugin hac interval numCorrelations: the heat current autocorrelation and
+// the running thermal conductivity in W/(mK) in hac.out, as in kappa_emd,
+// at the average temperature of the samples
+struct HacPlugin : CorrelationPlugin {
+  std::vector<double> history;
+  double volume;
+  double temperatureSum = 0.0;
+
+  HacPlugin(const int numCorrelations) : CorrelationPlugin(numCorrelations)
+  {
+    needsHeatCurrent = true;
+    history.resize(numCorrelations * 3);
+  }
+
+  void begin(const Run& run) override
+  {
+    CorrelationPlugin::begin(run);
+    volume = std::abs(getDet(run.box));
+  }
+
+  void on_step(const int, const State& state) override
+  {
+    double* hc = history.data() + numSamples % numCorrelations * 3;
+    std::copy(state.hc, state.hc + 3, hc);
+    for (int nc = 0; nc < std::min(numSamples + 1, numCorrelations); ++nc) {
+      const double* old =
+        history.data() + (numSamples - nc) % numCorrelations * 3;
+      for (int d = 0; d < 3; ++d)
+        sums[d][nc] += hc[d] * old[d];
+      ++counts[nc];
+    }
+
+    double kineticEnergy = 0.0;
+    for (int n = 0; n < state.number; ++n) {
+      kineticEnergy += state.mass[n] * (state.vx[n] * state.vx[n] +
+                                        state.vy[n] * state.vy[n] +
+                                        state.vz[n] * state.vz[n]);
+    }
+    temperatureSum += kineticEnergy / (3.0 * K_B * state.number);
+    ++numSamples;
+  }
+
+  void end() override
+  {
+    if (numSamples == 0)
+      return;
+    const double temperature = temperatureSum / numSamples;
+    const double factor = timeInterval * 0.5 * KAPPA_UNIT_CONVERSION /
+                          (K_B * temperature * temperature * volume);
+    std::ofstream output("hac.out");
+    double hac[3], rtc[3] = {0.0, 0.0, 0.0}, hacOld[3];
+    for (int nc = 0; nc < numCorrelations && counts[nc] > 0; ++nc) {
+      for (int d = 0; d < 3; ++d) {
+        hac[d] = sums[d][nc] / counts[nc];
+        if (nc > 0)
+          rtc[d] += (hacOld[d] + hac[d]) * factor;
+        hacOld[d] = hac[d];
+      }
+      const double values[7] = {
+        nc * timeInterval * TIME_UNIT_CONVERSION / 1000.0, // ps
+        hac[0], hac[1], hac[2], rtc[0], rtc[1], rtc[2]};
+      writeColumns(output, values, 7);
+    }
+  }
+};
+
+// in-place FFT of the n = 2^p complex values data[0], data[stride], ...
+void fft(std::complex<double>* data, const int n, const int stride)
+{
+  for (int i = 1, j = 0; i < n; ++i) { // bit reversal
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+      std::swap(data[i * stride], data[j * stride]);
+  }
+  for (int length = 2; length <= n; length <<= 1) {
+    const double angle = -2.0 * M_PI / length;
+    const std::complex<double> w(cos(angle), sin(angle));
+    for (int i = 0; i < n; i += length) {
+      std::complex<double> wk = 1.0;
+      for (int k = 0; k < length / 2; ++k) {
+        std::complex<double>& a = data[(i + k) * stride];
+        std::complex<double>& b = data[(i + k + length / 2) * stride];
+        const std::complex<double> t = b * wk;
+        b = a - t;
+        a += t;
+        wk *= w;
+      }
+    }
+  }
+}
+
+// plugin sk interval numGrid kmax numBins: the static structure factor
+// S(k) = <|rho(k)|^2> / N in sk.out, with rho(k) the sum of exp(-i k.r) over
+// the atoms. As in smooth particle mesh Ewald, each element spreads its atoms
+// onto a numGrid^3 grid of fractional coordinates with cubic B-splines, the
+// grid is Fourier transformed and |rho|^2 is corrected by the B-spline
+// factors; the k of the grid, 2 pi G^T m, are averaged in numBins shells up to
+// kmax. A sample costs O(N + G log G) and the memory does not depend on the
+// number of samples. S(k) is within about 1% for k below half of pi numGrid /
+// L, with errors falling as numGrid^-4. The columns are k (1/A), S and, with
+// more elements, S_ab for a <= b, with S the sum of S_ab over all a and b.
+struct SkPlugin : Plugin {
+  static const int ORDER = 4; // of the B-splines
+  int numGrid;
+  double kmax;
+  int numTypes;
+  std::vector<std::complex<double>> grids; // one for each element
+  std::vector<double> correction;          // 1 / |b(m)|^2 for each m
+  std::vector<double> sums;                // [bin][pair]
+  std::vector<long long> counts;
+  int number;
+  int numSamples = 0;
+
+  SkPlugin(const int numGrid, const double kmax, const int numBins)
+    : numGrid(numGrid), kmax(kmax), counts(numBins, 0)
+  {
+  }
+
+  void begin(const Run& run) override
+  {
+    if (!run.pbc[0] || !run.pbc[1] || !run.pbc[2]) {
+      std::cout << "plugin sk needs a fully periodic box." << std::endl;
+      fail();
+    }
+    number = run.number;
+    numTypes = std::max(1, run.elements.size);
+    const long long numPoints = (long long)numGrid * numGrid * numGrid;
+    grids.assign(numTypes * numPoints, 0.0);
+    sums.assign(counts.size() * numTypes * numTypes, 0.0);
+
+    // b(m) = sum over k < ORDER - 1 of M(k + 1) exp(2 pi i m k / numGrid)
+    const double M[ORDER - 1] = {1.0 / 6.0, 2.0 / 3.0, 1.0 / 6.0};
+    correction.resize(numGrid);
+    for (int m = 0; m < numGrid; ++m) {
+      std::complex<double> b = 0.0;
+      for (int k = 0; k < ORDER - 1; ++k)
+        b += M[k] * std::polar(1.0, 2.0 * M_PI * m * k / numGrid);
+      correction[m] = 1.0 / std::norm(b);
+    }
+  }
+
+  void on_step(const int, const State& state) override
+  {
+    const int K = numGrid;
+    const long long numPoints = (long long)K * K * K;
+    std::fill(grids.begin(), grids.end(), 0.0);
+    const double* G = state.box + 9;
+    for (int n = 0; n < state.number; ++n) {
+      const double r[3] = {state.x[n], state.y[n], state.z[n]};
+      int first[3];
+      double w[3][ORDER]; // cubic B-spline weights of 4 points per direction
+      for (int d = 0; d < 3; ++d) {
+        const double s =
+          G[d * 3] * r[0] + G[d * 3 + 1] * r[1] + G[d * 3 + 2] * r[2];
+        const double u = (s - floor(s)) * K;
+        const double t = u - floor(u);
+        first[d] = int(floor(u)) - ORDER + 1;
+        w[d][0] = (1.0 - t) * (1.0 - t) * (1.0 - t) / 6.0;
+        w[d][1] = (3.0 * t * t * t - 6.0 * t * t + 4.0) / 6.0;
+        w[d][2] = (-3.0 * t * t * t + 3.0 * t * t + 3.0 * t + 1.0) / 6.0;
+        w[d][3] = t * t * t / 6.0;
+      }
+      const int type = state.type.size > 0 ? state.type[n] : 0;
+      std::complex<double>* grid = grids.data() + type * numPoints;
+      for (int i = 0; i < ORDER; ++i) {
+        const int gi = (first[0] + i + K) % K;
+        for (int j = 0; j < ORDER; ++j) {
+          const int gj = (first[1] + j + K) % K;
+          const double wij = w[0][i] * w[1][j];
+          for (int k = 0; k < ORDER; ++k) {
+            const int gk = (first[2] + k + K) % K;
+            grid[((long long)gi * K + gj) * K + gk] += wij * w[2][k];
+          }
+        }
+      }
+    }
+
+    for (int t = 0; t < numTypes; ++t) {
+      std::complex<double>* grid = grids.data() + t * numPoints;
+      for (int i = 0; i < K * K; ++i) // along z, y and then x
+        fft(grid + (long long)i * K, K, 1);
+      for (int i = 0; i < K; ++i)
+        for (int k = 0; k < K; ++k)
+          fft(grid + (long long)i * K * K + k, K, K);
+      for (int i = 0; i < K * K; ++i)
+        fft(grid + i, K, K * K);
+    }
+
+    const int numBins = counts.size();
+    const double binSize = kmax / numBins;
+    for (int i = 0; i < K; ++i) {
+      const int mi = i < K / 2 ? i : i - K;
+      for (int j = 0; j < K; ++j) {
+        const int mj = j < K / 2 ? j : j - K;
+        for (int k = 0; k < K; ++k) {
+          const int mk = k < K / 2 ? k : k - K;
+          double kv[3];
+          for (int d = 0; d < 3; ++d)
+            kv[d] = 2.0 * M_PI * (mi * G[d] + mj * G[3 + d] + mk * G[6 + d]);
+          const double k2 = kv[0] * kv[0] + kv[1] * kv[1] + kv[2] * kv[2];
+          if (k2 == 0.0 || k2 >= kmax * kmax)
+            continue;
+          const int bin = std::min(int(sqrt(k2) / binSize), numBins - 1);
+          const double c = correction[i] * correction[j] * correction[k];
+          const long long index = ((long long)i * K + j) * K + k;
+          double* sum = sums.data() + bin * numTypes * numTypes;
+          for (int a = 0; a < numTypes; ++a) {
+            const std::complex<double> rhoA = grids[a * numPoints + index];
+            for (int b = 0; b < numTypes; ++b) {
+              const std::complex<double> rhoB = grids[b * numPoints + index];
+              sum[a * numTypes + b] += c * (rhoA * std::conj(rhoB)).real();
+            }
+          }
+          ++counts[bin];
+        }
+      }
+    }
+    ++numSamples;
+  }
+
+  void end() override
+  {
+    std::ofstream output("sk.out");
+    const int numBins = counts.size();
+    const double binSize = kmax / numBins;
+    const int numPairs = numTypes == 1 ? 0 : numTypes * (numTypes + 1) / 2;
+    std::vector<double> values(2 + numPairs);
+    for (int bin = 0; bin < numBins; ++bin) {
+      if (counts[bin] == 0)
+        continue;
+      const double* sum = sums.data() + bin * numTypes * numTypes;
+      const double scale = 1.0 / (double(counts[bin]) * number);
+      values[0] = (bin + 0.5) * binSize;
+      values[1] = 0.0;
+      int p = 2;
+      for (int a = 0; a < numTypes; ++a) {
+        for (int b = 0; b < numTypes; ++b) {
+          values[1] += sum[a * numTypes + b] * scale;
+          if (numPairs > 0 && b >= a)
+            values[p++] = sum[a * numTypes + b] * scale;
+        }
+      }
+      writeColumns(output, values.data(), values.size());
+    }
+  }
+};
+
+// plugin sed interval segmentLength numPerLeg q1 q2 ...: the spectral energy
+// density of the phonons along the path q1 -> q2 -> ..., each q given by three
+// coordinates in the reciprocal cell of the lattice line (of the box without
+// one), with numPerLeg points from one q to the next. Each sample projects
+// the mass-weighted velocities sqrt(m) v onto exp(i q.r0), with r0 the
+// positions of the first sample, and only the latest segmentLength samples
+// are kept: the power spectrum of each projection is averaged over
+// Hann-windowed segments that overlap by half (Welch), so that the memory is
+// numQ * segmentLength. The intensity is in eV/THz per atom and integrates to
+// about 3 kB T at each q but Gamma. sed.out has a line for each frequency
+// (THz) with a column for each q, and sed_q.out the path length (1/A) and the
+// Cartesian q (1/A) of each q.
+struct SedPlugin : Plugin {
+  int segmentLength;
+  int numPerLeg;
+  int numLegs; // of numPerLeg q each, followed by the last point alone
+  std::vector<double> points; // in the reciprocal cell, 3 per point
+  std::vector<double> q;      // Cartesian, 3 per q
+  std::vector<double> x0, y0, z0;
+  std::vector<std::complex<double>> history; // [sample][q][d], a ring
+  std::vector<double> window;
+  std::vector<double> sums; // [q][frequency], for frequencies >= 0
+  double timeInterval;      // in natural units
+  int number;
+  int numSamples = 0;
+  int numSegments = 0;
+
+  SedPlugin(
+    const int segmentLength, const int numPerLeg, std::vector<double> points)
+    : segmentLength(segmentLength), numPerLeg(numPerLeg), points(points)
+  {
+  }
+
+  int getNumQ() const { return q.size() / 3; }
+
+  void begin(const Run& run) override
+  {
+    if (run.isAdaptive) {
+      std::cout << "plugin sed needs a fixed time step." << std::endl;
+      fail();
+    }
+    number = run.number;
+    timeInterval = run.timeStep * interval;
+    double reciprocal[18];
+    if (run.cell) {
+      for (int d = 0; d < 3; ++d)
+        for (int k = 0; k < 3; ++k)
+          reciprocal[d * 3 + k] = run.cell[k * 3 + d];
+      getInverseBox(reciprocal);
+    } else {
+      std::copy(run.box, run.box + 18, reciprocal);
+    }
+    const double* G = reciprocal + 9; // row i is b_i with b_i.a_j = delta_ij
+    numLegs = points.size() / 3 - 1;
+    for (int leg = 0; leg <= numLegs; ++leg) {
+      for (int j = 0; j < (leg < numLegs ? numPerLeg : 1); ++j) {
+        double s[3];
+        for (int i = 0; i < 3; ++i)
+          s[i] = points[leg * 3 + i] +
+                 (leg < numLegs ? j * (points[leg * 3 + 3 + i] -
+                                       points[leg * 3 + i]) / numPerLeg
+                                : 0.0);
+        for (int d = 0; d < 3; ++d)
+          q.push_back(
+            2.0 * M_PI * (s[0] * G[d] + s[1] * G[3 + d] + s[2] * G[6 + d]));
+      }
+    }
+    const int L = segmentLength;
+    history.assign(L * getNumQ() * 3, 0.0);
+    sums.assign(getNumQ() * (L / 2 + 1), 0.0);
+    window.resize(L);
+    for (int t = 0; t < L; ++t)
+      window[t] = 0.5 - 0.5 * cos(2.0 * M_PI * t / L);
+  }
+
+  void on_step(const int, const State& state) override
+  {
+    if (numSamples == 0) {
+      x0.assign(state.x.data, state.x.data + state.number);
+      y0.assign(state.y.data, state.y.data + state.number);
+      z0.assign(state.z.data, state.z.data + state.number);
+    }
+    const int numQ = getNumQ();
+    const int L = segmentLength;
+    std::complex<double>* u = history.data() + (numSamples % L) * numQ * 3;
+    std::fill(u, u + numQ * 3, 0.0);
+    for (int n = 0; n < state.number; ++n) {
+      const double sqrtMass = sqrt(state.mass[n]);
+      const double p[3] = {
+        sqrtMass * state.vx[n], sqrtMass * state.vy[n], sqrtMass * state.vz[n]};
+      const auto phase = [&](const double* k) {
+        return std::polar(1.0, k[0] * x0[n] + k[1] * y0[n] + k[2] * z0[n]);
+      };
+      // exp(i q.r0) along a leg by multiplication with exp(i dq.r0)
+      for (int leg = 0; leg <= numLegs; ++leg) {
+        const int first = leg * numPerLeg;
+        std::complex<double> e = phase(q.data() + first * 3);
+        if (leg == numLegs) {
+          for (int d = 0; d < 3; ++d)
+            u[first * 3 + d] += p[d] * e;
+          break;
+        }
+        const double dq[3] = {
+          q[first * 3 + 3] - q[first * 3], q[first * 3 + 4] - q[first * 3 + 1],
+          q[first * 3 + 5] - q[first * 3 + 2]};
+        const std::complex<double> de = phase(dq);
+        for (int j = first; j < first + numPerLeg; ++j) {
+          for (int d = 0; d < 3; ++d)
+            u[j * 3 + d] += p[d] * e;
+          e *= de;
+        }
+      }
+    }
+    ++numSamples;
+    if (numSamples >= L && (numSamples - L) % (L / 2) == 0)
+      addSegment();
+  }
+
+  // the latest L samples
+  void addSegment()
+  {
+    const int numQ = getNumQ();
+    const int L = segmentLength;
+    std::vector<std::complex<double>> data(L);
+    for (int k = 0; k < numQ; ++k) {
+      double* sum = sums.data() + k * (L / 2 + 1);
+      for (int d = 0; d < 3; ++d) {
+        for (int t = 0; t < L; ++t) {
+          const int slot = (numSamples + t) % L; // from the oldest sample
+          data[t] = window[t] * history[(slot * numQ + k) * 3 + d];
+        }
+        fft(data.data(), L, 1);
+        sum[0] += std::norm(data[0]);
+        for (int f = 1; f < L / 2; ++f) // -f folded onto f
+          sum[f] += std::norm(data[f]) + std::norm(data[L - f]);
+        sum[L / 2] += std::norm(data[L / 2]);
+      }
+    }
+    ++numSegments;
+  }
+
+  void end() override
+  {
+    if (numSegments == 0) {
+      std::cout << "plugin sed has no segment of " << segmentLength
+                << " samples; no sed.out." << std::endl;
+      return;
+    }
+    const int numQ = getNumQ();
+    const int L = segmentLength;
+    const double df = 1000.0 / (L * timeInterval * TIME_UNIT_CONVERSION);
+    double sumWindow2 = 0.0;
+    for (int t = 0; t < L; ++t)
+      sumWindow2 += window[t] * window[t];
+    // Parseval: the sum over f of |X(f)|^2 is L times the sum over t of |x|^2
+    const double scale = 1.0 / (numSegments * L * sumWindow2 * number * df);
+    std::ofstream output("sed.out");
+    std::vector<double> values(1 + numQ);
+    for (int f = 0; f <= L / 2; ++f) {
+      values[0] = f * df;
+      for (int k = 0; k < numQ; ++k)
+        values[1 + k] = sums[k * (L / 2 + 1) + f] * scale;
+      writeColumns(output, values.data(), values.size());
+    }
+    std::ofstream outputQ("sed_q.out");
+    double length = 0.0;
+    for (int k = 0; k < numQ; ++k) {
+      if (k > 0) {
+        double dq2 = 0.0;
+        for (int d = 0; d < 3; ++d)
+          dq2 += (q[k * 3 + d] - q[k * 3 - 3 + d]) *
+                 (q[k * 3 + d] - q[k * 3 - 3 + d]);
+        length += sqrt(dq2);
+      }
+      const double row[4] = {length, q[k * 3], q[k * 3 + 1], q[k * 3 + 2]};
+      writeColumns(outputQ, row, 4);
+    }
+  }
+};
+
+// plugin name interval parameters
+std::shared_ptr<Plugin> createPlugin(std::vector<std::string>& tokens)
+{
+  if (tokens.size() < 3) {
+    std::cout << "plugin should have a name and an interval." << std::endl;
+    fail();
+  }
+  std::shared_ptr<Plugin> plugin;
+  if (tokens[1] == "rdf" && tokens.size() > 4) {
+    const double rmax = getDouble(tokens[3]);
+    const int numBins = getInt(tokens[4]);
+    if (rmax <= 0 || numBins < 1) {
+      std::cout << "plugin rdf needs rmax > 0 and numBins >= 1." << std::endl;
+      fail();
+    }
+    plugin = std::make_shared<RdfPlugin>(numBins, rmax);
+  } else if (tokens[1] == "sk" && tokens.size() > 5) {
+    const int numGrid = getInt(tokens[3]);
+    const double kmax = getDouble(tokens[4]);
+    const int numBins = getInt(tokens[5]);
+    if (numGrid < 4 || (numGrid & (numGrid - 1)) || kmax <= 0 || numBins < 1) {
+      std::cout << "plugin sk needs numGrid = 2^p >= 4, kmax > 0 and "
+                << "numBins >= 1." << std::endl;
+      fail();
+    }
+    plugin = std::make_shared<SkPlugin>(numGrid, kmax, numBins);
+  } else if (tokens[1] == "sed" && tokens.size() > 10) {
+    const int segmentLength = getInt(tokens[3]);
+    const int numPerLeg = getInt(tokens[4]);
+    std::vector<double> points;
+    for (size_t k = 5; k < tokens.size() && tokens[k][0] != '#'; ++k)
+      points.push_back(getDouble(tokens[k]));
+    if (
+      segmentLength < 4 || (segmentLength & (segmentLength - 1)) ||
+      numPerLeg < 1 || points.size() < 6 || points.size() % 3 != 0) {
+      std::cout << "plugin sed needs segmentLength = 2^p >= 4, numPerLeg >= 1 "
+                << "and three coordinates per q." << std::endl;
+      fail();
+    }
+    plugin = std::make_shared<SedPlugin>(segmentLength, numPerLeg, points);
+  } else if ((tokens[1] == "msd" || tokens[1] == "hac") && tokens.size() > 3) {
+    const int numCorrelations = getInt(tokens[3]);
+    if (numCorrelations < 1) {
+      std::cout << "numCorrelations should >= 1." << std::endl;
+      fail();
+    }
+    if (tokens[1] == "msd")
+      plugin = std::make_shared<MsdPlugin>(numCorrelations);
+    else
+      plugin = std::make_shared<HacPlugin>(numCorrelations);
+  } else {
+    std::cout << "plugin can only be rdf interval rmax numBins, "
+              << "sk interval numGrid kmax numBins, "
+              << "sed interval segmentLength numPerLeg q1 q2 ..., "
+              << "msd interval numCorrelations or hac interval "
+              << "numCorrelations." << std::endl;
+    fail();
+  }
+  plugin->interval = getInt(tokens[2]);
+  if (plugin->interval < 1) {
+    std::cout << "plugin interval should >= 1." << std::endl;
+    fail();
+  }
+  std::cout << "plugin " << tokens[1] << " every " << plugin->interval
+            << " steps" << std::endl;
+  return plugin;
+}
+
+// one line of run.in, split into tokens
+void parseRunLine(
+  std::vector<std::string>& tokens,
+  int& numSteps,
+  double& timeStep,
+  double& temperature,
+  Atom& atom)
+{
+  if (tokens[0][0] != '#' && tokens.size() < 2) {
+    std::cout << tokens[0] << " should have a value." << std::endl;
+    fail();
+  }
+  if (tokens[0] == "time_step") {
+    timeStep = getDouble(tokens[1]);
+    if (timeStep < 0) {
+      std::cout << "timeStep should >= 0." << std::endl;
+      fail();
+    }
+    std::cout << "timeStep = " << timeStep << " fs." << std::endl;
+  } else if (tokens[0] == "adaptive_time_step") {
+    atom.maxDisplacement = getDouble(tokens[1]);
+    if (atom.maxDisplacement <= 0) {
+      std::cout << "maxDisplacement should > 0." << std::endl;
+      fail();
+    }
+    if (tokens.size() > 2 && tokens[2][0] != '#')
+      atom.maxEnergyChange = getDouble(tokens[2]);
+    std::cout << "maxDisplacement = " << atom.maxDisplacement
+              << " A, maxEnergyChange = " << atom.maxEnergyChange
+              << " eV." << std::endl;
+  } else if (tokens[0] == "flush_interval") {
+    atom.flushInterval = getDouble(tokens[1]);
+    if (atom.flushInterval <= 0) {
+      std::cout << "flush_interval should > 0." << std::endl;
+      fail();
+    }
+    std::cout << "flush_interval = " << atom.flushInterval << " s."
+              << std::endl;
+  } else if (tokens[0] == "ipi") {
+    const bool isUnix = tokens.size() > 2 && tokens[1] == "unix";
+    const bool isInet = tokens.size() > 3 && tokens[1] == "inet";
+    if (!isUnix && !isInet) {
+      std::cout << "ipi should be unix name or inet host port." << std::endl;
+      fail();
+    }
+    atom.ipiAddress.assign(tokens.begin() + 1, tokens.begin() + 3 + isInet);
+    std::cout << "i-PI client of " << tokens[1] << " " << tokens[2]
+              << (isInet ? " " + tokens[3] : "") << std::endl;
+  } else if (tokens[0] == "thermostat") {
+    if (tokens.size() < 3 || tokens[1] != "massive_nhc") {
+      std::cout << "thermostat should be massive_nhc tau [chain_length]."
+                << std::endl;
+      fail();
+    }
+    atom.nhcTau = getDouble(tokens[2]) / TIME_UNIT_CONVERSION;
+    atom.nhcLength = tokens.size() > 3 ? getInt(tokens[3]) : 4;
+    if (atom.nhcTau <= 0.0) {
+      std::cout << "The thermostat tau should > 0." << std::endl;
+      fail();
+    }
+    if (atom.nhcLength < 2 || atom.nhcLength > NHC_MAX_LENGTH) {
+      std::cout << "The chain length should be from 2 to " << NHC_MAX_LENGTH
+                << std::endl;
+      fail();
+    }
+    std::cout << "Massive Nose-Hoover chains of length " << atom.nhcLength
+              << " with tau = " << tokens[2] << " fs." << std::endl;
+  } else if (tokens[0] == "monitor") {
+    if (tokens.size() < 2) {
+      std::cout << "monitor should be name [interval]." << std::endl;
+      fail();
+    }
+    atom.monitorName = tokens[1];
+    if (tokens.size() > 2)
+      atom.monitorInterval = getInt(tokens[2]);
+    if (atom.monitorInterval < 1) {
+      std::cout << "The monitor interval should >= 1." << std::endl;
+      fail();
+    }
+    std::cout << "monitor = /md_" << atom.monitorName << " every "
+              << atom.monitorInterval << " steps" << std::endl;
+  } else if (tokens[0] == "lattice") {
+    readLattice(tokens, atom.lattice);
+    std::cout << "lattice = " << atom.lattice.name << std::endl;
+  } else if (tokens[0] == "basis") {
+    if (atom.lattice.name != "custom") {
+      std::cout << "basis lines should follow lattice custom." << std::endl;
+      fail();
+    }
+    if (tokens.size() < 6) {
+      std::cout << "basis should have 5 parameters." << std::endl;
+      fail();
+    }
+    atom.lattice.elements.push_back(tokens[1]);
+    atom.lattice.masses.push_back(getDouble(tokens[2]));
+    for (int d = 0; d < 3; ++d)
+      atom.lattice.basis.push_back(getDouble(tokens[3 + d]));
+  } else if (tokens[0] == "num_threads") {
+    atom.numThreads = getInt(tokens[1]);
+    if (atom.numThreads < 1) {
+      std::cout << "num_threads should >= 1." << std::endl;
+      fail();
+    }
+    std::cout << "num_threads = " << atom.numThreads << std::endl;
+  } else if (tokens[0] == "run") {
+    numSteps = getInt(tokens[1]);
+    if (numSteps < 1) {
+      std::cout << "numSteps should >= 1." << std::endl;
+      fail();
+    }
+    std::cout << "numSteps = " << numSteps << std::endl;
+  } else if (tokens[0] == "velocity") {
+    temperature = getDouble(tokens[1]);
+    if (temperature < 0) {
+      std::cout << "temperature >= 0." << std::endl;
+      fail();
+    }
+    std::cout << "temperature = " << temperature << " K." << std::endl;
+  } else if (tokens[0] == "neighbor_flag" && tokens[1] == "auto") {
+    atom.isAutoNeighbor = true;
+    std::cout << "neighbor_flag = auto" << std::endl;
+  } else if (tokens[0] == "neighbor_flag") {
+    atom.neighbor_flag = getDouble(tokens[1]);
+    if (atom.neighbor_flag<0 | atom.neighbor_flag> 4) {
+      std::cout << "neighbor_flag can only be 0, 1, 2, 3 or 4." << std::endl;
+      fail();
+    }
+    std::cout << "neighbor_flag = " << atom.neighbor_flag << std::endl;
+    if (
+      atom.neighbor_flag == 3 && tokens.size() > 2 &&
+      tokens[2][0] != '#') {
+      atom.rebuildFraction = getDouble(tokens[2]);
+      if (atom.rebuildFraction < 0 || atom.rebuildFraction > 1) {
+        std::cout << "rebuildFraction should be in [0, 1]." << std::endl;
+        fail();
+      }
+      std::cout << "rebuildFraction = " << atom.rebuildFraction << std::endl;
+    }
+  } else if (tokens[0] == "neighbor_async") {
+    atom.asyncFraction = getDouble(tokens[1]);
+    if (atom.asyncFraction <= 0 || atom.asyncFraction >= 1) {
+      std::cout << "neighbor_async should be in (0, 1)." << std::endl;
+      fail();
+    }
+    std::cout << "neighbor_async = " << atom.asyncFraction << std::endl;
+  } else if (tokens[0] == "reduction_block") {
+    atom.reductionBlock = getInt(tokens[1]);
+    if (atom.reductionBlock < 1) {
+      std::cout << "reduction_block should >= 1." << std::endl;
+      fail();
+    }
+    if (tokens.size() > 2 && tokens[2] == "kahan")
+      atom.isCompensated = true;
+    std::cout << "reduction_block = " << atom.reductionBlock
+              << (atom.isCompensated ? " with Kahan sums" : "")
+              << std::endl;
+  } else if (tokens[0] == "plugin") {
+    atom.plugins.push_back(createPlugin(tokens));
+  } else if (tokens[0] == "neighbor_compress") {
+    atom.isCompressed = getInt(tokens[1]) != 0;
+    std::cout << "neighbor_compress = " << atom.isCompressed << std::endl;
+  } else if (tokens[0][0] != '#') {
+    std::cout << tokens[0] << " is not a valid keyword." << std::endl;
+    fail();
   }
-  return value;
 }
 
 void readRun(int& numSteps, double& timeStep, double& temperature, Atom& atom)
@@ -485,71 +2659,25 @@ void readRun(int& numSteps, double& timeStep, double& temperature, Atom& atom)
   std::ifstream input("run.in");
   if (!input.is_open()) {
     std::cout << "Failed to open run.in." << std::endl;
-    exit(1);
+    fail();
   }
 
   while (input.peek() != EOF) {
     std::vector<std::string> tokens = getTokens(input);
-    if (tokens.size() > 0) {
-      if (tokens[0] == "time_step") {
-        timeStep = getDouble(tokens[1]);
-        if (timeStep < 0) {
-          std::cout << "timeStep should >= 0." << std::endl;
-          exit(1);
-        }
-        std::cout << "timeStep = " << timeStep << " fs." << std::endl;
-      } else if (tokens[0] == "run") {
-        numSteps = getInt(tokens[1]);
-        if (numSteps < 1) {
-          std::cout << "numSteps should >= 1." << std::endl;
-          exit(1);
-        }
-        std::cout << "numSteps = " << numSteps << std::endl;
-      } else if (tokens[0] == "velocity") {
-        temperature = getDouble(tokens[1]);
-        if (temperature < 0) {
-          std::cout << "temperature >= 0." << std::endl;
-          exit(1);
-        }
-        std::cout << "temperature = " << temperature << " K." << std::endl;
-      } else if (tokens[0] == "neighbor_flag") {
-        atom.neighbor_flag = getDouble(tokens[1]);
-        if (atom.neighbor_flag<0 | atom.neighbor_flag> 2) {
-          std::cout << "neighbor_flag can only be 0 or 1 or 2." << std::endl;
-          exit(1);
-        }
-        std::cout << "neighbor_flag = " << atom.neighbor_flag << std::endl;
-      } else if (tokens[0][0] != '#') {
-        std::cout << tokens[0] << " is not a valid keyword." << std::endl;
-        exit(1);
-      }
-    }
+    if (tokens.size() > 0)
+      parseRunLine(tokens, numSteps, timeStep, temperature, atom);
   }
 
   input.close();
 }
 
-void readXyz(Atom& atom)
+void allocateMemory(Atom& atom)
 {
-  std::ifstream input("xyz.in");
-  if (!input.is_open()) {
-    std::cout << "Failed to open xyz.in." << std::endl;
-    exit(1);
-  }
-
-  std::vector<std::string> tokens = getTokens(input);
-
-  // line 1
-  if (tokens.size() != 1) {
-    std::cout << "The first line of xyz.in should have one item." << std::endl;
-    exit(1);
-  }
-  atom.number = getInt(tokens[0]);
-  std::cout << "Number of atoms = " << atom.number << std::endl;
-
-  // allocate memory
   atom.NN.resize(atom.number, 0);
-  atom.NL.resize(atom.number * atom.MN, 0);
+  if (!atom.isCompressed)
+    atom.NL.resize(atom.number * atom.MN, 0);
+  atom.isDirty.resize(atom.number, 0);
+  atom.pad.resize(atom.number, 0.0);
   atom.mass.resize(atom.number, 0.0);
   atom.x0.resize(atom.number, 0.0);
   atom.y0.resize(atom.number, 0.0);
@@ -563,20 +2691,25 @@ void readXyz(Atom& atom)
   atom.fx.resize(atom.number, 0.0);
   atom.fy.resize(atom.number, 0.0);
   atom.fz.resize(atom.number, 0.0);
+  atom.energy.resize(atom.number, 0.0);
+  atom.type.resize(atom.number, 0);
+}
 
-  // line 2
-  tokens = getTokens(input);
-  if (tokens.size() != 9) {
-    std::cout << "The second line of xyz.in should have 9 items." << std::endl;
-    exit(1);
-  }
+// index of element in atom.elements, which gets it if it is new
+int findType(Atom& atom, const std::string& element)
+{
+  const auto& elements = atom.elements;
+  const auto it = std::find(elements.begin(), elements.end(), element);
+  if (it != elements.end())
+    return it - elements.begin();
+  atom.elements.push_back(element);
+  return elements.size() - 1;
+}
 
-  for (int d1 = 0; d1 < 3; ++d1) {
-    for (int d2 = 0; d2 < 3; ++d2) {
-      atom.box[d2 * 3 + d1] = getDouble(tokens[d1 * 3 + d2]);
-    }
-  }
-  getInverseBox(atom.box);
+void printBox(const Atom& atom)
+{
+  std::cout << "pbc = " << atom.pbc[0] << " " << atom.pbc[1] << " "
+            << atom.pbc[2] << std::endl;
 
   std::cout << "box matrix H = " << std::endl;
   for (int d1 = 0; d1 < 3; ++d1) {
@@ -593,6 +2726,48 @@ void readXyz(Atom& atom)
     }
     std::cout << std::endl;
   }
+}
+
+void readXyz(Atom& atom)
+{
+  std::ifstream input("xyz.in");
+  if (!input.is_open()) {
+    std::cout << "Failed to open xyz.in." << std::endl;
+    fail();
+  }
+
+  std::vector<std::string> tokens = getTokens(input);
+
+  // line 1
+  if (tokens.size() != 1) {
+    std::cout << "The first line of xyz.in should have one item." << std::endl;
+    fail();
+  }
+  atom.number = getInt(tokens[0]);
+  std::cout << "Number of atoms = " << atom.number << std::endl;
+
+  allocateMemory(atom);
+
+  // line 2
+  tokens = getTokens(input);
+  if (tokens.size() != 9 && tokens.size() != 12) {
+    std::cout << "The second line of xyz.in should have 9 or 12 items."
+              << std::endl;
+    fail();
+  }
+
+  for (int d1 = 0; d1 < 3; ++d1) {
+    for (int d2 = 0; d2 < 3; ++d2) {
+      atom.box[d2 * 3 + d1] = getDouble(tokens[d1 * 3 + d2]);
+    }
+  }
+  getInverseBox(atom.box);
+  if (tokens.size() == 12) {
+    for (int d = 0; d < 3; ++d) {
+      atom.pbc[d] = getInt(tokens[9 + d]);
+    }
+  }
+  printBox(atom);
 
   // starting from line 3
   for (int n = 0; n < atom.number; ++n) {
@@ -600,9 +2775,9 @@ void readXyz(Atom& atom)
     if (tokens.size() != 5) {
       std::cout << "The 3rd line and later of xyz.in should have 5 items."
                 << std::endl;
-      exit(1);
+      fail();
     }
-    // atom types not used
+    atom.type[n] = findType(atom, tokens[0]);
     atom.x[n] = getDouble(tokens[1]);
     atom.y[n] = getDouble(tokens[2]);
     atom.z[n] = getDouble(tokens[3]);
@@ -612,6 +2787,595 @@ void readXyz(Atom& atom)
   input.close();
 }
 
+// uniform random number in [0, 1) for draw k of lattice site n, which does
+// not depend on the order in which the sites are filled
+double getSiteRandom(
+  const unsigned long long seed, const long long n, const int k)
+{
+  unsigned long long z = seed + (n * 8ULL + k + 1) * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return ((z ^ (z >> 31)) >> 11) * 0x1.0p-53;
+}
+
+// fill the atoms from atom.lattice on atom.numThreads threads; the sites are
+// ordered by cell and then basis atom, with vacancies removed
+void buildLattice(Atom& atom)
+{
+  const Lattice& lattice = atom.lattice;
+  const int numBasis = lattice.masses.size();
+  if (numBasis == 0) {
+    std::cout << "lattice custom needs basis atoms." << std::endl;
+    fail();
+  }
+  unsigned long long seed = lattice.seed;
+#ifndef DEBUG
+  if (seed == 0)
+    seed = time(NULL);
+#endif
+
+  const int* size = lattice.size;
+  const long long numSites = (long long)size[0] * size[1] * size[2] * numBasis;
+  std::vector<long long> sites;
+  sites.reserve(numSites);
+  for (long long s = 0; s < numSites; ++s) {
+    if (getSiteRandom(seed, s, 0) >= lattice.vacancyFraction)
+      sites.push_back(s);
+  }
+  if (sites.size() > 2000000000) {
+    std::cout << "Too many atoms in the lattice." << std::endl;
+    fail();
+  }
+  atom.number = sites.size();
+  std::cout << "Number of atoms = " << atom.number << std::endl;
+  allocateMemory(atom);
+
+  for (int d1 = 0; d1 < 3; ++d1) {
+    atom.pbc[d1] = lattice.pbc[d1];
+    for (int d2 = 0; d2 < 3; ++d2)
+      atom.box[d2 * 3 + d1] = lattice.cell[d1 * 3 + d2] * size[d1];
+  }
+  getInverseBox(atom.box);
+  printBox(atom);
+
+  std::vector<int> basisTypes(numBasis);
+  for (int b = 0; b < numBasis; ++b)
+    basisTypes[b] = findType(atom, lattice.elements[b]);
+  const int alloyType =
+    lattice.alloyFraction > 0 ? findType(atom, lattice.alloyElement) : 0;
+  runOnAtoms(atom, [&](const int begin, const int end) {
+    for (int n = begin; n < end; ++n) {
+      const long long s = sites[n];
+      const int b = s % numBasis;
+      const long long cell = s / numBasis;
+      const double f[3] = {
+        cell / (size[1] * size[2]) + lattice.basis[b * 3],
+        cell / size[2] % size[1] + lattice.basis[b * 3 + 1],
+        cell % size[2] + lattice.basis[b * 3 + 2]};
+      double r[3];
+      for (int d = 0; d < 3; ++d) {
+        r[d] = f[0] * lattice.cell[d] + f[1] * lattice.cell[3 + d] +
+               f[2] * lattice.cell[6 + d];
+        const double random = getSiteRandom(seed, s, 2 + d);
+        r[d] += lattice.displacement * (2.0 * random - 1.0);
+      }
+      atom.x[n] = r[0];
+      atom.y[n] = r[1];
+      atom.z[n] = r[2];
+      const bool isAlloy = getSiteRandom(seed, s, 1) < lattice.alloyFraction;
+      atom.mass[n] = isAlloy ? lattice.alloyMass : lattice.masses[b];
+      atom.type[n] = isAlloy ? alloyType : basisTypes[b];
+    }
+  });
+}
+
+// virial -dU/d(strain) in eV, row-major, from the per-atom virials W
+void findVirial(Atom& atom, double* virial)
+{
+  for (int a = 0; a < 3; ++a) {
+    for (int b = 0; b < 3; ++b) {
+      virial[b * 3 + a] = sumAtoms(
+        atom, [&](const int n) { return atom.virial[n * 9 + a * 3 + b]; });
+    }
+  }
+}
+
+// i-PI client: the server sends 12-byte headers and the client answers with
+// forces, energy and virial in atomic units, keeping its neighbor list
+// between requests; see https://ipi-code.org for the protocol and
+// tools/ipimock.cpp for a server that checks the answers
+#ifndef _WIN32
+const double BOHR = 0.52917721067;  // A
+const double HARTREE = 27.21138602; // eV
+const int IPI_HEADER_SIZE = 12;
+
+void readSocket(const int socket, void* data, const size_t size)
+{
+  char* bytes = (char*)data;
+  size_t count = 0;
+  while (count < size) {
+    const ssize_t n = recv(socket, bytes + count, size - count, 0);
+    if (n <= 0) {
+      std::cout << "Lost the connection to the i-PI server." << std::endl;
+      fail();
+    }
+    count += n;
+  }
+}
+
+void writeSocket(const int socket, const void* data, const size_t size)
+{
+  const char* bytes = (const char*)data;
+  size_t count = 0;
+  while (count < size) {
+    const ssize_t n = send(socket, bytes + count, size - count, 0);
+    if (n <= 0) {
+      std::cout << "Lost the connection to the i-PI server." << std::endl;
+      fail();
+    }
+    count += n;
+  }
+}
+
+void writeHeader(const int socket, const std::string& message)
+{
+  char header[IPI_HEADER_SIZE];
+  std::fill(header, header + IPI_HEADER_SIZE, ' ');
+  std::copy(message.begin(), message.end(), header);
+  writeSocket(socket, header, IPI_HEADER_SIZE);
+}
+
+// ipi unix name: the socket /tmp/ipi_name as in i-PI; ipi inet host port
+int connectIpi(const std::vector<std::string>& address)
+{
+  int result = -1;
+  if (address[0] == "unix") {
+    sockaddr_un server = {};
+    server.sun_family = AF_UNIX;
+    const std::string path = "/tmp/ipi_" + address[1];
+    if (path.size() >= sizeof(server.sun_path)) {
+      std::cout << "The i-PI socket name is too long." << std::endl;
+      fail();
+    }
+    std::copy(path.begin(), path.end(), server.sun_path);
+    const int socketUnix = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(socketUnix, (sockaddr*)&server, sizeof(server)) == 0)
+      result = socketUnix;
+    else
+      close(socketUnix);
+  } else {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* list = nullptr;
+    if (getaddrinfo(address[1].c_str(), address[2].c_str(), &hints, &list))
+      list = nullptr;
+    for (addrinfo* p = list; p && result < 0; p = p->ai_next) {
+      const int socketInet = socket(p->ai_family, p->ai_socktype, 0);
+      if (connect(socketInet, p->ai_addr, p->ai_addrlen) == 0) {
+        const int flag = 1; // small messages are sent at once
+        setsockopt(socketInet, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        result = socketInet;
+      } else {
+        close(socketInet);
+      }
+    }
+    if (list)
+      freeaddrinfo(list);
+  }
+  if (result < 0) {
+    std::cout << "Failed to connect to the i-PI server." << std::endl;
+    fail();
+  }
+  return result;
+}
+
+// the positions and cell of POSDATA; a new cell forces a neighbor list
+// update, and each position is taken as the periodic image closest to the
+// previous one, so that the list is only updated when atoms move
+void setIpiPositions(Atom& atom, const double* cell, const double* r)
+{
+  bool isNewBox = false;
+  for (int k = 0; k < 9; ++k) {
+    const double value = cell[k] * BOHR;
+    isNewBox = isNewBox || value != atom.box[k];
+    atom.box[k] = value;
+  }
+  if (isNewBox) {
+    getInverseBox(atom.box);
+    std::fill(atom.x0.begin(), atom.x0.end(), 1.0e10);
+  }
+  for (int n = 0; n < atom.number; ++n) {
+    double x = r[n * 3 + 0] * BOHR;
+    double y = r[n * 3 + 1] * BOHR;
+    double z = r[n * 3 + 2] * BOHR;
+    if (!isNewBox) {
+      x -= atom.x[n];
+      y -= atom.y[n];
+      z -= atom.z[n];
+      applyMic(atom.box, atom.pbc, x, y, z);
+      x += atom.x[n];
+      y += atom.y[n];
+      z += atom.z[n];
+    }
+    atom.x[n] = x;
+    atom.y[n] = y;
+    atom.z[n] = z;
+  }
+}
+
+void runIpiClient(Atom& atom)
+{
+  std::signal(SIGPIPE, SIG_IGN); // a closed server is an error from send
+  const int socket = connectIpi(atom.ipiAddress);
+  atom.isVirial = true;
+  atom.virial.resize(atom.number * 9);
+  std::cout << "Connected to the i-PI server." << std::endl;
+  std::fill(atom.box, atom.box + 9, 0.0); // the first POSDATA sets the box
+  std::vector<double> buffer(atom.number * 3);
+  double virial[9];
+  bool hasData = false;
+  int numRequests = 0;
+  while (true) {
+    char header[IPI_HEADER_SIZE + 1] = {};
+    readSocket(socket, header, IPI_HEADER_SIZE);
+    std::string message(header);
+    message.erase(message.find_last_not_of(' ') + 1);
+    if (message == "STATUS") {
+      writeHeader(socket, hasData ? "HAVEDATA" : "READY");
+    } else if (message == "INIT") {
+      int32_t bead, size;
+      readSocket(socket, &bead, 4);
+      readSocket(socket, &size, 4);
+      std::vector<char> text(size);
+      readSocket(socket, text.data(), size);
+    } else if (message == "POSDATA") {
+      double cell[9], cellInverse[9];
+      int32_t number;
+      readSocket(socket, cell, sizeof(cell));
+      readSocket(socket, cellInverse, sizeof(cellInverse));
+      readSocket(socket, &number, 4);
+      if (number != atom.number) {
+        std::cout << "i-PI sent " << number << " atoms instead of "
+                  << atom.number << std::endl;
+        fail();
+      }
+      readSocket(socket, buffer.data(), buffer.size() * sizeof(double));
+      setIpiPositions(atom, cell, buffer.data());
+      if (atom.neighbor_flag != 0 && atom.neighbor_flag != 4)
+        findNeighbor(atom);
+      findForce(atom);
+      findVirial(atom, virial);
+      hasData = true;
+      ++numRequests;
+    } else if (message == "GETFORCE") {
+      if (!hasData) {
+        std::cout << "i-PI asked for forces before sending positions."
+                  << std::endl;
+        fail();
+      }
+      const double pe = atom.pe / HARTREE;
+      const int32_t number = atom.number;
+      for (int n = 0; n < atom.number; ++n) {
+        buffer[n * 3 + 0] = atom.fx[n] * BOHR / HARTREE;
+        buffer[n * 3 + 1] = atom.fy[n] * BOHR / HARTREE;
+        buffer[n * 3 + 2] = atom.fz[n] * BOHR / HARTREE;
+      }
+      for (int k = 0; k < 9; ++k)
+        virial[k] /= HARTREE;
+      const int32_t extraSize = 0;
+      writeHeader(socket, "FORCEREADY");
+      writeSocket(socket, &pe, sizeof(pe));
+      writeSocket(socket, &number, 4);
+      writeSocket(socket, buffer.data(), buffer.size() * sizeof(double));
+      writeSocket(socket, virial, sizeof(virial));
+      writeSocket(socket, &extraSize, 4);
+      hasData = false;
+    } else if (message == "EXIT") {
+      break;
+    } else {
+      std::cout << "Unknown i-PI message " << message << std::endl;
+      fail();
+    }
+  }
+  close(socket);
+  std::cout << numRequests << " i-PI force requests, " << atom.numUpdates
+            << " neighbor list updates" << std::endl;
+}
+#else
+void runIpiClient(Atom& atom)
+{
+  std::cout << "ipi is not supported on Windows." << std::endl;
+  fail();
+}
+#endif
+
+// pressure in GPa from the kinetic energy and the virial of the last
+// findForce with atom.isVirial
+double findPressure(Atom& atom, const double kineticEnergy)
+{
+  double virial[9];
+  findVirial(atom, virial);
+  const double volume = std::abs(getDet(atom.box));
+  const double trace = 2.0 * kineticEnergy + virial[0] + virial[4] + virial[8];
+  return trace / (3.0 * volume) * PRESSURE_UNIT_CONVERSION;
+}
+
+// Live metrics for tools/mdtop.cpp in the POSIX shared memory /md_<name>,
+// with the layout of md_monitor.h
+#ifndef _WIN32
+struct Monitor {
+  std::string path;
+  size_t size;
+  MonitorHeader* header;
+  MonitorRecord* records;
+  std::chrono::steady_clock::time_point tLap, tRecord;
+  double phaseTime[4] = {0.0, 0.0, 0.0, 0.0};
+  double timeRecord = 0.0;
+
+  Monitor(const Atom& atom, const std::string& program, const int numSteps)
+    : path("/md_" + atom.monitorName)
+  {
+    size = sizeof(MonitorHeader) + sizeof(MonitorRecord) * MONITOR_SLOTS;
+    const int fd = shm_open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+      std::cout << "Failed to create the shared memory " << path << std::endl;
+      fail();
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      std::cout << "Failed to map the shared memory " << path << std::endl;
+      fail();
+    }
+    header = (MonitorHeader*)data; // zero-filled by ftruncate
+    records = (MonitorRecord*)(header + 1);
+    std::string("mdtop").copy(header->magic, sizeof(header->magic) - 1);
+    program.copy(header->program, sizeof(header->program) - 1);
+    header->numSlots = MONITOR_SLOTS;
+    header->recordSize = sizeof(MonitorRecord);
+    header->pid = getpid();
+    header->numAtoms = atom.number;
+    header->numSteps = numSteps;
+    header->isRunning.store(1);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->version = MONITOR_VERSION; // the reader checks this last
+    tLap = tRecord = std::chrono::steady_clock::now();
+    std::cout << "Metrics in the shared memory " << path << std::endl;
+  }
+
+  ~Monitor()
+  {
+    header->isRunning.store(0, std::memory_order_release);
+    munmap(header, size);
+    shm_unlink(path.c_str()); // a reader keeps its mapping
+  }
+
+  // adds the time since the previous lap to phase
+  void lap(const int phase)
+  {
+    const auto t = std::chrono::steady_clock::now();
+    phaseTime[phase] += std::chrono::duration<double>(t - tLap).count();
+    tLap = t;
+  }
+
+  void publish(
+    const Atom& atom, const int step, const double time, const double T,
+    const double pressure)
+  {
+    const auto t = std::chrono::steady_clock::now();
+    const double wallTime = std::chrono::duration<double>(t - tRecord).count();
+    const double fs = (time - timeRecord) * TIME_UNIT_CONVERSION;
+    tRecord = t;
+    timeRecord = time;
+
+    const uint64_t index = header->numRecords.load(std::memory_order_relaxed);
+    MonitorRecord& record = records[index % MONITOR_SLOTS];
+    const uint64_t sequence = record.sequence.load(std::memory_order_relaxed);
+    record.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.index = index;
+    record.step = step;
+    record.numUpdates = atom.numUpdates;
+    record.time = time * TIME_UNIT_CONVERSION / 1000.0;
+    record.temperature = T;
+    record.pe = atom.pe;
+    record.pressure = pressure;
+    record.nsPerDay = wallTime > 0.0 ? fs * 1.0e-6 / (wallTime / 86400.0) : 0.0;
+    std::copy(phaseTime, phaseTime + 4, record.phaseTime);
+    record.sequence.store(sequence + 2, std::memory_order_release);
+    header->numRecords.store(index + 1, std::memory_order_release);
+  }
+};
+#else
+struct Monitor {
+  Monitor(const Atom& atom, const std::string& program, const int numSteps)
+  {
+    std::cout << "monitor is not supported on Windows." << std::endl;
+    fail();
+  }
+  void lap(const int phase) {}
+  void publish(
+    const Atom& atom, const int step, const double time, const double T,
+    const double pressure)
+  {
+  }
+};
+#endif
+
+// the C interface in md2.h, with time in fs and other units as in run.in
+struct md2_system {
+  Atom atom;
+  int numSteps = 0;
+  double timeStep = 1.0; // fs
+  double temperature = 0.0;
+  bool isForceValid = false;
+};
+
+int md2_abi_version(void) { return MD2_ABI_VERSION; }
+
+md2_system* md2_create(void) { return new md2_system; }
+
+void md2_destroy(md2_system* system) { delete system; }
+
+int md2_command(md2_system* system, const char* line)
+{
+  try {
+    std::istringstream iss(line);
+    std::vector<std::string> tokens{
+      std::istream_iterator<std::string>{iss},
+      std::istream_iterator<std::string>{}};
+    if (tokens.size() == 0)
+      return 0;
+    // before parseRunLine, so that a rejected line leaves no state behind
+    const std::string& keyword = tokens[0];
+    if (
+      keyword == "lattice" || keyword == "basis" || keyword == "plugin" ||
+      keyword == "ipi" || keyword == "monitor" ||
+      keyword == "adaptive_time_step" || keyword == "neighbor_async" ||
+      (keyword == "neighbor_flag" && tokens.size() > 1 &&
+       tokens[1] == "auto")) {
+      std::cout << tokens[0] << " is not supported in library mode."
+                << std::endl;
+      fail();
+    }
+    parseRunLine(
+      tokens, system->numSteps, system->timeStep, system->temperature,
+      system->atom);
+  } catch (const InputError&) {
+    return 1;
+  }
+  return 0;
+}
+
+int md2_set_atoms(
+  md2_system* system,
+  int number,
+  const double* box,
+  const int* pbc,
+  const double* mass,
+  const double* x,
+  const double* y,
+  const double* z)
+{
+  try {
+    Atom& atom = system->atom;
+    if (number < 1) {
+      std::cout << "number of atoms should >= 1." << std::endl;
+      fail();
+    }
+    atom.number = number;
+    allocateMemory(atom);
+    for (int d1 = 0; d1 < 3; ++d1) {
+      for (int d2 = 0; d2 < 3; ++d2) {
+        atom.box[d2 * 3 + d1] = box[d1 * 3 + d2];
+      }
+    }
+    getInverseBox(atom.box);
+    for (int d = 0; d < 3; ++d)
+      atom.pbc[d] = pbc ? pbc[d] : 1;
+    if (
+      (atom.neighbor_flag == 3 || atom.neighbor_flag == 4) &&
+      (!atom.pbc[0] || !atom.pbc[1] || !atom.pbc[2])) {
+      std::cout << "neighbor_flag 3 and 4 need a fully periodic box."
+                << std::endl;
+      fail();
+    }
+    if (atom.isCompressed && atom.neighbor_flag == 3) {
+      std::cout << "neighbor_compress cannot be used with neighbor_flag 3."
+                << std::endl;
+      fail();
+    }
+    std::copy(mass, mass + number, atom.mass.begin());
+    std::copy(x, x + number, atom.x.begin());
+    std::copy(y, y + number, atom.y.begin());
+    std::copy(z, z + number, atom.z.begin());
+    // x0 of the last neighbor list update is far away to force the first one
+    std::fill(atom.x0.begin(), atom.x0.end(), 1.0e10);
+    initializeVelocity(system->temperature, atom);
+    system->isForceValid = false;
+  } catch (const InputError&) {
+    return 1;
+  }
+  return 0;
+}
+
+void md2_set_positions(
+  md2_system* system, const double* x, const double* y, const double* z)
+{
+  Atom& atom = system->atom;
+  std::copy(x, x + atom.number, atom.x.begin());
+  std::copy(y, y + atom.number, atom.y.begin());
+  std::copy(z, z + atom.number, atom.z.begin());
+  system->isForceValid = false;
+}
+
+double md2_compute(md2_system* system)
+{
+  Atom& atom = system->atom;
+  system->isForceValid = false;
+  try {
+    if (atom.neighbor_flag != 0 && atom.neighbor_flag != 4)
+      findNeighbor(atom);
+    findForce(atom);
+  } catch (const InputError&) {
+    return NAN;
+  }
+  system->isForceValid = true;
+  return atom.pe;
+}
+
+double md2_step(md2_system* system, int num_steps)
+{
+  Atom& atom = system->atom;
+  if (atom.nhcLength > 0 && system->temperature <= 0.0) {
+    std::cout << "thermostat needs a temperature > 0." << std::endl;
+    return NAN;
+  }
+  if (!system->isForceValid && std::isnan(md2_compute(system)))
+    return NAN;
+  const double timeStep = system->timeStep / TIME_UNIT_CONVERSION;
+  system->isForceValid = false;
+  try {
+    for (int step = 0; step < num_steps; ++step) {
+      if (atom.neighbor_flag != 0 && atom.neighbor_flag != 4)
+        findNeighbor(atom);
+      if (atom.nhcLength > 0)
+        applyMassiveNhc(atom, system->temperature, timeStep * 0.5);
+      integrate(true, timeStep, atom);
+      findForce(atom);
+      integrate(false, timeStep, atom);
+      if (atom.nhcLength > 0)
+        applyMassiveNhc(atom, system->temperature, timeStep * 0.5);
+    }
+  } catch (const InputError&) {
+    return NAN;
+  }
+  system->isForceValid = true;
+  return atom.pe;
+}
+
+double md2_kinetic_energy(md2_system* system)
+{
+  return findKineticEnergy(system->atom);
+}
+
+int md2_number(const md2_system* system) { return system->atom.number; }
+
+double* md2_array(md2_system* system, int name)
+{
+  Atom& atom = system->atom;
+  std::vector<double>* arrays[] = {
+    &atom.mass, &atom.x,  &atom.y,  &atom.z,  &atom.vx,    &atom.vy,
+    &atom.vz,   &atom.fx, &atom.fy, &atom.fz, &atom.energy};
+  if (name < MD2_MASS || name > MD2_ENERGY) {
+    std::cout << "md2_array has no array " << name << std::endl;
+    return nullptr;
+  }
+  return arrays[name]->data();
+}
+
+#ifndef MD2_LIBRARY
 int main(int argc, char** argv)
 {
   int numSteps;
@@ -621,30 +3385,148 @@ int main(int argc, char** argv)
   Atom atom;
   readRun(numSteps, timeStep, temperature, atom);
   timeStep /= TIME_UNIT_CONVERSION; // from fs to natural unit
-  readXyz(atom);
+  if (atom.lattice.name.empty())
+    readXyz(atom);
+  else
+    buildLattice(atom);
+  if (
+    (atom.neighbor_flag == 3 || atom.neighbor_flag == 4) &&
+    (!atom.pbc[0] || !atom.pbc[1] || !atom.pbc[2])) {
+    std::cout << "neighbor_flag 3 and 4 need a fully periodic box."
+              << std::endl;
+    exit(1);
+  }
+  if (atom.isCompressed && atom.neighbor_flag == 3) {
+    std::cout << "neighbor_compress cannot be used with neighbor_flag 3."
+              << std::endl;
+    exit(1);
+  }
+  if (!atom.ipiAddress.empty()) {
+    runIpiClient(atom);
+    return 0;
+  }
   initializeVelocity(temperature, atom);
+  if (atom.nhcLength > 0 && temperature <= 0.0) {
+    std::cout << "thermostat needs a temperature > 0." << std::endl;
+    exit(1);
+  }
+  if (atom.isAutoNeighbor) {
+    calibrateNeighbor(atom);
+    chooseNeighborAuto(atom, timeStep, 0);
+  }
+  if (
+    atom.asyncFraction > 0 && atom.neighbor_flag != 1 &&
+    atom.neighbor_flag != 2) {
+    std::cout << "neighbor_async needs neighbor_flag 1 or 2." << std::endl;
+    exit(1);
+  }
+  NeighborBuilder builder;
 
   const clock_t tStart = clock();
-  std::ofstream ofile("thermo.out");
-  ofile << std::fixed << std::setprecision(16);
+  AsyncWriter thermo("thermo.out", atom.flushInterval);
+  std::signal(SIGINT, handleSignal); // stop cleanly and keep thermo.out
+  std::signal(SIGTERM, handleSignal);
 
-  for (int step = 0; step < numSteps; ++step) {
-    if (atom.neighbor_flag != 0)
+  // with an adaptive time step, the run covers the time numSteps * timeStep
+  // and thermo.out is resampled on the grid of the fixed-step run
+  const bool isAdaptive = atom.maxDisplacement > 0.0;
+  const double totalTime = numSteps * timeStep;
+  double sampleTime = timeStep;
+  double thermoOld[2] = {0.0, 0.0};
+  const Run run = {
+    atom.number, numSteps, timeStep, temperature, isAdaptive, atom.box,
+    atom.pbc, atom.elements,
+    atom.lattice.name.empty() ? nullptr : atom.lattice.cell};
+  for (const auto& plugin : atom.plugins)
+    plugin->begin(run);
+  std::unique_ptr<Monitor> monitor;
+  if (!atom.monitorName.empty()) {
+    monitor.reset(new Monitor(atom, "md2", numSteps));
+    atom.virial.resize(atom.number * 9);
+  }
+  int step = 0;
+  for (double time = 0.0; time < totalTime - 1.0e-6 * timeStep; ++step) {
+    if (isInterrupted) {
+      std::cout << "Interrupted at step " << step << std::endl;
+      break;
+    }
+    double dt = timeStep;
+    if (isAdaptive)
+      dt = std::min(findTimeStep(atom, timeStep), totalTime - time);
+    if (atom.isAutoNeighbor && step > 0 && step % Nrecheck == 0)
+      chooseNeighborAuto(atom, timeStep, step);
+    if (monitor)
+      monitor->lap(3); // output, plugins and the time step
+    if (atom.asyncFraction > 0)
+      findNeighborAsync(atom, builder);
+    else if (atom.neighbor_flag != 0 && atom.neighbor_flag != 4)
       findNeighbor(atom);
-    integrate(true, timeStep, atom);  // step 1 in the book
-    findForce(atom);                  // step 2 in the book
-    integrate(false, timeStep, atom); // step 3 in the book
-    if (step % Ns == 0) {
+    if (monitor)
+      monitor->lap(0);
+    if (atom.nhcLength > 0)
+      applyMassiveNhc(atom, temperature, dt * 0.5);
+    integrate(true, dt, atom); // step 1 in the book
+    if (monitor)
+      monitor->lap(2);
+    atom.isVirial = monitor && step % atom.monitorInterval == 0;
+    findForce(atom); // step 2 in the book
+    if (monitor)
+      monitor->lap(1);
+    integrate(false, dt, atom); // step 3 in the book
+    if (atom.nhcLength > 0)
+      applyMassiveNhc(atom, temperature, dt * 0.5);
+    if (monitor)
+      monitor->lap(2);
+    time += dt;
+    if (!atom.plugins.empty())
+      runPlugins(atom, step, time);
+    if (isAdaptive) {
+      const double kineticEnergy = findKineticEnergy(atom);
+      while (sampleTime < time + 1.0e-6 * timeStep) {
+        const double w = (sampleTime - time + dt) / dt;
+        const double ek = (1.0 - w) * thermoOld[0] + w * kineticEnergy;
+        const double pe = (1.0 - w) * thermoOld[1] + w * atom.pe;
+        const double T = ek / (1.5 * K_B * atom.number);
+        const double values[3] = {T, ek, pe};
+        thermo.writeLine(values, 3);
+        sampleTime += Ns * timeStep;
+      }
+      thermoOld[0] = kineticEnergy;
+      thermoOld[1] = atom.pe;
+    } else if (step % Ns == 0) {
+      const double kineticEnergy = findKineticEnergy(atom);
+      const double T = kineticEnergy / (1.5 * K_B * atom.number);
+      const double values[3] = {T, kineticEnergy, atom.pe};
+      thermo.writeLine(values, 3);
+    }
+    if (atom.isVirial) {
       const double kineticEnergy = findKineticEnergy(atom);
       const double T = kineticEnergy / (1.5 * K_B * atom.number);
-      ofile << T << " " << kineticEnergy << " " << atom.pe << std::endl;
+      monitor->publish(atom, step, time, T, findPressure(atom, kineticEnergy));
     }
   }
-  ofile.close();
+  monitor.reset();
+  thermo.close();
+  for (const auto& plugin : atom.plugins)
+    plugin->end();
   const clock_t tStop = clock();
   const float tElapsed = float(tStop - tStart) / CLOCKS_PER_SEC;
   std::cout << atom.numUpdates << " neighbor list updates" << std::endl;
+  if (atom.neighbor_flag == 3)
+    std::cout << atom.numRepairs << " partial neighbor list repairs"
+              << std::endl;
+  if (atom.isCompressed) {
+    const int numPairs = atom.NL8.size() + atom.NL16.size() + atom.NL32.size();
+    const int numBytes =
+      atom.NL8.size() + atom.NL16.size() * 2 + atom.NL32.size() * 4;
+    std::cout << "Compressed neighbor list: " << numBytes << " bytes for "
+              << numPairs << " neighbors" << std::endl;
+  }
+  if (isAdaptive)
+    std::cout << step << " steps, average time step = "
+              << totalTime / step * TIME_UNIT_CONVERSION << " fs" << std::endl;
   std::cout << "Time used = " << tElapsed << " s" << std::endl;
 
   return 0;
 }
+#endif
@@ -0,0 +1,93 @@
+/*----------------------------------------------------------------------------80
+    Copyright 2022 Zheyong Fan
+C interface of md2.cpp built as a library:
+    g++ md2.cpp -O3 -pthread -shared -fPIC -fvisibility=hidden \
+        -DMD2_LIBRARY -o libmd2.so
+Usage:
+    md2_create, md2_command with run.in lines (not lattice, basis, plugin,
+    adaptive_time_step, neighbor_async or neighbor_flag auto), md2_set_atoms
+    and then md2_compute and md2_step in any order. Invalid input prints a
+    message as in the program; md2_command and md2_set_atoms then return 1
+    instead of 0, md2_compute and md2_step NaN and md2_array NULL. After a
+    NaN, call md2_set_atoms before the next md2_compute or md2_step.
+------------------------------------------------------------------------------*/
+
+#ifndef MD2_H
+#define MD2_H
+
+#if defined(_WIN32) && defined(MD2_LIBRARY)
+#define MD2_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define MD2_API __declspec(dllimport)
+#else
+#define MD2_API __attribute__((visibility("default")))
+#endif
+
+#define MD2_ABI_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the per-atom arrays of md2_array
+enum md2_array_name {
+  MD2_MASS,
+  MD2_X,
+  MD2_Y,
+  MD2_Z,
+  MD2_VX,
+  MD2_VY,
+  MD2_VZ,
+  MD2_FX,
+  MD2_FY,
+  MD2_FZ,
+  MD2_ENERGY
+};
+
+typedef struct md2_system md2_system;
+
+MD2_API int md2_abi_version(void);
+
+MD2_API md2_system* md2_create(void);
+
+MD2_API void md2_destroy(md2_system* system);
+
+// one line of run.in, e.g. "time_step 5" or "neighbor_flag 1"
+MD2_API int md2_command(md2_system* system, const char* line);
+
+// box has the 3 cell vectors a, b and c as in xyz.in and pbc can be NULL
+// for a periodic box; the velocities are drawn for the temperature of the
+// velocity command, or are zero
+MD2_API int md2_set_atoms(
+  md2_system* system,
+  int number,
+  const double* box,
+  const int* pbc,
+  const double* mass,
+  const double* x,
+  const double* y,
+  const double* z);
+
+MD2_API void md2_set_positions(
+  md2_system* system, const double* x, const double* y, const double* z);
+
+// forces and per-atom energies at the current positions; returns the
+// potential energy in eV
+MD2_API double md2_compute(md2_system* system);
+
+// num_steps velocity-Verlet steps; returns the potential energy in eV
+MD2_API double md2_step(md2_system* system, int num_steps);
+
+MD2_API double md2_kinetic_energy(md2_system* system);
+
+MD2_API int md2_number(const md2_system* system);
+
+// borrowed pointer to number elements, valid until md2_set_atoms or
+// md2_destroy; call md2_compute after writing positions through it
+MD2_API double* md2_array(md2_system* system, int name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
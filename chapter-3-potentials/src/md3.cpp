@@ -1,48 +1,197 @@
 /*----------------------------------------------------------------------------80
     Copyright 2022 Zheyong Fan
 Compile:
-    g++ md3.cpp -O3 -o md3
+    g++ md3.cpp -O3 -pthread -o md3
+    # add -march=native for the SIMD triplet loops (AVX2 or AVX-512) and
+    # -fno-trapping-math to also vectorize the bond functions
+    # or build a library with the C interface in md3.h; see there
 Run:
     path/to/md3.out # Linux
     path\to\md3.exe # Windows
 Inputs:
-    xyz.in and run.in
+    xyz.in and run.in (and nep.txt for "potential nep nep.txt"); no xyz.in
+    if run.in has a lattice line
+Outputs:
+    thermo.out (and kappa.txt for "hnemd x|y|z Fe [equilibration_steps]");
+    with an ipi line, md3 is a force client of an i-PI server instead; with
+    "monitor name [interval]", live metrics for tools/mdtop.cpp
 ------------------------------------------------------------------------------*/
 
+#include <algorithm> // std::min
+#include <atomic>   // std::atomic
+#include <chrono>   // std::chrono::duration
 #include <cmath>    // sqrt() function
+#include <csignal>  // std::signal
+#include <cstdint>  // int32_t
+#include <cstdio>   // snprintf
+#include <cstring>  // std::memcpy
 #include <ctime>    // for timing
 #include <fstream>  // file
 #include <iomanip>  // std::setprecision
 #include <iostream> // input/output
 #include <iterator>
+#include <memory>  // std::unique_ptr
+#include <mutex>   // std::mutex
 #include <sstream> // std::istringstream
 #include <string>  // string
+#include <thread>  // std::thread
+#include <unordered_map> // std::unordered_map
 #include <vector>  // vector
 
+#ifndef _WIN32 // for the i-PI client and the monitor
+#include <fcntl.h>       // O_CREAT
+#include <netdb.h>       // getaddrinfo
+#include <netinet/in.h>  // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <sys/mman.h>    // shm_open
+#include <sys/socket.h>  // socket
+#include <sys/un.h>      // sockaddr_un
+#include <unistd.h>      // close
+#endif
+
+#include "../../common/async_writer.h" // AsyncWriter and handleSignal
+#include "../../common/fast_exp.h"     // fastExp and fastExpInRange
+#include "../../common/md_monitor.h"  // MonitorRecord and MonitorHeader
+#include "md3.h"
+
 const int Ns = 100;             // output frequency
 const double K_B = 8.617343e-5; // Boltzmann's constant in natural unit
 const double TIME_UNIT_CONVERSION = 1.018051e+1; // from natural unit to fs
+const double KAPPA_UNIT_CONVERSION = 1.573769e+5; // to W/(mK)
+const double PRESSURE_UNIT_CONVERSION = 1.602177e+2; // from eV/A^3 to GPa
+
+// Invalid input prints a message and ends the program; in the library it
+// ends the call of the C interface instead, which then returns an error.
+struct InputError {};
+#ifdef MD3_LIBRARY
+[[noreturn]] void fail() { throw InputError(); }
+#else
+[[noreturn]] void fail() { exit(1); }
+#endif
+
+const int NEP_MAX_N = 19;     // largest n_max
+const int NEP_MAX_BASIS = 20; // largest basis_size + 1
+const int NEP_MAX_DIM = 160;  // largest number of descriptors
+const int NEP_NUM_S = 24;     // s components for l = 1, 2, 3, 4
+
+// NEP3 or NEP4 potential of GPUMD, read from nep.txt; see find_force_nep
+struct NEP {
+  int version = 0; // 0 for Tersoff
+  int numTypes = 0;
+  std::vector<std::string> elements;
+  double rcRadial, rcAngular;
+  int nMaxRadial, nMaxAngular;
+  int basisSizeRadial, basisSizeAngular;
+  int lMax, lMax4 = 0, lMax5 = 0; // 3-body l_max; 4- and 5-body on if > 0
+  int dim, numNeurons;
+  std::vector<double> ann, c, qScaler;
+};
+
+// crystal built from the lattice and basis keywords of run.in instead of
+// reading xyz.in; see readLattice and buildLattice
+struct Lattice {
+  std::string name; // empty to read xyz.in
+  double cell[9];   // the cell vectors a, b and c, one per row
+  int size[3];      // number of cells along a, b and c
+  int pbc[3] = {1, 1, 1};
+  std::vector<std::string> elements; // of the basis atoms
+  std::vector<double> masses, basis; // basis in fractional coordinates
+  double displacement = 0.0;         // largest random displacement
+  double vacancyFraction = 0.0;
+  double alloyFraction = 0.0; // of the atoms that become alloyElement
+  std::string alloyElement;
+  double alloyMass;
+  unsigned long long seed = 0; // from the clock if 0, unless DEBUG
+};
 
 struct Atom {
   int number;
   int numUpdates = 0;
   int neighbor_flag = 2;
+  int numRepairs = 0;
+  double rebuildFraction = 0.2;
+  double maxDisplacement = 0.0; // adaptive time step if > 0
+  double maxEnergyChange = 0.0;
+  double flushInterval = 1.0; // s
   const int MN = 1000;
   double cutoffNeighbor = 3.1;
   double box[18];
+  int pbc[3] = {1, 1, 1};
   double pe;
+  int reductionBlock = 256; // atoms per block in sumAtoms
+  bool isCompensated = false;
+  std::vector<double> energy; // of each atom
   std::vector<int> NN, NL;
+  int numCells[4];
+  std::vector<int> cellCount, cellCountSum, cellContents, isDirty, dirtyAtoms;
+  std::vector<double> pad;
   std::vector<double> mass, x0, y0, z0, x, y, z, vx, vy, vz, fx, fy, fz, b, bp;
+  const int MB = 50;        // maximum number of bonds of an atom
+  std::vector<int> NB, BL; // bonds within the Tersoff cutoff
+  std::vector<double> bx, by, bz, bd, fc, fcp, fa, fap; // of each bond
+  NEP nep;
+  Lattice lattice;
+  int numThreads = 1;
+  std::vector<int> type; // index in nep.elements
+  std::vector<double> Fp, sumFxyz;
+  bool isHnemd = false;
+  int hnemdDirection = 0;
+  double hnemdFe = 0.0;           // driving force parameter in 1/A
+  double fe[3] = {0.0, 0.0, 0.0}; // zero during the equilibration
+  int numEquilibrationSteps = 0;
+  std::vector<double> hx, hy, hz; // heat current of each atom
+  double hc[3];
+  bool isVirial = false;
+  std::vector<double> virial; // W of each atom, row-major
+  std::vector<std::string> ipiAddress; // unix name, or inet host and port
+  std::string monitorName;
+  int monitorInterval = Ns;
+  int nhcLength = 0; // massive Nose-Hoover chains if > 0
+  double nhcTau;
+  std::vector<double> etaPos, etaVel; // [m * number + n]
 };
 
+// Sum of value(n) over the atoms in an order that only depends on the number
+// of atoms and atom.reductionBlock: each block of reductionBlock atoms is
+// summed in turn, with Kahan compensation if atom.isCompensated, and the block
+// sums are added pairwise in a binary tree. The kernels write per-atom values
+// rather than share one accumulator, so the sums are bit-identical for any
+// number of threads.
+template <typename Value>
+double sumAtoms(const Atom& atom, const Value& value)
+{
+  const int blockSize = atom.reductionBlock;
+  const int numBlocks = (atom.number + blockSize - 1) / blockSize;
+  std::vector<double> sums(numBlocks, 0.0);
+  for (int b = 0; b < numBlocks; ++b) {
+    const int end = std::min(atom.number, (b + 1) * blockSize);
+    double sum = 0.0;
+    double error = 0.0;
+    for (int n = b * blockSize; n < end; ++n) {
+      if (atom.isCompensated) {
+        const double y = value(n) - error;
+        const double s = sum + y;
+        error = (s - sum) - y;
+        sum = s;
+      } else {
+        sum += value(n);
+      }
+    }
+    sums[b] = sum;
+  }
+  for (int stride = 1; stride < numBlocks; stride *= 2)
+    for (int b = 0; b + stride < numBlocks; b += 2 * stride)
+      sums[b] += sums[b + stride];
+  return numBlocks > 0 ? sums[0] : 0.0;
+}
+
 double findKineticEnergy(const Atom& atom)
 {
-  double kineticEnergy = 0.0;
-  for (int n = 0; n < atom.number; ++n) {
+  const double kineticEnergy = sumAtoms(atom, [&](const int n) {
     double v2 = atom.vx[n] * atom.vx[n] + atom.vy[n] * atom.vy[n] +
                 atom.vz[n] * atom.vz[n];
-    kineticEnergy += atom.mass[n] * v2;
-  }
+    return atom.mass[n] * v2;
+  });
   return kineticEnergy * 0.5;
 }
 
@@ -136,14 +285,18 @@ void applyMicOne(double& x12)
     x12 -= 1.0;
 }
 
-void applyMic(const double* box, double& x12, double& y12, double& z12)
+void applyMic(
+  const double* box, const int* pbc, double& x12, double& y12, double& z12)
 {
   double sx12 = box[9] * x12 + box[10] * y12 + box[11] * z12;
   double sy12 = box[12] * x12 + box[13] * y12 + box[14] * z12;
   double sz12 = box[15] * x12 + box[16] * y12 + box[17] * z12;
-  applyMicOne(sx12);
-  applyMicOne(sy12);
-  applyMicOne(sz12);
+  if (pbc[0])
+    applyMicOne(sx12);
+  if (pbc[1])
+    applyMicOne(sy12);
+  if (pbc[2])
+    applyMicOne(sz12);
   x12 = box[0] * sx12 + box[1] * sy12 + box[2] * sz12;
   y12 = box[3] * sx12 + box[4] * sy12 + box[5] * sz12;
   z12 = box[6] * sx12 + box[7] * sy12 + box[8] * sz12;
@@ -173,21 +326,29 @@ void applyPbcOne(double& sx)
   }
 }
 
-void applyPbc(Atom& atom)
+void applyPbc(Atom& atom, const int n)
 {
-  for (int n = 0; n < atom.number; ++n) {
-    double sx = atom.box[9] * atom.x[n] + atom.box[10] * atom.y[n] +
-                atom.box[11] * atom.z[n];
-    double sy = atom.box[12] * atom.x[n] + atom.box[13] * atom.y[n] +
-                atom.box[14] * atom.z[n];
-    double sz = atom.box[15] * atom.x[n] + atom.box[16] * atom.y[n] +
-                atom.box[17] * atom.z[n];
+  double sx = atom.box[9] * atom.x[n] + atom.box[10] * atom.y[n] +
+              atom.box[11] * atom.z[n];
+  double sy = atom.box[12] * atom.x[n] + atom.box[13] * atom.y[n] +
+              atom.box[14] * atom.z[n];
+  double sz = atom.box[15] * atom.x[n] + atom.box[16] * atom.y[n] +
+              atom.box[17] * atom.z[n];
+  if (atom.pbc[0])
     applyPbcOne(sx);
+  if (atom.pbc[1])
     applyPbcOne(sy);
+  if (atom.pbc[2])
     applyPbcOne(sz);
-    atom.x[n] = atom.box[0] * sx + atom.box[1] * sy + atom.box[2] * sz;
-    atom.y[n] = atom.box[3] * sx + atom.box[4] * sy + atom.box[5] * sz;
-    atom.z[n] = atom.box[6] * sx + atom.box[7] * sy + atom.box[8] * sz;
+  atom.x[n] = atom.box[0] * sx + atom.box[1] * sy + atom.box[2] * sz;
+  atom.y[n] = atom.box[3] * sx + atom.box[4] * sy + atom.box[5] * sz;
+  atom.z[n] = atom.box[6] * sx + atom.box[7] * sy + atom.box[8] * sz;
+}
+
+void applyPbc(Atom& atom)
+{
+  for (int n = 0; n < atom.number; ++n) {
+    applyPbc(atom, n);
   }
 }
 
@@ -213,7 +374,7 @@ void findNeighborON2(Atom& atom)
       double xij = atom.x[j] - x1;
       double yij = atom.y[j] - y1;
       double zij = atom.z[j] - z1;
-      applyMic(atom.box, xij, yij, zij);
+      applyMic(atom.box, atom.pbc, xij, yij, zij);
       const double distanceSquare = xij * xij + yij * yij + zij * zij;
       if (distanceSquare < cutoffSquare) {
         atom.NL[i * atom.MN + atom.NN[i]++] = j;
@@ -221,12 +382,12 @@ void findNeighborON2(Atom& atom)
         if (atom.NN[i] > atom.MN) {
           std::cout << "Error: number of neighbors for atom " << i
                     << " exceeds " << atom.MN << std::endl;
-          exit(1);
+          fail();
         }
         if (atom.NN[j] > atom.MN) {
           std::cout << "Error: number of neighbors for atom " << j
                     << " exceeds " << atom.MN << std::endl;
-          exit(1);
+          fail();
         }
       }
     }
@@ -255,8 +416,115 @@ void findCell(
   cell[3] = cell[0] + numCells[0] * (cell[1] + numCells[1] * cell[2]);
 }
 
+long long getCellKey(const int* cell)
+{
+  const long long offset = 1 << 20; // cells may have negative indices
+  return ((cell[0] + offset) << 42) | ((cell[1] + offset) << 21) |
+         (cell[2] + offset);
+}
+
+// Used for boxes that are open in at least one direction. Only occupied cells
+// are stored (keyed by their integer coordinates), so vacuum padding around a
+// slab or a cluster costs neither memory nor loop time.
+void findNeighborHashed(Atom& atom)
+{
+  const double cutoffInverse = 1.0 / atom.cutoffNeighbor;
+  const double cutoffSquare = atom.cutoffNeighbor * atom.cutoffNeighbor;
+  double thickness[3];
+  getThickness(atom, thickness);
+  int numCells[3];
+  for (int d = 0; d < 3; ++d) {
+    numCells[d] = floor(thickness[d] * cutoffInverse);
+    if (atom.pbc[d] && numCells[d] < 3) {
+      std::cout << "Error: box is too thin in periodic direction " << d
+                << " for the cell list." << std::endl;
+      fail();
+    }
+  }
+
+  std::vector<int> atomCell(atom.number * 3);
+  std::vector<int> cellIndex(atom.number);
+  std::vector<int> cellCount;
+  std::unordered_map<long long, int> cellMap;
+  cellMap.reserve(atom.number);
+  for (int n = 0; n < atom.number; ++n) {
+    const double r[3] = {atom.x[n], atom.y[n], atom.z[n]};
+    int* cell = atomCell.data() + n * 3;
+    for (int d = 0; d < 3; ++d) {
+      const double* g = atom.box + 9 + d * 3;
+      const double s = g[0] * r[0] + g[1] * r[1] + g[2] * r[2];
+      cell[d] = floor(s * thickness[d] * cutoffInverse);
+      if (atom.pbc[d] && cell[d] < 0)
+        cell[d] += numCells[d];
+      if (atom.pbc[d] && cell[d] >= numCells[d])
+        cell[d] -= numCells[d];
+    }
+    auto result = cellMap.emplace(getCellKey(cell), cellCount.size());
+    if (result.second)
+      cellCount.push_back(0);
+    cellIndex[n] = result.first->second;
+    ++cellCount[cellIndex[n]];
+  }
+
+  std::vector<int> cellCountSum(cellCount.size(), 0);
+  for (int i = 1; i < int(cellCount.size()); ++i) {
+    cellCountSum[i] = cellCountSum[i - 1] + cellCount[i - 1];
+  }
+  std::fill(cellCount.begin(), cellCount.end(), 0);
+  std::vector<int> cellContents(atom.number, 0);
+  for (int n = 0; n < atom.number; ++n) {
+    const int c = cellIndex[n];
+    cellContents[cellCountSum[c] + cellCount[c]++] = n;
+  }
+
+  std::fill(atom.NN.begin(), atom.NN.end(), 0);
+
+  for (int n1 = 0; n1 < atom.number; ++n1) {
+    const double r1[3] = {atom.x[n1], atom.y[n1], atom.z[n1]};
+    const int* cell = atomCell.data() + n1 * 3;
+    for (int offset = 0; offset < 27; ++offset) {
+      int neighborCell[3] = {
+        cell[0] + offset % 3 - 1, cell[1] + offset / 3 % 3 - 1,
+        cell[2] + offset / 9 - 1};
+      for (int d = 0; d < 3; ++d) {
+        if (atom.pbc[d] && neighborCell[d] < 0)
+          neighborCell[d] += numCells[d];
+        if (atom.pbc[d] && neighborCell[d] >= numCells[d])
+          neighborCell[d] -= numCells[d];
+      }
+      const auto found = cellMap.find(getCellKey(neighborCell));
+      if (found == cellMap.end())
+        continue;
+      const int c = found->second;
+      for (int m = 0; m < cellCount[c]; ++m) {
+        const int n2 = cellContents[cellCountSum[c] + m];
+        if (n1 < n2) {
+          double x12 = atom.x[n2] - r1[0];
+          double y12 = atom.y[n2] - r1[1];
+          double z12 = atom.z[n2] - r1[2];
+          applyMic(atom.box, atom.pbc, x12, y12, z12);
+          const double d2 = x12 * x12 + y12 * y12 + z12 * z12;
+          if (d2 < cutoffSquare) {
+            atom.NL[n1 * atom.MN + atom.NN[n1]++] = n2;
+              atom.NL[n2 * atom.MN + atom.NN[n2]++] = n1;
+            if (atom.NN[n1] > atom.MN || atom.NN[n2] > atom.MN) {
+              std::cout << "Error: number of neighbors exceeds " << atom.MN
+                        << std::endl;
+              fail();
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
 void findNeighborON1(Atom& atom)
 {
+  if (!atom.pbc[0] || !atom.pbc[1] || !atom.pbc[2]) {
+    findNeighborHashed(atom);
+    return;
+  }
   const double cutoffInverse = 1.0 / atom.cutoffNeighbor;
   double cutoffSquare = atom.cutoffNeighbor * atom.cutoffNeighbor;
   double thickness[3];
@@ -323,7 +591,7 @@ void findNeighborON1(Atom& atom)
               double x12 = atom.x[n2] - r1[0];
               double y12 = atom.y[n2] - r1[1];
               double z12 = atom.z[n2] - r1[2];
-              applyMic(atom.box, x12, y12, z12);
+              applyMic(atom.box, atom.pbc, x12, y12, z12);
               const double d2 = x12 * x12 + y12 * y12 + z12 * z12;
               if (d2 < cutoffSquare) {
                 atom.NL[n1 * atom.MN + atom.NN[n1]++] = n2;
@@ -331,12 +599,12 @@ void findNeighborON1(Atom& atom)
                 if (atom.NN[n1] > atom.MN) {
                   std::cout << "Error: number of neighbors for atom " << n1
                             << " exceeds " << atom.MN << std::endl;
-                  exit(1);
+                  fail();
                 }
                 if (atom.NN[n2] > atom.MN) {
                   std::cout << "Error: number of neighbors for atom " << n2
                             << " exceeds " << atom.MN << std::endl;
-                  exit(1);
+                  fail();
                 }
               }
             }
@@ -347,8 +615,179 @@ void findNeighborON1(Atom& atom)
   }
 }
 
+void removeNeighbor(Atom& atom, const int n1, const int n2)
+{
+  const int offset = n1 * atom.MN;
+  for (int k = 0; k < atom.NN[n1]; ++k) {
+    if (atom.NL[offset + k] == n2) {
+      atom.NL[offset + k] = atom.NL[offset + --atom.NN[n1]];
+      return;
+    }
+  }
+}
+
+void addNeighbor(Atom& atom, const int n1, const int n2)
+{
+  atom.NL[n1 * atom.MN + atom.NN[n1]++] = n2;
+  if (atom.NN[n1] > atom.MN) {
+    std::cout << "Error: number of neighbors for atom " << n1 << " exceeds "
+              << atom.MN << std::endl;
+    fail();
+  }
+}
+
+void binAtoms(Atom& atom, const double cellSize)
+{
+  const double cellSizeInverse = 1.0 / cellSize;
+  double thickness[3];
+  getThickness(atom, thickness);
+  for (int d = 0; d < 3; ++d) {
+    atom.numCells[d] = floor(thickness[d] * cellSizeInverse);
+    if (atom.numCells[d] < 3) {
+      std::cout << "Error: box is too thin for neighbor_flag 3." << std::endl;
+      fail();
+    }
+  }
+  atom.numCells[3] = atom.numCells[0] * atom.numCells[1] * atom.numCells[2];
+  atom.cellCount.assign(atom.numCells[3], 0);
+  atom.cellCountSum.assign(atom.numCells[3], 0);
+  atom.cellContents.resize(atom.number);
+
+  int cell[4];
+  for (int n = 0; n < atom.number; ++n) {
+    const double r[3] = {atom.x[n], atom.y[n], atom.z[n]};
+    findCell(atom.box, thickness, r, cellSizeInverse, atom.numCells, cell);
+    ++atom.cellCount[cell[3]];
+  }
+  for (int i = 1; i < atom.numCells[3]; ++i) {
+    atom.cellCountSum[i] = atom.cellCountSum[i - 1] + atom.cellCount[i - 1];
+  }
+  std::fill(atom.cellCount.begin(), atom.cellCount.end(), 0);
+  for (int n = 0; n < atom.number; ++n) {
+    const double r[3] = {atom.x[n], atom.y[n], atom.z[n]};
+    findCell(atom.box, thickness, r, cellSizeInverse, atom.numCells, cell);
+    atom.cellContents[atom.cellCountSum[cell[3]] + atom.cellCount[cell[3]]] = n;
+    ++atom.cellCount[cell[3]];
+  }
+}
+
+// Only the atoms that moved more than half of the skin since their own last
+// list build get new lists. A clean atom n2 may have moved up to pad[n2]
+// since then, so a pair is kept if it is within cutoffNeighbor + pad[n2].
+void findNeighborIncremental(Atom& atom)
+{
+  const double halfSkin = 0.5; // consistent with checkIfNeedUpdate
+  atom.dirtyAtoms.clear();
+  for (int n = 0; n < atom.number; ++n) {
+    const double dx = atom.x[n] - atom.x0[n];
+    const double dy = atom.y[n] - atom.y0[n];
+    const double dz = atom.z[n] - atom.z0[n];
+    const double d2 = dx * dx + dy * dy + dz * dz;
+    if (d2 > halfSkin * halfSkin) {
+      atom.dirtyAtoms.push_back(n);
+    }
+    atom.pad[n] = sqrt(d2);
+  }
+  const int numDirty = atom.dirtyAtoms.size();
+  if (numDirty == 0) {
+    return;
+  }
+
+  const bool isFullRebuild = numDirty > atom.rebuildFraction * atom.number;
+  if (isFullRebuild) {
+    atom.numUpdates++;
+    applyPbc(atom);
+    updateXyz0(atom);
+    atom.dirtyAtoms.resize(atom.number);
+    for (int n = 0; n < atom.number; ++n) {
+      atom.dirtyAtoms[n] = n;
+      atom.isDirty[n] = 1;
+      atom.pad[n] = 0.0;
+      atom.NN[n] = 0;
+    }
+  } else {
+    atom.numRepairs++;
+    for (int n1 : atom.dirtyAtoms) {
+      atom.isDirty[n1] = 1;
+    }
+    for (int n1 : atom.dirtyAtoms) {
+      for (int k = 0; k < atom.NN[n1]; ++k) {
+        const int n2 = atom.NL[n1 * atom.MN + k];
+        if (!atom.isDirty[n2]) {
+          removeNeighbor(atom, n2, n1);
+        }
+      }
+      atom.NN[n1] = 0;
+      applyPbc(atom, n1);
+      atom.x0[n1] = atom.x[n1];
+      atom.y0[n1] = atom.y[n1];
+      atom.z0[n1] = atom.z[n1];
+      atom.pad[n1] = 0.0;
+    }
+  }
+
+  binAtoms(atom, atom.cutoffNeighbor + halfSkin);
+  const int* numCells = atom.numCells;
+  double thickness[3];
+  getThickness(atom, thickness);
+  const double cellSizeInverse = 1.0 / (atom.cutoffNeighbor + halfSkin);
+  int cell[4];
+
+  for (int n1 : atom.dirtyAtoms) {
+    const double r1[3] = {atom.x[n1], atom.y[n1], atom.z[n1]};
+    findCell(atom.box, thickness, r1, cellSizeInverse, numCells, cell);
+    for (int k = -1; k <= 1; ++k) {
+      for (int j = -1; j <= 1; ++j) {
+        for (int i = -1; i <= 1; ++i) {
+          int neighborCell = cell[3] + (k * numCells[1] + j) * numCells[0] + i;
+          if (cell[0] + i < 0)
+            neighborCell += numCells[0];
+          if (cell[0] + i >= numCells[0])
+            neighborCell -= numCells[0];
+          if (cell[1] + j < 0)
+            neighborCell += numCells[1] * numCells[0];
+          if (cell[1] + j >= numCells[1])
+            neighborCell -= numCells[1] * numCells[0];
+          if (cell[2] + k < 0)
+            neighborCell += numCells[3];
+          if (cell[2] + k >= numCells[2])
+            neighborCell -= numCells[3];
+
+          for (int m = 0; m < atom.cellCount[neighborCell]; ++m) {
+            const int n2 =
+              atom.cellContents[atom.cellCountSum[neighborCell] + m];
+            if (n2 == n1) {
+              continue;
+            }
+            double x12 = atom.x[n2] - r1[0];
+            double y12 = atom.y[n2] - r1[1];
+            double z12 = atom.z[n2] - r1[2];
+            applyMic(atom.box, atom.pbc, x12, y12, z12);
+            const double d2 = x12 * x12 + y12 * y12 + z12 * z12;
+            const double cutoff = atom.cutoffNeighbor + atom.pad[n2];
+            if (d2 < cutoff * cutoff) {
+              addNeighbor(atom, n1, n2);
+              if (!atom.isDirty[n2]) {
+                addNeighbor(atom, n2, n1);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for (int n1 : atom.dirtyAtoms) {
+    atom.isDirty[n1] = 0;
+  }
+}
+
 void findNeighbor(Atom& atom)
 {
+  if (atom.neighbor_flag == 3) {
+    findNeighborIncremental(atom);
+    return;
+  }
   if (checkIfNeedUpdate(atom)) {
     atom.numUpdates++;
     applyPbc(atom);
@@ -360,11 +799,90 @@ void findNeighbor(Atom& atom)
   }
 }
 
+// log, pow and sin/cos as inline polynomials with no libm calls, so that the
+// Tersoff loops contain no function calls, as fastExp of fast_exp.h; compile
+// with -DUSE_LIBM to get the libm versions. Largest errors against libm
+// (checked with 1e7 samples):
+//   fastLog(x), normal x > 0: 2 ulp
+//   fastPow(x, y), x >= 0: about 4 ulp per unit of |y * log(x)|, which is
+//     29 ulp for (beta * zeta)^n and 1 ulp for (1 + bzn)^(-1/2n) in Tersoff
+//   fastSinCos(x), |x| < 1e5: 2.3e-16 absolute
+inline double fastLog(const double x)
+{
+#ifdef USE_LIBM
+  return log(x);
+#else
+  const double ln2Hi = 6.93147180369123816490e-01;
+  const double ln2Lo = 1.90821492927058770002e-10;
+  const long long bits = getBitsFromDouble(x);
+  const double magic = 4503599627370496.0; // 2^52
+  double e = getDoubleFromBits((bits >> 52) | 0x4330000000000000LL) - magic;
+  e -= 1023.0;
+  double m = getDoubleFromBits((bits & 0x000fffffffffffffLL) | (1023LL << 52));
+  const bool isLarge = m > 1.4142135623730951; // m in [sqrt(1/2), sqrt(2))
+  m = isLarge ? m * 0.5 : m;
+  e = isLarge ? e + 1.0 : e;
+  const double f = (m - 1.0) / (m + 1.0); // log(m) = 2 atanh(f)
+  const double s = f * f;
+  const double s2 = s * s; // series of atanh in pairs of terms
+  double p = 1.0 / 19.0 + s * (1.0 / 21.0);
+  p = p * s2 + (1.0 / 15.0 + s * (1.0 / 17.0));
+  p = p * s2 + (1.0 / 11.0 + s * (1.0 / 13.0));
+  p = p * s2 + (1.0 / 7.0 + s * (1.0 / 9.0));
+  p = p * s2 + (1.0 / 3.0 + s * (1.0 / 5.0));
+  const double tail = 2.0 * f * s * p + e * ln2Lo;
+  return (e * ln2Hi + 2.0 * f) + tail;
+#endif
+}
+
+inline double fastPow(const double x, const double y)
+{
+#ifdef USE_LIBM
+  return pow(x, y);
+#else
+  return x > 0.0 ? fastExp(y * fastLog(x)) : 0.0;
+#endif
+}
+
+inline void fastSinCos(const double x, double& s, double& c)
+{
+#ifdef USE_LIBM
+  s = sin(x);
+  c = cos(x);
+#else
+  const double twoOverPi = 0.63661977236758134;
+  const double pio2Hi = 1.57079632673412561417e+00;
+  const double pio2Mid = 6.07710050650619224932e-11;
+  const double pio2Lo = 2.02226624879595063154e-21;
+  const double magic = 6755399441055744.0; // 1.5 * 2^52
+  const double t = x * twoOverPi + magic;  // k is in the low bits of t
+  const double k = t - magic;
+  const double r = ((x - k * pio2Hi) - k * pio2Mid) - k * pio2Lo;
+  const double r2 = r * r;
+  const double r4 = r2 * r2; // Taylor series to r^15 and r^16
+  double ps = -1.0 / 39916800.0 + r2 * (1.0 / 6227020800.0) +
+              r4 * (-1.0 / 1307674368000.0);
+  ps = ps * r4 + (-1.0 / 5040.0 + r2 * (1.0 / 362880.0));
+  ps = ps * r4 + (-1.0 / 6.0 + r2 * (1.0 / 120.0));
+  const double sr = r + r * r2 * ps;
+  double pc = 1.0 / 479001600.0 + r2 * (-1.0 / 87178291200.0) +
+              r4 * (1.0 / 20922789888000.0);
+  pc = pc * r4 + (1.0 / 40320.0 + r2 * (-1.0 / 3628800.0));
+  pc = pc * r4 + (1.0 / 24.0 + r2 * (-1.0 / 720.0));
+  const double cr = 1.0 - 0.5 * r2 + r2 * r2 * pc;
+  const long long quadrant = getBitsFromDouble(t) & 3;
+  const double sAbs = (quadrant & 1) ? cr : sr;
+  const double cAbs = (quadrant & 1) ? sr : cr;
+  s = (quadrant & 2) ? -sAbs : sAbs;
+  c = ((quadrant + 1) & 2) ? -cAbs : cAbs;
+#endif
+}
+
 inline void find_fr_and_frp(double d12, double& fr, double& frp)
 {
   const double a = 1393.6;
   const double lambda = 3.4879;
-  fr = a * exp(-lambda * d12);
+  fr = a * fastExp(-lambda * d12);
   frp = -lambda * fr;
 }
 
@@ -372,51 +890,26 @@ inline void find_fa_and_fap(double d12, double& fa, double& fap)
 {
   const double b = 430.0; // optimized
   const double mu = 2.2119;
-  fa = b * exp(-mu * d12);
+  fa = b * fastExp(-mu * d12);
   fap = -mu * fa;
 }
 
-inline void find_fa(double d12, double& fa)
-{
-  const double b = 430.0;
-  const double mu = 2.2119;
-  fa = b * exp(-mu * d12);
-}
-
+// branch-free: the cosine is 1 for d12 < r1 and -1 for d12 > r2
 inline void find_fc_and_fcp(double d12, double& fc, double& fcp)
 {
   const double r1 = 1.8;
   const double r2 = 2.1;
   const double pi = 3.141592653589793;
   const double pi_factor = pi / (r2 - r1);
-  if (d12 < r1) {
-    fc = 1.0;
-    fcp = 0.0;
-  } else if (d12 < r2) {
-    fc = cos(pi_factor * (d12 - r1)) * 0.5 + 0.5;
-    fcp = -sin(pi_factor * (d12 - r1)) * pi_factor * 0.5;
-  } else {
-    fc = 0.0;
-    fcp = 0.0;
-  }
-}
-
-inline void find_fc(double d12, double& fc)
-{
-  const double r1 = 1.8;
-  const double r2 = 2.1;
-  const double pi = 3.141592653589793;
-  const double pi_factor = pi / (r2 - r1);
-  if (d12 < r1) {
-    fc = 1.0;
-  } else if (d12 < r2) {
-    fc = cos(pi_factor * (d12 - r1)) * 0.5 + 0.5;
-  } else {
-    fc = 0.0;
-  }
+  const double d = std::min(std::max(d12, r1), r2);
+  double s, c;
+  fastSinCos(pi_factor * (d - r1), s, c);
+  fc = c * 0.5 + 0.5;
+  fcp = d12 < r2 ? -s * pi_factor * 0.5 : 0.0;
 }
 
-inline void find_g_and_gp(double cos, double& g, double& gp)
+template <typename T>
+inline void find_g_and_gp(T cos, T& g, T& gp)
 {
   const double c = 38049.0;
   const double d = 4.3484;
@@ -424,12 +917,13 @@ inline void find_g_and_gp(double cos, double& g, double& gp)
   const double c2 = c * c;
   const double d2 = d * d;
   const double c2overd2 = c2 / d2;
-  double temp = d2 + (cos - h) * (cos - h);
+  T temp = d2 + (cos - h) * (cos - h);
   g = 1.0 + c2overd2 - c2 / temp;
   gp = 2.0 * c2 * (cos - h) / (temp * temp);
 }
 
-inline void find_g(double cos, double& g)
+template <typename T>
+inline void find_g(T cos, T& g)
 {
   const double c = 38049.0;
   const double d = 4.3484;
@@ -437,90 +931,297 @@ inline void find_g(double cos, double& g)
   const double c2 = c * c;
   const double d2 = d * d;
   const double c2overd2 = c2 / d2;
-  double temp = d2 + (cos - h) * (cos - h);
+  T temp = d2 + (cos - h) * (cos - h);
   g = 1.0 + c2overd2 - c2 / temp;
 }
 
-void find_b_and_bp(Atom& atom)
+// SIMD vectors of doubles for the triplet loops, which run over the
+// contiguous bond arrays of one atom; compile with -march=native to enable
+// them on AVX2 or AVX-512, otherwise the scalar loops are used. 4 lanes fit
+// the about 4 bonds of a carbon atom best; -DSIMD_WIDTH=8 uses 8 on AVX-512
+#if defined(__AVX512F__) || defined(__AVX2__)
+#define USE_SIMD
+#ifndef SIMD_WIDTH
+#define SIMD_WIDTH 4
+#endif
+typedef double SimdDouble __attribute__((vector_size(SIMD_WIDTH * 8)));
+typedef long long SimdMask __attribute__((vector_size(SIMD_WIDTH * 8)));
+
+inline SimdDouble loadSimd(const double* p)
 {
-  const double beta = 1.5724e-7;
-  const double n = 0.72751;
-  const double minus_half_over_n = -0.5 / n;
+  SimdDouble v;
+  std::memcpy(&v, p, sizeof(SimdDouble));
+  return v;
+}
+
+inline double sumSimd(const SimdDouble v)
+{
+  double sum = 0.0;
+  for (int k = 0; k < SIMD_WIDTH; ++k)
+    sum += v[k];
+  return sum;
+}
+
+// lanes of bonds i2, i2 + 1, ... that are below count and are not bond skip
+inline SimdMask getSimdMask(const int i2, const int count, const int skip)
+{
+  SimdMask index;
+  for (int k = 0; k < SIMD_WIDTH; ++k)
+    index[k] = i2 + k;
+  return (index < count) & (index != skip);
+}
+#endif
+
+// the bonds of each atom are its neighbors within r2 = 2.1 A, where fc > 0;
+// their displacements, fc, fcp, fa and fap are found once per force call,
+// and the second loop over i1 has no branches or libm calls, so that the
+// compiler can vectorize it
+void find_bonds(Atom& atom)
+{
+  const double r2_square = 2.1 * 2.1;
   for (int n1 = 0; n1 < atom.number; ++n1) {
+    const int offset = n1 * atom.MB;
+    int count = 0;
     for (int i1 = 0; i1 < atom.NN[n1]; ++i1) {
-      int n2 = atom.NL[n1 * atom.MN + i1]; // we only know n2 != n1
+      int n2 = atom.NL[n1 * atom.MN + i1];
       double x12, y12, z12;
       x12 = atom.x[n2] - atom.x[n1];
       y12 = atom.y[n2] - atom.y[n1];
       z12 = atom.z[n2] - atom.z[n1];
-      applyMic(atom.box, x12, y12, z12);
-      double d12 = sqrt(x12 * x12 + y12 * y12 + z12 * z12);
-
-      double zeta = 0.0;
-      for (int i2 = 0; i2 < atom.NN[n1]; ++i2) {
-        int n3 = atom.NL[n1 * atom.MN + i2]; // we only know n3 != n1
-        if (n3 == n2) {
-          continue;
-        } // ensure that n3 != n2
-        double x13, y13, z13;
-        x13 = atom.x[n3] - atom.x[n1];
-        y13 = atom.y[n3] - atom.y[n1];
-        z13 = atom.z[n3] - atom.z[n1];
-        applyMic(atom.box, x13, y13, z13);
-
-        double d13 = sqrt(x13 * x13 + y13 * y13 + z13 * z13);
-        double cos = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
-        double fc13, g123;
-        find_fc(d13, fc13);
-        find_g(cos, g123);
-        zeta += fc13 * g123;
+      applyMic(atom.box, atom.pbc, x12, y12, z12);
+      double d12_square = x12 * x12 + y12 * y12 + z12 * z12;
+      if (d12_square < r2_square) {
+        if (count == atom.MB) {
+          std::cout << "Error: number of bonds exceeds " << atom.MB
+                    << std::endl;
+          fail();
+        }
+        atom.BL[offset + count] = n2;
+        atom.bx[offset + count] = x12;
+        atom.by[offset + count] = y12;
+        atom.bz[offset + count] = z12;
+        atom.bd[offset + count] = sqrt(d12_square);
+        ++count;
       }
-      double bzn = pow(beta * zeta, n);
-      double b12 = pow(1.0 + bzn, minus_half_over_n);
-      atom.b[n1 * atom.MN + i1] = b12;
-      atom.bp[n1 * atom.MN + i1] = -b12 * bzn * 0.5 / ((1.0 + bzn) * zeta);
+    }
+    atom.NB[n1] = count;
+
+    const double* d12 = atom.bd.data() + offset;
+    double* fc = atom.fc.data() + offset;
+    double* fcp = atom.fcp.data() + offset;
+    double* fa = atom.fa.data() + offset;
+    double* fap = atom.fap.data() + offset;
+    for (int i1 = 0; i1 < count; ++i1) {
+      find_fc_and_fcp(d12[i1], fc[i1], fcp[i1]);
+      find_fa_and_fap(d12[i1], fa[i1], fap[i1]);
+    }
+  }
+}
+
+// zeta of bond i1 in the bonds of one atom starting at offset
+inline double find_zeta(
+  const Atom& atom,
+  const int offset,
+  const int count,
+  const int i1)
+{
+  const double x12 = atom.bx[offset + i1];
+  const double y12 = atom.by[offset + i1];
+  const double z12 = atom.bz[offset + i1];
+  const double d12 = atom.bd[offset + i1];
+#ifdef USE_SIMD
+  const SimdDouble zero = {};
+  SimdDouble zeta = zero;
+  for (int i2 = 0; i2 < count; i2 += SIMD_WIDTH) {
+    const int k = offset + i2;
+    SimdDouble x13 = loadSimd(&atom.bx[k]);
+    SimdDouble y13 = loadSimd(&atom.by[k]);
+    SimdDouble z13 = loadSimd(&atom.bz[k]);
+    SimdDouble d13 = loadSimd(&atom.bd[k]);
+    SimdDouble cos = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
+    SimdDouble g123;
+    find_g(cos, g123);
+    zeta += getSimdMask(i2, count, i1) ? loadSimd(&atom.fc[k]) * g123 : zero;
+  }
+  return sumSimd(zeta);
+#else
+  double zeta = 0.0;
+  for (int i2 = 0; i2 < count; ++i2) {
+    if (i2 == i1) {
+      continue;
+    } // ensure that n3 != n2
+    double x13 = atom.bx[offset + i2];
+    double y13 = atom.by[offset + i2];
+    double z13 = atom.bz[offset + i2];
+    double d13 = atom.bd[offset + i2];
+    double cos = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
+    double fc13 = atom.fc[offset + i2];
+    double g123;
+    find_g(cos, g123);
+    zeta += fc13 * g123;
+  }
+  return zeta;
+#endif
+}
+
+// three-body part of d_U_i_d_r_ij, where r12 is bond i1 of atom i (with its
+// bonds starting at offset) and the bond functions are those of r12
+inline void find_f12_three_body(
+  const Atom& atom,
+  const int offset,
+  const int count,
+  const int i1,
+  const double x12,
+  const double y12,
+  const double z12,
+  const double d12,
+  const double fc12,
+  const double fcp12,
+  const double fa12,
+  double* f12)
+{
+  const double d12inv = 1.0 / d12;
+  const double bp12 = atom.bp[offset + i1];
+#ifdef USE_SIMD
+  const SimdDouble zero = {};
+  SimdDouble f[3] = {zero, zero, zero};
+  for (int i2 = 0; i2 < count; i2 += SIMD_WIDTH) {
+    const int k = offset + i2;
+    SimdDouble x13 = loadSimd(&atom.bx[k]);
+    SimdDouble y13 = loadSimd(&atom.by[k]);
+    SimdDouble z13 = loadSimd(&atom.bz[k]);
+    SimdDouble d13 = loadSimd(&atom.bd[k]);
+    SimdDouble fc13 = loadSimd(&atom.fc[k]);
+    SimdDouble fa13 = loadSimd(&atom.fa[k]);
+    SimdDouble bp13 = loadSimd(&atom.bp[k]);
+
+    SimdDouble cos123 = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
+    SimdDouble g123, gp123;
+    find_g_and_gp(cos123, g123, gp123);
+    SimdDouble cos_x = x13 / (d12 * d13) - x12 * cos123 / (d12 * d12);
+    SimdDouble cos_y = y13 / (d12 * d13) - y12 * cos123 / (d12 * d12);
+    SimdDouble cos_z = z13 / (d12 * d13) - z12 * cos123 / (d12 * d12);
+    SimdDouble factor123a =
+      (-bp12 * fc12 * fa12 * fc13 - bp13 * fc13 * fa13 * fc12) * gp123;
+    SimdDouble factor123b = -bp13 * fc13 * fa13 * fcp12 * g123 * d12inv;
+    SimdMask mask = getSimdMask(i2, count, i1);
+    f[0] += mask ? (x12 * factor123b + factor123a * cos_x) * 0.5 : zero;
+    f[1] += mask ? (y12 * factor123b + factor123a * cos_y) * 0.5 : zero;
+    f[2] += mask ? (z12 * factor123b + factor123a * cos_z) * 0.5 : zero;
+  }
+  for (int d = 0; d < 3; ++d)
+    f12[d] += sumSimd(f[d]);
+#else
+  for (int i2 = 0; i2 < count; ++i2) {
+    if (i2 == i1) {
+      continue;
+    }
+    double x13 = atom.bx[offset + i2];
+    double y13 = atom.by[offset + i2];
+    double z13 = atom.bz[offset + i2];
+    double d13 = atom.bd[offset + i2];
+    double fc13 = atom.fc[offset + i2];
+    double fa13 = atom.fa[offset + i2];
+    double bp13 = atom.bp[offset + i2];
+
+    double cos123 = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
+    double g123, gp123;
+    find_g_and_gp(cos123, g123, gp123);
+    double cos_x = x13 / (d12 * d13) - x12 * cos123 / (d12 * d12);
+    double cos_y = y13 / (d12 * d13) - y12 * cos123 / (d12 * d12);
+    double cos_z = z13 / (d12 * d13) - z12 * cos123 / (d12 * d12);
+    double factor123a =
+      (-bp12 * fc12 * fa12 * fc13 - bp13 * fc13 * fa13 * fc12) * gp123;
+    double factor123b = -bp13 * fc13 * fa13 * fcp12 * g123 * d12inv;
+    f12[0] += (x12 * factor123b + factor123a * cos_x) * 0.5;
+    f12[1] += (y12 * factor123b + factor123a * cos_y) * 0.5;
+    f12[2] += (z12 * factor123b + factor123a * cos_z) * 0.5;
+  }
+#endif
+}
+
+void find_b_and_bp(Atom& atom)
+{
+  const double beta = 1.5724e-7;
+  const double n = 0.72751;
+  const double minus_half_over_n = -0.5 / n;
+  for (int n1 = 0; n1 < atom.number; ++n1) {
+    const int offset = n1 * atom.MB;
+    for (int i1 = 0; i1 < atom.NB[n1]; ++i1) {
+      double zeta = find_zeta(atom, offset, atom.NB[n1], i1);
+      double bzn = fastPow(beta * zeta, n);
+      double b12 = fastPow(1.0 + bzn, minus_half_over_n);
+      atom.b[offset + i1] = b12;
+      // zeta = 0 for a bond without a third neighbor, e.g. at a free surface
+      atom.bp[offset + i1] =
+        zeta > 0.0 ? -b12 * bzn * 0.5 / ((1.0 + bzn) * zeta) : 0.0;
     }
   }
 }
 
+// the terms of the pair 1-2 in the heat current J = sum_1 W_1 . v_1 and in
+// the HNEMD driving force F_1 = Fe . W_1, where W_1 = sum_2 r_12 (x) f_21 is
+// the per-atom virial and f_21 = d_U_2_d_r_21; the convective term of J is
+// left out as in kappa_hnemd
+inline void find_hnemd_terms(
+  Atom& atom, const int n1, const double* r12, const double* f21)
+{
+  const double fe12 =
+    atom.fe[0] * r12[0] + atom.fe[1] * r12[1] + atom.fe[2] * r12[2];
+  const double f21v1 =
+    f21[0] * atom.vx[n1] + f21[1] * atom.vy[n1] + f21[2] * atom.vz[n1];
+  atom.hx[n1] += r12[0] * f21v1;
+  atom.hy[n1] += r12[1] * f21v1;
+  atom.hz[n1] += r12[2] * f21v1;
+  atom.fx[n1] += fe12 * f21[0];
+  atom.fy[n1] += fe12 * f21[1];
+  atom.fz[n1] += fe12 * f21[2];
+}
+
+// W_1 += r_12 (x) f_21 as in find_hnemd_terms, for the virial
+inline void find_virial_terms(
+  Atom& atom, const int n1, const double* r12, const double* f21)
+{
+  double* w = atom.virial.data() + n1 * 9;
+  for (int a = 0; a < 3; ++a)
+    for (int b = 0; b < 3; ++b)
+      w[a * 3 + b] += r12[a] * f21[b];
+}
+
 void find_force_tersoff(Atom& atom)
 {
-  atom.pe = 0.0;
   for (int n = 0; n < atom.number; ++n) {
-    atom.fx[n] = atom.fy[n] = atom.fz[n] = 0.0;
+    atom.fx[n] = atom.fy[n] = atom.fz[n] = atom.energy[n] = 0.0;
   }
 
   for (int n1 = 0; n1 < atom.number; ++n1) {
-    for (int i1 = 0; i1 < atom.NN[n1]; ++i1) {
-      int n2 = atom.NL[n1 * atom.MN + i1];
+    const int offset1 = n1 * atom.MB;
+    for (int i1 = 0; i1 < atom.NB[n1]; ++i1) {
+      int n2 = atom.BL[offset1 + i1];
       if (n2 < n1) {
         continue;
       }
-      double x12, y12, z12;
-      x12 = atom.x[n2] - atom.x[n1];
-      y12 = atom.y[n2] - atom.y[n1];
-      z12 = atom.z[n2] - atom.z[n1];
-      applyMic(atom.box, x12, y12, z12);
-
-      double d12 = sqrt(x12 * x12 + y12 * y12 + z12 * z12);
-      double d12inv = 1.0 / d12;
-      double d12inv_square = d12inv * d12inv;
-
-      double fc12, fcp12;
-      double fa12, fap12;
+      const int offset2 = n2 * atom.MB;
+      double x12 = atom.bx[offset1 + i1];
+      double y12 = atom.by[offset1 + i1];
+      double z12 = atom.bz[offset1 + i1];
+      double d12 = atom.bd[offset1 + i1];
+
+      double fc12 = atom.fc[offset1 + i1];
+      double fcp12 = atom.fcp[offset1 + i1];
+      double fa12 = atom.fa[offset1 + i1];
+      double fap12 = atom.fap[offset1 + i1];
       double fr12, frp12;
-      find_fc_and_fcp(d12, fc12, fcp12);
-      find_fa_and_fap(d12, fa12, fap12);
       find_fr_and_frp(d12, fr12, frp12);
 
-      double b12, bp12;
+      double b12;
 
       double f12[3] = {0.0, 0.0, 0.0}; // d_U_i_d_r_ij
       double f21[3] = {0.0, 0.0, 0.0}; // d_U_j_d_r_ji
       double p12 = 0.0;                // U_ij
       double p21 = 0.0;                // U_ji
 
-      b12 = atom.b[n1 * atom.MN + i1];
+      b12 = atom.b[offset1 + i1];
       double factor1 = -b12 * fa12 + fr12;
       double factor2 = -b12 * fap12 + frp12;
       double factor3 = (fcp12 * factor1 + fc12 * factor2) / d12;
@@ -530,13 +1231,13 @@ void find_force_tersoff(Atom& atom)
       p12 += factor1 * fc12;
 
       int offset = 0;
-      for (int k = 0; k < atom.NN[n2]; ++k) {
-        if (atom.NL[n2 * atom.MN + k] == n1) {
+      for (int k = 0; k < atom.NB[n2]; ++k) {
+        if (atom.BL[offset2 + k] == n1) {
           offset = k;
           break;
         }
       }
-      b12 = atom.b[n2 * atom.MN + offset];
+      b12 = atom.b[offset2 + offset];
       factor1 = -b12 * fa12 + fr12;
       factor2 = -b12 * fap12 + frp12;
       factor3 = (fcp12 * factor1 + fc12 * factor2) / d12;
@@ -545,109 +1246,590 @@ void find_force_tersoff(Atom& atom)
       f21[2] += -z12 * factor3 * 0.5;
       p21 += factor1 * fc12;
 
-      bp12 = atom.bp[n1 * atom.MN + i1];
-      for (int i2 = 0; i2 < atom.NN[n1]; ++i2) {
-        int n3 = atom.NL[n1 * atom.MN + i2];
-        if (n3 == n2) {
-          continue;
-        }
-        double x13, y13, z13;
-        x13 = atom.x[n3] - atom.x[n1];
-        y13 = atom.y[n3] - atom.y[n1];
-        z13 = atom.z[n3] - atom.z[n1];
-        applyMic(atom.box, x13, y13, z13);
-
-        double d13 = sqrt(x13 * x13 + y13 * y13 + z13 * z13);
-        double fc13, fa13;
-        find_fc(d13, fc13);
-        find_fa(d13, fa13);
-        double bp13 = atom.bp[n1 * atom.MN + i2];
-
-        double cos123 = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
-        double g123, gp123;
-        find_g_and_gp(cos123, g123, gp123);
-        double cos_x = x13 / (d12 * d13) - x12 * cos123 / (d12 * d12);
-        double cos_y = y13 / (d12 * d13) - y12 * cos123 / (d12 * d12);
-        double cos_z = z13 / (d12 * d13) - z12 * cos123 / (d12 * d12);
-        double factor123a =
-          (-bp12 * fc12 * fa12 * fc13 - bp13 * fc13 * fa13 * fc12) * gp123;
-        double factor123b = -bp13 * fc13 * fa13 * fcp12 * g123 * d12inv;
-        f12[0] += (x12 * factor123b + factor123a * cos_x) * 0.5;
-        f12[1] += (y12 * factor123b + factor123a * cos_y) * 0.5;
-        f12[2] += (z12 * factor123b + factor123a * cos_z) * 0.5;
-      }
-
-      bp12 = atom.bp[n2 * atom.MN + offset];
-      for (int i2 = 0; i2 < atom.NN[n2]; ++i2) {
-        int n3 = atom.NL[n2 * atom.MN + i2];
-        if (n3 == n1) {
-          continue;
-        }
-        double x23, y23, z23;
-        x23 = atom.x[n3] - atom.x[n2];
-        y23 = atom.y[n3] - atom.y[n2];
-        z23 = atom.z[n3] - atom.z[n2];
-        applyMic(atom.box, x23, y23, z23);
-
-        double d23 = sqrt(x23 * x23 + y23 * y23 + z23 * z23);
-        double fc23, fa23;
-        find_fc(d23, fc23);
-        find_fa(d23, fa23);
-        double bp13 = atom.bp[n2 * atom.MN + i2];
-
-        double cos213 = -(x12 * x23 + y12 * y23 + z12 * z23) / (d12 * d23);
-        double g213, gp213;
-        find_g_and_gp(cos213, g213, gp213);
-        double cos_x = x23 / (d12 * d23) + x12 * cos213 / (d12 * d12);
-        double cos_y = y23 / (d12 * d23) + y12 * cos213 / (d12 * d12);
-        double cos_z = z23 / (d12 * d23) + z12 * cos213 / (d12 * d12);
-        double factor213a =
-          (-bp12 * fc12 * fa12 * fc23 - bp13 * fc23 * fa23 * fc12) * gp213;
-        double factor213b = -bp13 * fc23 * fa23 * fcp12 * g213 * d12inv;
-        f21[0] += (-x12 * factor213b + factor213a * cos_x) * 0.5;
-        f21[1] += (-y12 * factor213b + factor213a * cos_y) * 0.5;
-        f21[2] += (-z12 * factor213b + factor213a * cos_z) * 0.5;
-      }
+      find_f12_three_body(
+        atom, offset1, atom.NB[n1], i1, x12, y12, z12, d12, fc12, fcp12, fa12,
+        f12);
+      find_f12_three_body(
+        atom, offset2, atom.NB[n2], offset, -x12, -y12, -z12, d12, fc12, fcp12,
+        fa12, f21);
 
       double fx12 = f12[0] - f21[0];
       double fy12 = f12[1] - f21[1];
       double fz12 = f12[2] - f21[2];
-      atom.pe += (p12 + p21) * 0.5;
+      atom.energy[n1] += p12 * 0.5;
+      atom.energy[n2] += p21 * 0.5;
       atom.fx[n1] += fx12;
       atom.fy[n1] += fy12;
       atom.fz[n1] += fz12;
       atom.fx[n2] -= fx12;
       atom.fy[n2] -= fy12;
       atom.fz[n2] -= fz12;
+      if (atom.isHnemd) {
+        const double r12[3] = {x12, y12, z12};
+        const double r21[3] = {-x12, -y12, -z12};
+        find_hnemd_terms(atom, n1, r12, f21);
+        find_hnemd_terms(atom, n2, r21, f12);
+      }
+      if (atom.isVirial) {
+        const double r12[3] = {x12, y12, z12};
+        const double r21[3] = {-x12, -y12, -z12};
+        find_virial_terms(atom, n1, r12, f21);
+        find_virial_terms(atom, n2, r21, f12);
+      }
     }
   }
+  atom.pe = sumAtoms(atom, [&](const int n) { return atom.energy[n]; });
 }
 
-void findForce(Atom& atom)
+// run task(begin, end) on atom.numThreads threads, each with a contiguous
+// range of atoms
+template <typename Task>
+void runOnAtoms(const Atom& atom, const Task& task)
 {
-  find_b_and_bp(atom);
-  find_force_tersoff(atom);
+  const int numThreads = std::min(atom.numThreads, atom.number);
+  if (numThreads <= 1) {
+    task(0, atom.number);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; ++t) {
+    const int begin = long(atom.number) * t / numThreads;
+    const int end = long(atom.number) * (t + 1) / numThreads;
+    threads.emplace_back(task, begin, end);
+  }
+  for (auto& thread : threads)
+    thread.join();
 }
 
-void integrate(const bool isStepOne, const double timeStep, Atom& atom)
+const int NHC_BLOCK = 64;      // atoms of a block in applyMassiveNhc
+const int NHC_MAX_LENGTH = 10; // longest chain
+
+// Massive Nose-Hoover chains: a chain of atom.nhcLength thermostats for each
+// atom, with etaPos[m * number + n] and etaVel[m * number + n] for level m of
+// atom n, so that each level is contiguous over the atoms. This is nhc() of
+// chapter-4-ensembles/nhc/md_ho_nhc.c with dN = 3 for each atom, applied to a
+// block of atoms at a time: the kinetic energies of the block are found in
+// the same pass, and the loops over a block have no branches or libm calls,
+// so that the compiler vectorizes them (wider with -march=native). Each call
+// integrates the chains over dt2 and scales the velocities.
+void applyMassiveNhc(Atom& atom, const double T0, const double dt2)
 {
-  const double timeStepHalf = timeStep * 0.5;
-  for (int n = 0; n < atom.number; ++n) {
-    const double mass_inv = 1.0 / atom.mass[n];
-    const double ax = atom.fx[n] * mass_inv;
-    const double ay = atom.fy[n] * mass_inv;
-    const double az = atom.fz[n] * mass_inv;
-    atom.vx[n] += ax * timeStepHalf;
-    atom.vy[n] += ay * timeStepHalf;
-    atom.vz[n] += az * timeStepHalf;
-    if (isStepOne) {
-      atom.x[n] += atom.vx[n] * timeStep;
-      atom.y[n] += atom.vy[n] * timeStep;
-      atom.z[n] += atom.vz[n] * timeStep;
-    }
+  const int M = atom.nhcLength;
+  const int N = atom.number;
+  if (int(atom.etaVel.size()) != M * N) { // chains start at rest
+    atom.etaPos.assign(M * N, 0.0);
+    atom.etaVel.assign(M * N, 0.0);
   }
-}
-
+  const double kT = K_B * T0;
+  const double dN = 3.0;
+  double Qinv[NHC_MAX_LENGTH]; // 1 / mass of each level
+  for (int m = 0; m < M; ++m)
+    Qinv[m] = 1.0 / (kT * atom.nhcTau * atom.nhcTau * (m == 0 ? dN : 1.0));
+  const double dt4 = dt2 * 0.5;
+  const double dt8 = dt4 * 0.5;
+
+  runOnAtoms(atom, [&](const int begin, const int end) {
+    double ek2[NHC_BLOCK], factor[NHC_BLOCK], G[NHC_BLOCK];
+    for (int b = begin; b < end; b += NHC_BLOCK) {
+      const int L = std::min(NHC_BLOCK, end - b);
+      double* vx = atom.vx.data() + b;
+      double* vy = atom.vy.data() + b;
+      double* vz = atom.vz.data() + b;
+      const double* mass = atom.mass.data() + b;
+      double* eta[NHC_MAX_LENGTH];
+      double* v[NHC_MAX_LENGTH];
+      for (int m = 0; m < M; ++m) {
+        eta[m] = atom.etaPos.data() + m * N + b;
+        v[m] = atom.etaVel.data() + m * N + b;
+      }
+      for (int n = 0; n < L; ++n)
+        ek2[n] = mass[n] * (vx[n] * vx[n] + vy[n] * vy[n] + vz[n] * vz[n]);
+
+      // level m driven by the kinetic energy of level m - 1 or of the atom
+      const auto update = [&](const int m) {
+        if (m == 0) {
+          for (int n = 0; n < L; ++n)
+            G[n] = ek2[n] - dN * kT;
+        } else {
+          for (int n = 0; n < L; ++n)
+            G[n] = v[m - 1][n] * v[m - 1][n] * Qinv[m - 1] - kT;
+        }
+        for (int n = 0; n < L; ++n) {
+          const double s = fastExpInRange(-dt8 * v[m + 1][n] * Qinv[m + 1]);
+          v[m][n] = s * (s * v[m][n] + dt4 * G[n]);
+        }
+      };
+      const auto updateLast = [&]() {
+        for (int n = 0; n < L; ++n)
+          v[M - 1][n] +=
+            dt4 * (v[M - 2][n] * v[M - 2][n] * Qinv[M - 2] - kT);
+      };
+
+      updateLast();
+      for (int m = M - 2; m >= 0; --m)
+        update(m);
+      for (int m = 0; m < M; ++m)
+        for (int n = 0; n < L; ++n)
+          eta[m][n] += dt2 * v[m][n] * Qinv[m];
+      for (int n = 0; n < L; ++n) {
+        factor[n] = fastExpInRange(-dt2 * v[0][n] * Qinv[0]);
+        ek2[n] *= factor[n] * factor[n];
+      }
+      for (int m = 0; m < M - 1; ++m)
+        update(m);
+      updateLast();
+      for (int n = 0; n < L; ++n) {
+        vx[n] *= factor[n];
+        vy[n] *= factor[n];
+        vz[n] *= factor[n];
+      }
+    }
+  });
+}
+
+// weights of the squared s components in the 3-body descriptors, with the
+// factor 2 of the m != 0 terms included; 1 / (integral of P^2 over the unit
+// sphere), where P are the polynomials in find_angular_polynomials
+const double W3B[NEP_NUM_S] = {
+  0.238732414637843, 0.238732414637843, 0.238732414637843, 0.099471839432435,
+  1.193662073189215, 1.193662073189215, 0.298415518297304, 0.298415518297304,
+  0.139260575205408, 0.208890862808113, 0.208890862808113, 2.088908628081126,
+  2.088908628081126, 0.348151438013521, 0.348151438013521, 0.011190581936149,
+  0.447623277445956, 0.447623277445956, 0.223811638722978, 0.223811638722978,
+  3.133362942121690, 3.133362942121690, 0.391670367765211, 0.391670367765211};
+const double C4B[5] = {
+  -0.007499480826664, -0.134990654879954, 0.067495327439977,
+  0.404971964639862, -0.809943929279723};
+const double C5B[3] = {0.026596810706114, 0.053193621412227, 0.026596810706114};
+
+// real spherical harmonics up to l = 4 without normalization, as polynomials
+// of the unit vector (x, y, z), and their gradients
+void find_angular_polynomials(
+  const double x, const double y, const double z, double* p, double* dp)
+{
+  const double x2 = x * x, y2 = y * y, z2 = z * z;
+  const double x2my2 = x2 - y2;
+  const double values[NEP_NUM_S] = {
+    z,
+    x,
+    y,
+    3.0 * z2 - 1.0,
+    x * z,
+    y * z,
+    x2my2,
+    2.0 * x * y,
+    (5.0 * z2 - 3.0) * z,
+    (5.0 * z2 - 1.0) * x,
+    (5.0 * z2 - 1.0) * y,
+    x2my2 * z,
+    2.0 * x * y * z,
+    (x2 - 3.0 * y2) * x,
+    (3.0 * x2 - y2) * y,
+    (35.0 * z2 - 30.0) * z2 + 3.0,
+    (7.0 * z2 - 3.0) * x * z,
+    (7.0 * z2 - 3.0) * y * z,
+    (7.0 * z2 - 1.0) * x2my2,
+    (7.0 * z2 - 1.0) * 2.0 * x * y,
+    (x2 - 3.0 * y2) * x * z,
+    (3.0 * x2 - y2) * y * z,
+    x2my2 * x2my2 - 4.0 * x2 * y2,
+    4.0 * x * y * x2my2};
+  const double gradients[NEP_NUM_S][3] = {
+    {0.0, 0.0, 1.0},
+    {1.0, 0.0, 0.0},
+    {0.0, 1.0, 0.0},
+    {0.0, 0.0, 6.0 * z},
+    {z, 0.0, x},
+    {0.0, z, y},
+    {2.0 * x, -2.0 * y, 0.0},
+    {2.0 * y, 2.0 * x, 0.0},
+    {0.0, 0.0, 15.0 * z2 - 3.0},
+    {5.0 * z2 - 1.0, 0.0, 10.0 * x * z},
+    {0.0, 5.0 * z2 - 1.0, 10.0 * y * z},
+    {2.0 * x * z, -2.0 * y * z, x2my2},
+    {2.0 * y * z, 2.0 * x * z, 2.0 * x * y},
+    {3.0 * x2my2, -6.0 * x * y, 0.0},
+    {6.0 * x * y, 3.0 * x2my2, 0.0},
+    {0.0, 0.0, (140.0 * z2 - 60.0) * z},
+    {(7.0 * z2 - 3.0) * z, 0.0, (21.0 * z2 - 3.0) * x},
+    {0.0, (7.0 * z2 - 3.0) * z, (21.0 * z2 - 3.0) * y},
+    {(14.0 * z2 - 2.0) * x, (2.0 - 14.0 * z2) * y, 14.0 * z * x2my2},
+    {(14.0 * z2 - 2.0) * y, (14.0 * z2 - 2.0) * x, 28.0 * x * y * z},
+    {3.0 * x2my2 * z, -6.0 * x * y * z, (x2 - 3.0 * y2) * x},
+    {6.0 * x * y * z, 3.0 * x2my2 * z, (3.0 * x2 - y2) * y},
+    {4.0 * x * (x2 - 3.0 * y2), 4.0 * y * (y2 - 3.0 * x2), 0.0},
+    {4.0 * y * (3.0 * x2 - y2), 4.0 * x * (x2 - 3.0 * y2), 0.0}};
+  for (int k = 0; k < NEP_NUM_S; ++k) {
+    p[k] = values[k];
+    for (int d = 0; d < 3; ++d)
+      dp[k * 3 + d] = gradients[k][d];
+  }
+}
+
+// f_k(d) = (T_k(x) + 1) / 2 * fc(d) with x = 2 (d / rc - 1)^2 - 1, and the
+// derivatives, for k = 0, 1, ..., basisSize
+void find_fn_and_fnp(
+  const int basisSize,
+  const double rc,
+  const double d12,
+  double* fn,
+  double* fnp)
+{
+  const double pi = 3.141592653589793;
+  const double fc = 0.5 * cos(pi * d12 / rc) + 0.5;
+  const double fcp = -0.5 * pi / rc * sin(pi * d12 / rc);
+  const double t = d12 / rc - 1.0;
+  const double x = 2.0 * t * t - 1.0;
+  const double xp = 4.0 * t / rc;
+  double T0 = 1.0, T1 = x, Tp0 = 0.0, Tp1 = 1.0;
+  for (int k = 0; k <= basisSize; ++k) {
+    double T = T0, Tp = Tp0;
+    if (k == 1) {
+      T = T1;
+      Tp = Tp1;
+    } else if (k > 1) {
+      T = 2.0 * x * T1 - T0;
+      Tp = 2.0 * T1 + 2.0 * x * Tp1 - Tp0;
+      T0 = T1;
+      T1 = T;
+      Tp0 = Tp1;
+      Tp1 = Tp;
+    }
+    fn[k] = (T + 1.0) * 0.5 * fc;
+    fnp[k] = Tp * xp * 0.5 * fc + (T + 1.0) * 0.5 * fcp;
+  }
+}
+
+// g_n(d) = sum_k c_nk^{t1 t2} f_k(d) and g_n'(d) for n = 0, 1, ..., nMax
+void find_gn_and_gnp(
+  const NEP& nep,
+  const bool isAngular,
+  const int t1,
+  const int t2,
+  const double d12,
+  double* gn,
+  double* gnp)
+{
+  const int nMax = isAngular ? nep.nMaxAngular : nep.nMaxRadial;
+  const int basisSize = isAngular ? nep.basisSizeAngular : nep.basisSizeRadial;
+  double fn[NEP_MAX_BASIS], fnp[NEP_MAX_BASIS];
+  find_fn_and_fnp(
+    basisSize, isAngular ? nep.rcAngular : nep.rcRadial, d12, fn, fnp);
+  const int numTypesSquare = nep.numTypes * nep.numTypes;
+  const double* c = nep.c.data() + t1 * nep.numTypes + t2;
+  if (isAngular)
+    c += numTypesSquare * (nep.nMaxRadial + 1) * (nep.basisSizeRadial + 1);
+  for (int n = 0; n <= nMax; ++n) {
+    gn[n] = gnp[n] = 0.0;
+    for (int k = 0; k <= basisSize; ++k) {
+      const double ck = c[(n * (basisSize + 1) + k) * numTypesSquare];
+      gn[n] += ck * fn[k];
+      gnp[n] += ck * fnp[k];
+    }
+  }
+}
+
+// descriptors, site energy and the derivatives of the energy with respect to
+// the radial descriptors (atom.Fp) and the s components (atom.sumFxyz)
+void find_descriptor_nep(Atom& atom, const int n1, double& energy)
+{
+  const NEP& nep = atom.nep;
+  const int t1 = atom.type[n1];
+  const int numS = nep.lMax * (nep.lMax + 2);
+  double q[NEP_MAX_DIM] = {0.0};
+  double s[(NEP_MAX_N + 1) * NEP_NUM_S] = {0.0};
+  double gn[NEP_MAX_N + 1], gnp[NEP_MAX_N + 1];
+  double p[NEP_NUM_S], dp[NEP_NUM_S * 3];
+
+  for (int i1 = 0; i1 < atom.NN[n1]; ++i1) {
+    const int n2 = atom.NL[n1 * atom.MN + i1];
+    double x12 = atom.x[n2] - atom.x[n1];
+    double y12 = atom.y[n2] - atom.y[n1];
+    double z12 = atom.z[n2] - atom.z[n1];
+    applyMic(atom.box, atom.pbc, x12, y12, z12);
+    const double d12 = sqrt(x12 * x12 + y12 * y12 + z12 * z12);
+    if (d12 >= nep.rcRadial)
+      continue;
+    find_gn_and_gnp(nep, false, t1, atom.type[n2], d12, gn, gnp);
+    for (int n = 0; n <= nep.nMaxRadial; ++n)
+      q[n] += gn[n];
+    if (d12 >= nep.rcAngular)
+      continue;
+    find_gn_and_gnp(nep, true, t1, atom.type[n2], d12, gn, gnp);
+    find_angular_polynomials(x12 / d12, y12 / d12, z12 / d12, p, dp);
+    for (int n = 0; n <= nep.nMaxAngular; ++n)
+      for (int k = 0; k < numS; ++k)
+        s[n * NEP_NUM_S + k] += gn[n] * p[k];
+  }
+
+  const int numN = nep.nMaxAngular + 1;
+  double* q3 = q + nep.nMaxRadial + 1;
+  for (int n = 0; n < numN; ++n) {
+    const double* sn = s + n * NEP_NUM_S;
+    for (int l = 1; l <= nep.lMax; ++l) {
+      double sum = 0.0;
+      for (int k = l * l - 1; k < (l + 1) * (l + 1) - 1; ++k)
+        sum += W3B[k] * sn[k] * sn[k];
+      q3[(l - 1) * numN + n] = sum;
+    }
+    if (nep.lMax4 > 0) {
+      q3[nep.lMax * numN + n] =
+        C4B[0] * sn[3] * sn[3] * sn[3] +
+        C4B[1] * sn[3] * (sn[4] * sn[4] + sn[5] * sn[5]) +
+        C4B[2] * sn[3] * (sn[6] * sn[6] + sn[7] * sn[7]) +
+        C4B[3] * sn[6] * (sn[5] * sn[5] - sn[4] * sn[4]) +
+        C4B[4] * sn[4] * sn[5] * sn[7];
+    }
+    if (nep.lMax5 > 0) {
+      const double s0s0 = sn[0] * sn[0];
+      const double s1s1s2s2 = sn[1] * sn[1] + sn[2] * sn[2];
+      q3[(nep.lMax + (nep.lMax4 > 0)) * numN + n] =
+        C5B[0] * s0s0 * s0s0 + C5B[1] * s0s0 * s1s1s2s2 +
+        C5B[2] * s1s1s2s2 * s1s1s2s2;
+    }
+  }
+
+  // the network: one hidden layer of tanh neurons and a linear output
+  const int dim = nep.dim;
+  const int numNeurons = nep.numNeurons;
+  for (int d = 0; d < dim; ++d)
+    q[d] *= nep.qScaler[d];
+  const double* w0 = nep.ann.data();
+  if (nep.version == 4)
+    w0 += t1 * (dim + 2) * numNeurons;
+  const double* b0 = w0 + numNeurons * dim;
+  const double* w1 = b0 + numNeurons;
+  double Fp[NEP_MAX_DIM] = {0.0};
+  energy = -nep.ann.back();
+  for (int k = 0; k < numNeurons; ++k) {
+    double w0q = 0.0;
+    for (int d = 0; d < dim; ++d)
+      w0q += w0[k * dim + d] * q[d];
+    const double x1 = tanh(w0q - b0[k]);
+    energy += w1[k] * x1;
+    const double factor = w1[k] * (1.0 - x1 * x1);
+    for (int d = 0; d < dim; ++d)
+      Fp[d] += factor * w0[k * dim + d];
+  }
+  for (int d = 0; d < dim; ++d)
+    Fp[d] *= nep.qScaler[d];
+
+  // derivatives with respect to the unscaled descriptors and s
+  for (int n = 0; n <= nep.nMaxRadial; ++n)
+    atom.Fp[n1 * (NEP_MAX_N + 1) + n] = Fp[n];
+  const double* Fp3 = Fp + nep.nMaxRadial + 1;
+  for (int n = 0; n < numN; ++n) {
+    const double* sn = s + n * NEP_NUM_S;
+    double* sumFxyz = atom.sumFxyz.data() + (n1 * numN + n) * NEP_NUM_S;
+    for (int l = 1; l <= nep.lMax; ++l) {
+      for (int k = l * l - 1; k < (l + 1) * (l + 1) - 1; ++k)
+        sumFxyz[k] = Fp3[(l - 1) * numN + n] * 2.0 * W3B[k] * sn[k];
+    }
+    if (nep.lMax4 > 0) {
+      const double F4 = Fp3[nep.lMax * numN + n];
+      sumFxyz[3] += F4 * (3.0 * C4B[0] * sn[3] * sn[3] +
+                          C4B[1] * (sn[4] * sn[4] + sn[5] * sn[5]) +
+                          C4B[2] * (sn[6] * sn[6] + sn[7] * sn[7]));
+      sumFxyz[4] += F4 * (2.0 * (C4B[1] * sn[3] - C4B[3] * sn[6]) * sn[4] +
+                          C4B[4] * sn[5] * sn[7]);
+      sumFxyz[5] += F4 * (2.0 * (C4B[1] * sn[3] + C4B[3] * sn[6]) * sn[5] +
+                          C4B[4] * sn[4] * sn[7]);
+      sumFxyz[6] += F4 * (2.0 * C4B[2] * sn[3] * sn[6] +
+                          C4B[3] * (sn[5] * sn[5] - sn[4] * sn[4]));
+      sumFxyz[7] +=
+        F4 * (2.0 * C4B[2] * sn[3] * sn[7] + C4B[4] * sn[4] * sn[5]);
+    }
+    if (nep.lMax5 > 0) {
+      const double F5 = Fp3[(nep.lMax + (nep.lMax4 > 0)) * numN + n];
+      const double s0s0 = sn[0] * sn[0];
+      const double s1s1s2s2 = sn[1] * sn[1] + sn[2] * sn[2];
+      sumFxyz[0] +=
+        F5 * (4.0 * C5B[0] * s0s0 + 2.0 * C5B[1] * s1s1s2s2) * sn[0];
+      const double factor = 2.0 * C5B[1] * s0s0 + 4.0 * C5B[2] * s1s1s2s2;
+      sumFxyz[1] += F5 * factor * sn[1];
+      sumFxyz[2] += F5 * factor * sn[2];
+    }
+  }
+}
+
+// dE_1 / dr_12 for the bond from atom n1 to atom n2 at r12
+void find_partial_force_nep(
+  const Atom& atom,
+  const int n1,
+  const int n2,
+  const double x12,
+  const double y12,
+  const double z12,
+  const double d12,
+  double* f12)
+{
+  const NEP& nep = atom.nep;
+  double gn[NEP_MAX_N + 1], gnp[NEP_MAX_N + 1];
+  const double u[3] = {x12 / d12, y12 / d12, z12 / d12};
+  find_gn_and_gnp(nep, false, atom.type[n1], atom.type[n2], d12, gn, gnp);
+  const double* Fp = atom.Fp.data() + n1 * (NEP_MAX_N + 1);
+  double radial = 0.0;
+  for (int n = 0; n <= nep.nMaxRadial; ++n)
+    radial += Fp[n] * gnp[n];
+  for (int d = 0; d < 3; ++d)
+    f12[d] = radial * u[d];
+  if (d12 >= nep.rcAngular)
+    return;
+
+  // d(g_n P_k) / dr = g_n' P_k u + g_n (grad P_k - (u . grad P_k) u) / d
+  find_gn_and_gnp(nep, true, atom.type[n1], atom.type[n2], d12, gn, gnp);
+  double p[NEP_NUM_S], dp[NEP_NUM_S * 3];
+  find_angular_polynomials(u[0], u[1], u[2], p, dp);
+  const int numN = nep.nMaxAngular + 1;
+  const int numS = nep.lMax * (nep.lMax + 2);
+  for (int k = 0; k < numS; ++k) {
+    double sumGn = 0.0, sumGnp = 0.0;
+    const double* sumFxyz = atom.sumFxyz.data() + n1 * numN * NEP_NUM_S + k;
+    for (int n = 0; n < numN; ++n) {
+      sumGn += sumFxyz[n * NEP_NUM_S] * gn[n];
+      sumGnp += sumFxyz[n * NEP_NUM_S] * gnp[n];
+    }
+    const double* dpk = dp + k * 3;
+    const double udp = u[0] * dpk[0] + u[1] * dpk[1] + u[2] * dpk[2];
+    for (int d = 0; d < 3; ++d)
+      f12[d] += sumGnp * p[k] * u[d] + sumGn * (dpk[d] - udp * u[d]) / d12;
+  }
+}
+
+// Both passes run over the atoms on atom.numThreads threads. The second one
+// gathers F_1 = sum_2 (dE_1 / dr_12 - dE_2 / dr_21), so that each thread only
+// writes the forces of its own atoms.
+void find_force_nep(Atom& atom)
+{
+  runOnAtoms(atom, [&](const int begin, const int end) {
+    for (int n1 = begin; n1 < end; ++n1)
+      find_descriptor_nep(atom, n1, atom.energy[n1]);
+  });
+
+  runOnAtoms(atom, [&](const int begin, const int end) {
+    for (int n1 = begin; n1 < end; ++n1) {
+      double f[3] = {0.0, 0.0, 0.0};
+      atom.fx[n1] = atom.fy[n1] = atom.fz[n1] = 0.0;
+      for (int i1 = 0; i1 < atom.NN[n1]; ++i1) {
+        const int n2 = atom.NL[n1 * atom.MN + i1];
+        double x12 = atom.x[n2] - atom.x[n1];
+        double y12 = atom.y[n2] - atom.y[n1];
+        double z12 = atom.z[n2] - atom.z[n1];
+        applyMic(atom.box, atom.pbc, x12, y12, z12);
+        const double d12 = sqrt(x12 * x12 + y12 * y12 + z12 * z12);
+        if (d12 >= atom.nep.rcRadial)
+          continue;
+        double f12[3], f21[3];
+        find_partial_force_nep(atom, n1, n2, x12, y12, z12, d12, f12);
+        find_partial_force_nep(atom, n2, n1, -x12, -y12, -z12, d12, f21);
+        for (int d = 0; d < 3; ++d)
+          f[d] += f12[d] - f21[d];
+        if (atom.isHnemd) {
+          const double r12[3] = {x12, y12, z12};
+          find_hnemd_terms(atom, n1, r12, f21);
+        }
+        if (atom.isVirial) {
+          const double r12[3] = {x12, y12, z12};
+          find_virial_terms(atom, n1, r12, f21);
+        }
+      }
+      atom.fx[n1] += f[0];
+      atom.fy[n1] += f[1];
+      atom.fz[n1] += f[2];
+    }
+  });
+
+  atom.pe = sumAtoms(atom, [&](const int n) { return atom.energy[n]; });
+}
+
+// the driving force of a many-body potential does not sum to zero and the
+// total force is corrected as in kappa_hnemd
+void correctTotalForce(Atom& atom)
+{
+  const double fxAve = sumAtoms(atom, [&](const int n) { return atom.fx[n]; });
+  const double fyAve = sumAtoms(atom, [&](const int n) { return atom.fy[n]; });
+  const double fzAve = sumAtoms(atom, [&](const int n) { return atom.fz[n]; });
+  for (int n = 0; n < atom.number; ++n) {
+    atom.fx[n] -= fxAve / atom.number;
+    atom.fy[n] -= fyAve / atom.number;
+    atom.fz[n] -= fzAve / atom.number;
+  }
+}
+
+void findForce(Atom& atom)
+{
+  if (atom.isVirial)
+    std::fill(atom.virial.begin(), atom.virial.end(), 0.0);
+  if (atom.isHnemd) {
+    std::fill(atom.hx.begin(), atom.hx.end(), 0.0);
+    std::fill(atom.hy.begin(), atom.hy.end(), 0.0);
+    std::fill(atom.hz.begin(), atom.hz.end(), 0.0);
+  }
+  if (atom.nep.version > 0) {
+    find_force_nep(atom);
+  } else {
+    find_bonds(atom);
+    find_b_and_bp(atom);
+    find_force_tersoff(atom);
+  }
+  if (atom.isHnemd) {
+    correctTotalForce(atom);
+    atom.hc[0] = sumAtoms(atom, [&](const int n) { return atom.hx[n]; });
+    atom.hc[1] = sumAtoms(atom, [&](const int n) { return atom.hy[n]; });
+    atom.hc[2] = sumAtoms(atom, [&](const int n) { return atom.hz[n]; });
+  }
+}
+
+void integrate(const bool isStepOne, const double timeStep, Atom& atom)
+{
+  const double timeStepHalf = timeStep * 0.5;
+  for (int n = 0; n < atom.number; ++n) {
+    const double mass_inv = 1.0 / atom.mass[n];
+    const double ax = atom.fx[n] * mass_inv;
+    const double ay = atom.fy[n] * mass_inv;
+    const double az = atom.fz[n] * mass_inv;
+    atom.vx[n] += ax * timeStepHalf;
+    atom.vy[n] += ay * timeStepHalf;
+    atom.vz[n] += az * timeStepHalf;
+    if (isStepOne) {
+      atom.x[n] += atom.vx[n] * timeStep;
+      atom.y[n] += atom.vy[n] * timeStep;
+      atom.z[n] += atom.vz[n] * timeStep;
+    }
+  }
+}
+
+// Largest step (not above timeStepMax) for which no atom moves more than
+// maxDisplacement and no atom changes its kinetic energy by more than
+// maxEnergyChange, estimated from the current velocities and forces.
+double findTimeStep(const Atom& atom, const double timeStepMax)
+{
+  double v2max = 0.0;
+  double a2max = 0.0;
+  double powerMax = 0.0;
+  for (int n = 0; n < atom.number; ++n) {
+    const double v2 = atom.vx[n] * atom.vx[n] + atom.vy[n] * atom.vy[n] +
+                      atom.vz[n] * atom.vz[n];
+    const double f2 = atom.fx[n] * atom.fx[n] + atom.fy[n] * atom.fy[n] +
+                      atom.fz[n] * atom.fz[n];
+    const double power = std::abs(
+      atom.fx[n] * atom.vx[n] + atom.fy[n] * atom.vy[n] +
+      atom.fz[n] * atom.vz[n]);
+    v2max = std::max(v2max, v2);
+    a2max = std::max(a2max, f2 / (atom.mass[n] * atom.mass[n]));
+    powerMax = std::max(powerMax, power);
+  }
+  double timeStep = timeStepMax;
+  if (v2max > 0.0)
+    timeStep = std::min(timeStep, atom.maxDisplacement / sqrt(v2max));
+  if (a2max > 0.0)
+    timeStep =
+      std::min(timeStep, sqrt(2.0 * atom.maxDisplacement / sqrt(a2max)));
+  if (atom.maxEnergyChange > 0.0 && powerMax > 0.0)
+    timeStep = std::min(timeStep, atom.maxEnergyChange / powerMax);
+  return timeStep;
+}
+
 std::vector<std::string> getTokens(std::ifstream& input)
 {
   std::string line;
@@ -666,93 +1848,460 @@ int getInt(std::string& token)
     value = std::stoi(token);
   } catch (const std::exception& e) {
     std::cout << "Standard exception:" << e.what() << std::endl;
-    exit(1);
+    fail();
   }
   return value;
 }
 
 double getDouble(std::string& token)
 {
-  float value = 0;
+  double value = 0;
   try {
     value = std::stod(token);
   } catch (const std::exception& e) {
     std::cout << "Standard exception:" << e.what() << std::endl;
-    exit(1);
+    fail();
   }
   return value;
 }
 
-void readRun(int& numSteps, double& timeStep, double& temperature, Atom& atom)
+// nep.txt: a header of keywords and then one parameter per line, in the
+// order of the network, the c coefficients and the descriptor scalers
+void readNep(const std::string& fileName, NEP& nep)
 {
-  std::ifstream input("run.in");
+  std::ifstream input(fileName);
   if (!input.is_open()) {
-    std::cout << "Failed to open run.in." << std::endl;
-    exit(1);
+    std::cout << "Failed to open " << fileName << std::endl;
+    fail();
   }
 
-  while (input.peek() != EOF) {
-    std::vector<std::string> tokens = getTokens(input);
-    if (tokens.size() > 0) {
-      if (tokens[0] == "time_step") {
-        timeStep = getDouble(tokens[1]);
-        if (timeStep < 0) {
-          std::cout << "timeStep should >= 0." << std::endl;
-          exit(1);
-        }
-        std::cout << "timeStep = " << timeStep << " fs." << std::endl;
-      } else if (tokens[0] == "run") {
-        numSteps = getInt(tokens[1]);
-        if (numSteps < 1) {
-          std::cout << "numSteps should >= 1." << std::endl;
-          exit(1);
-        }
-        std::cout << "numSteps = " << numSteps << std::endl;
-      } else if (tokens[0] == "velocity") {
-        temperature = getDouble(tokens[1]);
-        if (temperature < 0) {
-          std::cout << "temperature >= 0." << std::endl;
-          exit(1);
-        }
-        std::cout << "temperature = " << temperature << " K." << std::endl;
-      } else if (tokens[0] == "neighbor_flag") {
-        atom.neighbor_flag = getDouble(tokens[1]);
-        if (atom.neighbor_flag<0 | atom.neighbor_flag> 2) {
-          std::cout << "neighbor_flag can only be 0 or 1 or 2." << std::endl;
-          exit(1);
-        }
-        std::cout << "neighbor_flag = " << atom.neighbor_flag << std::endl;
-      } else if (tokens[0][0] != '#') {
-        std::cout << tokens[0] << " is not a valid keyword." << std::endl;
-        exit(1);
-      }
+  std::vector<std::string> tokens = getTokens(input);
+  if (tokens.size() < 3 || (tokens[0] != "nep3" && tokens[0] != "nep4")) {
+    std::cout << "Only nep3 and nep4 potentials are supported." << std::endl;
+    fail();
+  }
+  nep.version = tokens[0] == "nep3" ? 3 : 4;
+  nep.numTypes = getInt(tokens[1]);
+  if (int(tokens.size()) != 2 + nep.numTypes) {
+    std::cout << "The first line of " << fileName << " should have "
+              << 2 + nep.numTypes << " items." << std::endl;
+    fail();
+  }
+  for (int n = 0; n < nep.numTypes; ++n)
+    nep.elements.push_back(tokens[2 + n]);
+
+  const char* keywords[5] = {"cutoff", "n_max", "basis_size", "l_max", "ANN"};
+  for (int k = 0; k < 5; ++k) {
+    tokens = getTokens(input);
+    if (tokens.size() < 2 || tokens[0] != keywords[k]) {
+      std::cout << "Expected " << keywords[k] << " in " << fileName
+                << std::endl;
+      fail();
+    }
+    if (k == 0) {
+      nep.rcRadial = getDouble(tokens[1]);
+      nep.rcAngular = getDouble(tokens[2]);
+    } else if (k == 1) {
+      nep.nMaxRadial = getInt(tokens[1]);
+      nep.nMaxAngular = getInt(tokens[2]);
+    } else if (k == 2) {
+      nep.basisSizeRadial = getInt(tokens[1]);
+      nep.basisSizeAngular = getInt(tokens[2]);
+    } else if (k == 3) {
+      nep.lMax = getInt(tokens[1]);
+      if (tokens.size() > 2)
+        nep.lMax4 = getInt(tokens[2]);
+      if (tokens.size() > 3)
+        nep.lMax5 = getInt(tokens[3]);
+    } else {
+      nep.numNeurons = getInt(tokens[1]);
     }
   }
+  if (
+    nep.nMaxRadial > NEP_MAX_N || nep.nMaxAngular > NEP_MAX_N ||
+    nep.basisSizeRadial >= NEP_MAX_BASIS ||
+    nep.basisSizeAngular >= NEP_MAX_BASIS || nep.lMax < 1 || nep.lMax > 4 ||
+    (nep.lMax4 > 0 && nep.lMax < 2) || nep.rcAngular > nep.rcRadial) {
+    std::cout << "Unsupported sizes in " << fileName << std::endl;
+    fail();
+  }
 
+  const int numN = nep.nMaxAngular + 1;
+  nep.dim = nep.nMaxRadial + 1 + numN * nep.lMax;
+  nep.dim += (nep.lMax4 > 0) * numN + (nep.lMax5 > 0) * numN;
+  if (nep.dim > NEP_MAX_DIM) {
+    std::cout << "Too many descriptors in " << fileName << std::endl;
+    fail();
+  }
+  int numAnn = (nep.dim + 2) * nep.numNeurons;
+  if (nep.version == 4)
+    numAnn *= nep.numTypes;
+  nep.ann.resize(numAnn + 1);
+  nep.c.resize(
+    nep.numTypes * nep.numTypes *
+    ((nep.nMaxRadial + 1) * (nep.basisSizeRadial + 1) +
+     numN * (nep.basisSizeAngular + 1)));
+  nep.qScaler.resize(nep.dim);
+  for (auto* values : {&nep.ann, &nep.c, &nep.qScaler}) {
+    for (double& value : *values) {
+      tokens = getTokens(input);
+      if (tokens.size() < 1) {
+        std::cout << fileName << " has too few parameters." << std::endl;
+        fail();
+      }
+      value = getDouble(tokens[0]);
+    }
+  }
   input.close();
+
+  std::cout << "Use the NEP" << nep.version << " potential in " << fileName
+            << " with " << nep.dim << " descriptors and " << nep.numNeurons
+            << " neurons." << std::endl;
 }
 
-void readXyz(Atom& atom)
+// lattice fcc|bcc|diamond|hcp|graphene a nx ny nz element mass [options]
+// lattice custom ax ay az bx by bz cx cy cz nx ny nz [options]
+// where the basis atoms of custom come from basis element mass sa sb sc
+// lines; the options are c (of hcp and graphene), displace amplitude,
+// vacancy fraction, alloy element mass fraction and seed
+void readLattice(std::vector<std::string>& tokens, Lattice& lattice)
 {
-  std::ifstream input("xyz.in");
-  if (!input.is_open()) {
-    std::cout << "Failed to open xyz.in." << std::endl;
-    exit(1);
+  const int numTokens = tokens.size();
+  if (numTokens < 2) {
+    std::cout << "lattice needs a name." << std::endl;
+    fail();
+  }
+  lattice.name = tokens[1];
+  const bool isCustom = lattice.name == "custom";
+  const int numFixed = isCustom ? 14 : 8;
+  if (numTokens < numFixed) {
+    std::cout << "lattice " << lattice.name << " should have " << numFixed - 2
+              << " parameters." << std::endl;
+    fail();
+  }
+  double a = 0.0;
+  if (isCustom) {
+    for (int k = 0; k < 9; ++k)
+      lattice.cell[k] = getDouble(tokens[2 + k]);
+  } else {
+    a = getDouble(tokens[2]);
+  }
+  for (int d = 0; d < 3; ++d) {
+    lattice.size[d] = getInt(tokens[(isCustom ? 11 : 3) + d]);
+    if (lattice.size[d] < 1) {
+      std::cout << "lattice sizes should >= 1." << std::endl;
+      fail();
+    }
   }
 
-  std::vector<std::string> tokens = getTokens(input);
+  double c = 0.0;
+  for (int k = numFixed; k < numTokens && tokens[k][0] != '#';) {
+    const std::string& option = tokens[k];
+    const int numValues = option == "alloy" ? 3 : 1;
+    if (k + numValues >= numTokens) {
+      std::cout << "lattice option " << option << " needs " << numValues
+                << " values." << std::endl;
+      fail();
+    }
+    if (option == "c") {
+      c = getDouble(tokens[k + 1]);
+    } else if (option == "displace") {
+      lattice.displacement = getDouble(tokens[k + 1]);
+    } else if (option == "vacancy") {
+      lattice.vacancyFraction = getDouble(tokens[k + 1]);
+    } else if (option == "alloy") {
+      lattice.alloyElement = tokens[k + 1];
+      lattice.alloyMass = getDouble(tokens[k + 2]);
+      lattice.alloyFraction = getDouble(tokens[k + 3]);
+    } else if (option == "seed") {
+      lattice.seed = getInt(tokens[k + 1]);
+    } else {
+      std::cout << option << " is not a valid lattice option." << std::endl;
+      fail();
+    }
+    k += numValues + 1;
+  }
+  if (
+    lattice.vacancyFraction < 0 || lattice.vacancyFraction >= 1 ||
+    lattice.alloyFraction < 0 || lattice.alloyFraction > 1) {
+    std::cout << "vacancy should be in [0, 1) and alloy in [0, 1]."
+              << std::endl;
+    fail();
+  }
+  if (isCustom)
+    return;
+
+  const double cubic[9] = {a, 0.0, 0.0, 0.0, a, 0.0, 0.0, 0.0, a};
+  const double hexagonal[9] = {a, 0.0, 0.0, a * 0.5, a * sqrt(3.0) * 0.5, 0.0,
+                               0.0, 0.0, 1.0};
+  const double third = 1.0 / 3.0;
+  if (lattice.name == "fcc" || lattice.name == "diamond") {
+    std::copy(cubic, cubic + 9, lattice.cell);
+    lattice.basis = {
+      0.0, 0.0, 0.0, 0.0, 0.5, 0.5, 0.5, 0.0, 0.5, 0.5, 0.5, 0.0};
+    if (lattice.name == "diamond") {
+      for (int k = 0; k < 12; ++k)
+        lattice.basis.push_back(lattice.basis[k] + 0.25);
+    }
+  } else if (lattice.name == "bcc") {
+    std::copy(cubic, cubic + 9, lattice.cell);
+    lattice.basis = {0.0, 0.0, 0.0, 0.5, 0.5, 0.5};
+  } else if (lattice.name == "hcp") {
+    std::copy(hexagonal, hexagonal + 9, lattice.cell);
+    lattice.cell[8] = c > 0.0 ? c : a * sqrt(8.0 / 3.0); // ideal c / a
+    lattice.basis = {0.0, 0.0, 0.0, third, third, 0.5};
+  } else if (lattice.name == "graphene") {
+    // a sheet in the xy plane, with a free z direction
+    std::copy(hexagonal, hexagonal + 9, lattice.cell);
+    lattice.cell[8] = c > 0.0 ? c : 10.0;
+    lattice.basis = {0.0, 0.0, 0.5, third, third, 0.5};
+    lattice.pbc[2] = 0;
+  } else {
+    std::cout << "lattice can only be fcc, bcc, diamond, hcp, graphene or "
+                 "custom."
+              << std::endl;
+    fail();
+  }
+  if (c > 0.0 && lattice.name != "hcp" && lattice.name != "graphene") {
+    std::cout << "c is only for hcp and graphene." << std::endl;
+    fail();
+  }
+  const int numBasis = lattice.basis.size() / 3;
+  lattice.elements.assign(numBasis, tokens[6]);
+  lattice.masses.assign(numBasis, getDouble(tokens[7]));
+}
 
-  // line 1
-  if (tokens.size() != 1) {
-    std::cout << "The first line of xyz.in should have one item." << std::endl;
-    exit(1);
+// one line of run.in, split into tokens
+void parseRunLine(
+  std::vector<std::string>& tokens,
+  int& numSteps,
+  double& timeStep,
+  double& temperature,
+  Atom& atom)
+{
+  if (tokens[0][0] != '#' && tokens.size() < 2) {
+    std::cout << tokens[0] << " should have a value." << std::endl;
+    fail();
   }
-  atom.number = getInt(tokens[0]);
-  std::cout << "Number of atoms = " << atom.number << std::endl;
+  if (tokens[0] == "time_step") {
+    timeStep = getDouble(tokens[1]);
+    if (timeStep < 0) {
+      std::cout << "timeStep should >= 0." << std::endl;
+      fail();
+    }
+    std::cout << "timeStep = " << timeStep << " fs." << std::endl;
+  } else if (tokens[0] == "adaptive_time_step") {
+    atom.maxDisplacement = getDouble(tokens[1]);
+    if (atom.maxDisplacement <= 0) {
+      std::cout << "maxDisplacement should > 0." << std::endl;
+      fail();
+    }
+    if (tokens.size() > 2 && tokens[2][0] != '#')
+      atom.maxEnergyChange = getDouble(tokens[2]);
+    std::cout << "maxDisplacement = " << atom.maxDisplacement
+              << " A, maxEnergyChange = " << atom.maxEnergyChange
+              << " eV." << std::endl;
+  } else if (tokens[0] == "flush_interval") {
+    atom.flushInterval = getDouble(tokens[1]);
+    if (atom.flushInterval <= 0) {
+      std::cout << "flush_interval should > 0." << std::endl;
+      fail();
+    }
+    std::cout << "flush_interval = " << atom.flushInterval << " s."
+              << std::endl;
+  } else if (tokens[0] == "potential") {
+    if (tokens.size() > 2 && tokens[1] == "nep") {
+      readNep(tokens[2], atom.nep);
+      atom.cutoffNeighbor = atom.nep.rcRadial + 1.0; // same skin
+    } else if (tokens.size() < 2 || tokens[1] != "tersoff") {
+      std::cout << "potential can only be tersoff or nep file." << std::endl;
+      fail();
+    }
+  } else if (tokens[0] == "num_threads") {
+    atom.numThreads = getInt(tokens[1]);
+    if (atom.numThreads < 1) {
+      std::cout << "num_threads should >= 1." << std::endl;
+      fail();
+    }
+    std::cout << "num_threads = " << atom.numThreads << std::endl;
+  } else if (tokens[0] == "reduction_block") {
+    atom.reductionBlock = getInt(tokens[1]);
+    if (atom.reductionBlock < 1) {
+      std::cout << "reduction_block should >= 1." << std::endl;
+      fail();
+    }
+    if (tokens.size() > 2 && tokens[2] == "kahan")
+      atom.isCompensated = true;
+    std::cout << "reduction_block = " << atom.reductionBlock
+              << (atom.isCompensated ? " with Kahan sums" : "")
+              << std::endl;
+  } else if (tokens[0] == "hnemd") {
+    if (tokens.size() < 3) {
+      std::cout << "hnemd should have 2 or 3 parameters." << std::endl;
+      fail();
+    }
+    const std::string directions = "xyz";
+    if (tokens[1].size() != 1 || directions.find(tokens[1]) > 2) {
+      std::cout << "hnemd direction can only be x or y or z." << std::endl;
+      fail();
+    }
+    atom.isHnemd = true;
+    atom.hnemdDirection = directions.find(tokens[1]);
+    atom.hnemdFe = getDouble(tokens[2]);
+    if (atom.hnemdFe == 0) {
+      std::cout << "hnemd Fe should not be 0." << std::endl;
+      fail();
+    }
+    if (tokens.size() > 3 && tokens[3][0] != '#')
+      atom.numEquilibrationSteps = getInt(tokens[3]);
+    if (atom.numEquilibrationSteps < 0) {
+      std::cout << "hnemd equilibration steps should >= 0." << std::endl;
+      fail();
+    }
+    std::cout << "hnemd Fe_" << tokens[1] << " = " << atom.hnemdFe
+              << " /A after " << atom.numEquilibrationSteps
+              << " equilibration steps." << std::endl;
+  } else if (tokens[0] == "ipi") {
+    const bool isUnix = tokens.size() > 2 && tokens[1] == "unix";
+    const bool isInet = tokens.size() > 3 && tokens[1] == "inet";
+    if (!isUnix && !isInet) {
+      std::cout << "ipi should be unix name or inet host port." << std::endl;
+      fail();
+    }
+    atom.ipiAddress.assign(tokens.begin() + 1, tokens.begin() + 3 + isInet);
+    std::cout << "i-PI client of " << tokens[1] << " " << tokens[2]
+              << (isInet ? " " + tokens[3] : "") << std::endl;
+  } else if (tokens[0] == "thermostat") {
+    if (tokens.size() < 3 || tokens[1] != "massive_nhc") {
+      std::cout << "thermostat should be massive_nhc tau [chain_length]."
+                << std::endl;
+      fail();
+    }
+    atom.nhcTau = getDouble(tokens[2]) / TIME_UNIT_CONVERSION;
+    atom.nhcLength = tokens.size() > 3 ? getInt(tokens[3]) : 4;
+    if (atom.nhcTau <= 0.0) {
+      std::cout << "The thermostat tau should > 0." << std::endl;
+      fail();
+    }
+    if (atom.nhcLength < 2 || atom.nhcLength > NHC_MAX_LENGTH) {
+      std::cout << "The chain length should be from 2 to " << NHC_MAX_LENGTH
+                << std::endl;
+      fail();
+    }
+    std::cout << "Massive Nose-Hoover chains of length " << atom.nhcLength
+              << " with tau = " << tokens[2] << " fs." << std::endl;
+  } else if (tokens[0] == "monitor") {
+    if (tokens.size() < 2) {
+      std::cout << "monitor should be name [interval]." << std::endl;
+      fail();
+    }
+    atom.monitorName = tokens[1];
+    if (tokens.size() > 2)
+      atom.monitorInterval = getInt(tokens[2]);
+    if (atom.monitorInterval < 1) {
+      std::cout << "The monitor interval should >= 1." << std::endl;
+      fail();
+    }
+    std::cout << "monitor = /md_" << atom.monitorName << " every "
+              << atom.monitorInterval << " steps" << std::endl;
+  } else if (tokens[0] == "lattice") {
+    readLattice(tokens, atom.lattice);
+    std::cout << "lattice = " << atom.lattice.name << std::endl;
+  } else if (tokens[0] == "basis") {
+    if (atom.lattice.name != "custom") {
+      std::cout << "basis lines should follow lattice custom." << std::endl;
+      fail();
+    }
+    if (tokens.size() < 6) {
+      std::cout << "basis should have 5 parameters." << std::endl;
+      fail();
+    }
+    atom.lattice.elements.push_back(tokens[1]);
+    atom.lattice.masses.push_back(getDouble(tokens[2]));
+    for (int d = 0; d < 3; ++d)
+      atom.lattice.basis.push_back(getDouble(tokens[3 + d]));
+  } else if (tokens[0] == "run") {
+    numSteps = getInt(tokens[1]);
+    if (numSteps < 1) {
+      std::cout << "numSteps should >= 1." << std::endl;
+      fail();
+    }
+    std::cout << "numSteps = " << numSteps << std::endl;
+  } else if (tokens[0] == "velocity") {
+    temperature = getDouble(tokens[1]);
+    if (temperature < 0) {
+      std::cout << "temperature >= 0." << std::endl;
+      fail();
+    }
+    std::cout << "temperature = " << temperature << " K." << std::endl;
+  } else if (tokens[0] == "neighbor_flag") {
+    atom.neighbor_flag = getDouble(tokens[1]);
+    if (atom.neighbor_flag<0 | atom.neighbor_flag> 3) {
+      std::cout << "neighbor_flag can only be 0 or 1 or 2 or 3." << std::endl;
+      fail();
+    }
+    std::cout << "neighbor_flag = " << atom.neighbor_flag << std::endl;
+    if (
+      atom.neighbor_flag == 3 && tokens.size() > 2 &&
+      tokens[2][0] != '#') {
+      atom.rebuildFraction = getDouble(tokens[2]);
+      if (atom.rebuildFraction < 0 || atom.rebuildFraction > 1) {
+        std::cout << "rebuildFraction should be in [0, 1]." << std::endl;
+        fail();
+      }
+      std::cout << "rebuildFraction = " << atom.rebuildFraction << std::endl;
+    }
+  } else if (tokens[0] == "plugin") {
+    // the plugins of md2 read a half neighbor list and a pair heat current
+    std::cout << "plugin is only in md2; use hnemd for kappa." << std::endl;
+    fail();
+  } else if (tokens[0][0] != '#') {
+    std::cout << tokens[0] << " is not a valid keyword." << std::endl;
+    fail();
+  }
+}
 
-  // allocate memory
+void readRun(int& numSteps, double& timeStep, double& temperature, Atom& atom)
+{
+  std::ifstream input("run.in");
+  if (!input.is_open()) {
+    std::cout << "Failed to open run.in." << std::endl;
+    fail();
+  }
+
+  while (input.peek() != EOF) {
+    std::vector<std::string> tokens = getTokens(input);
+    if (tokens.size() > 0)
+      parseRunLine(tokens, numSteps, timeStep, temperature, atom);
+  }
+
+  input.close();
+}
+
+void allocateMemory(Atom& atom)
+{
   atom.NN.resize(atom.number, 0);
   atom.NL.resize(atom.number * atom.MN, 0);
+  const int numBonds = atom.number * atom.MB + 8; // 8 for the SIMD loads
+  atom.NB.resize(atom.number, 0);
+  atom.BL.resize(numBonds, 0);
+  atom.bx.resize(numBonds, 0.0);
+  atom.by.resize(numBonds, 0.0);
+  atom.bz.resize(numBonds, 0.0);
+  atom.bd.resize(numBonds, 0.0);
+  atom.b.resize(numBonds, 0.0);
+  atom.bp.resize(numBonds, 0.0);
+  atom.fc.resize(numBonds, 0.0);
+  atom.fcp.resize(numBonds, 0.0);
+  atom.fa.resize(numBonds, 0.0);
+  atom.fap.resize(numBonds, 0.0);
+  atom.isDirty.resize(atom.number, 0);
+  if (atom.isHnemd) {
+    atom.hx.resize(atom.number, 0.0);
+    atom.hy.resize(atom.number, 0.0);
+    atom.hz.resize(atom.number, 0.0);
+  }
+  atom.pad.resize(atom.number, 0.0);
   atom.mass.resize(atom.number, 0.0);
   atom.x0.resize(atom.number, 0.0);
   atom.y0.resize(atom.number, 0.0);
@@ -766,20 +2315,19 @@ void readXyz(Atom& atom)
   atom.fx.resize(atom.number, 0.0);
   atom.fy.resize(atom.number, 0.0);
   atom.fz.resize(atom.number, 0.0);
-
-  // line 2
-  tokens = getTokens(input);
-  if (tokens.size() != 9) {
-    std::cout << "The second line of xyz.in should have 9 items." << std::endl;
-    exit(1);
+  atom.energy.resize(atom.number, 0.0);
+  atom.type.resize(atom.number, 0);
+  if (atom.nep.version > 0) {
+    const int numN = atom.nep.nMaxAngular + 1;
+    atom.Fp.resize(atom.number * (NEP_MAX_N + 1), 0.0);
+    atom.sumFxyz.resize(atom.number * numN * NEP_NUM_S, 0.0);
   }
+}
 
-  for (int d1 = 0; d1 < 3; ++d1) {
-    for (int d2 = 0; d2 < 3; ++d2) {
-      atom.box[d2 * 3 + d1] = getDouble(tokens[d1 * 3 + d2]);
-    }
-  }
-  getInverseBox(atom.box);
+void printBox(const Atom& atom)
+{
+  std::cout << "pbc = " << atom.pbc[0] << " " << atom.pbc[1] << " "
+            << atom.pbc[2] << std::endl;
 
   std::cout << "box matrix H = " << std::endl;
   for (int d1 = 0; d1 < 3; ++d1) {
@@ -796,6 +2344,62 @@ void readXyz(Atom& atom)
     }
     std::cout << std::endl;
   }
+}
+
+// index of element in the NEP potential, or 0 for Tersoff
+int findType(const Atom& atom, const std::string& element)
+{
+  if (atom.nep.version == 0)
+    return 0;
+  const auto& elements = atom.nep.elements;
+  auto it = std::find(elements.begin(), elements.end(), element);
+  if (it == elements.end()) {
+    std::cout << element << " is not in the NEP potential." << std::endl;
+    fail();
+  }
+  return it - elements.begin();
+}
+
+void readXyz(Atom& atom)
+{
+  std::ifstream input("xyz.in");
+  if (!input.is_open()) {
+    std::cout << "Failed to open xyz.in." << std::endl;
+    fail();
+  }
+
+  std::vector<std::string> tokens = getTokens(input);
+
+  // line 1
+  if (tokens.size() != 1) {
+    std::cout << "The first line of xyz.in should have one item." << std::endl;
+    fail();
+  }
+  atom.number = getInt(tokens[0]);
+  std::cout << "Number of atoms = " << atom.number << std::endl;
+
+  allocateMemory(atom);
+
+  // line 2
+  tokens = getTokens(input);
+  if (tokens.size() != 9 && tokens.size() != 12) {
+    std::cout << "The second line of xyz.in should have 9 or 12 items."
+              << std::endl;
+    fail();
+  }
+
+  for (int d1 = 0; d1 < 3; ++d1) {
+    for (int d2 = 0; d2 < 3; ++d2) {
+      atom.box[d2 * 3 + d1] = getDouble(tokens[d1 * 3 + d2]);
+    }
+  }
+  getInverseBox(atom.box);
+  if (tokens.size() == 12) {
+    for (int d = 0; d < 3; ++d) {
+      atom.pbc[d] = getInt(tokens[9 + d]);
+    }
+  }
+  printBox(atom);
 
   // starting from line 3
   for (int n = 0; n < atom.number; ++n) {
@@ -803,9 +2407,9 @@ void readXyz(Atom& atom)
     if (tokens.size() != 5) {
       std::cout << "The 3rd line and later of xyz.in should have 5 items."
                 << std::endl;
-      exit(1);
+      fail();
     }
-    // atom types not used
+    atom.type[n] = findType(atom, tokens[0]);
     atom.x[n] = getDouble(tokens[1]);
     atom.y[n] = getDouble(tokens[2]);
     atom.z[n] = getDouble(tokens[3]);
@@ -815,6 +2419,638 @@ void readXyz(Atom& atom)
   input.close();
 }
 
+// uniform random number in [0, 1) for draw k of lattice site n, which does
+// not depend on the order in which the sites are filled
+double getSiteRandom(
+  const unsigned long long seed, const long long n, const int k)
+{
+  unsigned long long z = seed + (n * 8ULL + k + 1) * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return ((z ^ (z >> 31)) >> 11) * 0x1.0p-53;
+}
+
+// fill the atoms from atom.lattice on atom.numThreads threads; the sites are
+// ordered by cell and then basis atom, with vacancies removed
+void buildLattice(Atom& atom)
+{
+  const Lattice& lattice = atom.lattice;
+  const int numBasis = lattice.masses.size();
+  if (numBasis == 0) {
+    std::cout << "lattice custom needs basis atoms." << std::endl;
+    fail();
+  }
+  unsigned long long seed = lattice.seed;
+#ifndef DEBUG
+  if (seed == 0)
+    seed = time(NULL);
+#endif
+
+  const int* size = lattice.size;
+  const long long numSites = (long long)size[0] * size[1] * size[2] * numBasis;
+  std::vector<long long> sites;
+  sites.reserve(numSites);
+  for (long long s = 0; s < numSites; ++s) {
+    if (getSiteRandom(seed, s, 0) >= lattice.vacancyFraction)
+      sites.push_back(s);
+  }
+  if (sites.size() > 2000000000) {
+    std::cout << "Too many atoms in the lattice." << std::endl;
+    fail();
+  }
+  atom.number = sites.size();
+  std::cout << "Number of atoms = " << atom.number << std::endl;
+  allocateMemory(atom);
+
+  for (int d1 = 0; d1 < 3; ++d1) {
+    atom.pbc[d1] = lattice.pbc[d1];
+    for (int d2 = 0; d2 < 3; ++d2)
+      atom.box[d2 * 3 + d1] = lattice.cell[d1 * 3 + d2] * size[d1];
+  }
+  getInverseBox(atom.box);
+  printBox(atom);
+
+  std::vector<int> types(numBasis);
+  for (int b = 0; b < numBasis; ++b)
+    types[b] = findType(atom, lattice.elements[b]);
+  const int alloyType =
+    lattice.alloyFraction > 0.0 ? findType(atom, lattice.alloyElement) : 0;
+
+  runOnAtoms(atom, [&](const int begin, const int end) {
+    for (int n = begin; n < end; ++n) {
+      const long long s = sites[n];
+      const int b = s % numBasis;
+      const long long cell = s / numBasis;
+      const double f[3] = {
+        cell / (size[1] * size[2]) + lattice.basis[b * 3],
+        cell / size[2] % size[1] + lattice.basis[b * 3 + 1],
+        cell % size[2] + lattice.basis[b * 3 + 2]};
+      double r[3];
+      for (int d = 0; d < 3; ++d) {
+        r[d] = f[0] * lattice.cell[d] + f[1] * lattice.cell[3 + d] +
+               f[2] * lattice.cell[6 + d];
+        const double random = getSiteRandom(seed, s, 2 + d);
+        r[d] += lattice.displacement * (2.0 * random - 1.0);
+      }
+      atom.x[n] = r[0];
+      atom.y[n] = r[1];
+      atom.z[n] = r[2];
+      const bool isAlloy = getSiteRandom(seed, s, 1) < lattice.alloyFraction;
+      atom.mass[n] = isAlloy ? lattice.alloyMass : lattice.masses[b];
+      atom.type[n] = isAlloy ? alloyType : types[b];
+    }
+  });
+}
+
+// block averages of the HNEMD thermal conductivity, appended to kappa.txt
+// in the format of kappa_hnemd: time (ps), kappa_x, kappa_y and kappa_z in
+// W/(mK); each step adds hc * dt to the blocks of Ns * timeStep it covers
+struct KappaWriter {
+  std::ofstream output;
+  double blockTime;
+  double factor;
+  double hcSum[3] = {0.0, 0.0, 0.0};
+  int numBlocks = 0;
+
+  KappaWriter(const Atom& atom, const double temperature, const double dt)
+    : output("kappa.txt", std::ios::app), blockTime(Ns * dt)
+  {
+    const double volume = std::abs(getDet(atom.box));
+    factor = KAPPA_UNIT_CONVERSION / (temperature * volume * atom.hnemdFe);
+  }
+
+  // hc during the production time from tOld to t
+  void sample(const double* hc, double tOld, const double t)
+  {
+    double tBlock = (numBlocks + 1) * blockTime;
+    while (tBlock < t + 1.0e-6 * blockTime / Ns) {
+      for (int d = 0; d < 3; ++d)
+        hcSum[d] += hc[d] * factor * (tBlock - tOld);
+      char line[128];
+      snprintf(
+        line, sizeof(line), "%25.15e%25.15e%25.15e%25.15e\n",
+        tBlock * TIME_UNIT_CONVERSION / 1000.0, hcSum[0] / blockTime,
+        hcSum[1] / blockTime, hcSum[2] / blockTime);
+      output << line;
+      for (int d = 0; d < 3; ++d)
+        hcSum[d] = 0.0;
+      ++numBlocks;
+      tOld = tBlock;
+      tBlock = (numBlocks + 1) * blockTime;
+    }
+    for (int d = 0; d < 3; ++d)
+      hcSum[d] += hc[d] * factor * (t - tOld);
+  }
+};
+
+// virial -dU/d(strain) in eV, row-major, from the per-atom virials W
+void findVirial(Atom& atom, double* virial)
+{
+  for (int a = 0; a < 3; ++a) {
+    for (int b = 0; b < 3; ++b) {
+      virial[b * 3 + a] = sumAtoms(
+        atom, [&](const int n) { return atom.virial[n * 9 + a * 3 + b]; });
+    }
+  }
+}
+
+// i-PI client: the server sends 12-byte headers and the client answers with
+// forces, energy and virial in atomic units, keeping its neighbor list
+// between requests; see https://ipi-code.org for the protocol and
+// tools/ipimock.cpp for a server that checks the answers
+#ifndef _WIN32
+const double BOHR = 0.52917721067;  // A
+const double HARTREE = 27.21138602; // eV
+const int IPI_HEADER_SIZE = 12;
+
+void readSocket(const int socket, void* data, const size_t size)
+{
+  char* bytes = (char*)data;
+  size_t count = 0;
+  while (count < size) {
+    const ssize_t n = recv(socket, bytes + count, size - count, 0);
+    if (n <= 0) {
+      std::cout << "Lost the connection to the i-PI server." << std::endl;
+      fail();
+    }
+    count += n;
+  }
+}
+
+void writeSocket(const int socket, const void* data, const size_t size)
+{
+  const char* bytes = (const char*)data;
+  size_t count = 0;
+  while (count < size) {
+    const ssize_t n = send(socket, bytes + count, size - count, 0);
+    if (n <= 0) {
+      std::cout << "Lost the connection to the i-PI server." << std::endl;
+      fail();
+    }
+    count += n;
+  }
+}
+
+void writeHeader(const int socket, const std::string& message)
+{
+  char header[IPI_HEADER_SIZE];
+  std::fill(header, header + IPI_HEADER_SIZE, ' ');
+  std::copy(message.begin(), message.end(), header);
+  writeSocket(socket, header, IPI_HEADER_SIZE);
+}
+
+// ipi unix name: the socket /tmp/ipi_name as in i-PI; ipi inet host port
+int connectIpi(const std::vector<std::string>& address)
+{
+  int result = -1;
+  if (address[0] == "unix") {
+    sockaddr_un server = {};
+    server.sun_family = AF_UNIX;
+    const std::string path = "/tmp/ipi_" + address[1];
+    if (path.size() >= sizeof(server.sun_path)) {
+      std::cout << "The i-PI socket name is too long." << std::endl;
+      fail();
+    }
+    std::copy(path.begin(), path.end(), server.sun_path);
+    const int socketUnix = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(socketUnix, (sockaddr*)&server, sizeof(server)) == 0)
+      result = socketUnix;
+    else
+      close(socketUnix);
+  } else {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* list = nullptr;
+    if (getaddrinfo(address[1].c_str(), address[2].c_str(), &hints, &list))
+      list = nullptr;
+    for (addrinfo* p = list; p && result < 0; p = p->ai_next) {
+      const int socketInet = socket(p->ai_family, p->ai_socktype, 0);
+      if (connect(socketInet, p->ai_addr, p->ai_addrlen) == 0) {
+        const int flag = 1; // small messages are sent at once
+        setsockopt(socketInet, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        result = socketInet;
+      } else {
+        close(socketInet);
+      }
+    }
+    if (list)
+      freeaddrinfo(list);
+  }
+  if (result < 0) {
+    std::cout << "Failed to connect to the i-PI server." << std::endl;
+    fail();
+  }
+  return result;
+}
+
+// the positions and cell of POSDATA; a new cell forces a neighbor list
+// update, and each position is taken as the periodic image closest to the
+// previous one, so that the list is only updated when atoms move
+void setIpiPositions(Atom& atom, const double* cell, const double* r)
+{
+  bool isNewBox = false;
+  for (int k = 0; k < 9; ++k) {
+    const double value = cell[k] * BOHR;
+    isNewBox = isNewBox || value != atom.box[k];
+    atom.box[k] = value;
+  }
+  if (isNewBox) {
+    getInverseBox(atom.box);
+    std::fill(atom.x0.begin(), atom.x0.end(), 1.0e10);
+  }
+  for (int n = 0; n < atom.number; ++n) {
+    double x = r[n * 3 + 0] * BOHR;
+    double y = r[n * 3 + 1] * BOHR;
+    double z = r[n * 3 + 2] * BOHR;
+    if (!isNewBox) {
+      x -= atom.x[n];
+      y -= atom.y[n];
+      z -= atom.z[n];
+      applyMic(atom.box, atom.pbc, x, y, z);
+      x += atom.x[n];
+      y += atom.y[n];
+      z += atom.z[n];
+    }
+    atom.x[n] = x;
+    atom.y[n] = y;
+    atom.z[n] = z;
+  }
+}
+
+void runIpiClient(Atom& atom)
+{
+  std::signal(SIGPIPE, SIG_IGN); // a closed server is an error from send
+  const int socket = connectIpi(atom.ipiAddress);
+  atom.isVirial = true;
+  atom.virial.resize(atom.number * 9);
+  std::cout << "Connected to the i-PI server." << std::endl;
+  std::fill(atom.box, atom.box + 9, 0.0); // the first POSDATA sets the box
+  std::vector<double> buffer(atom.number * 3);
+  double virial[9];
+  bool hasData = false;
+  int numRequests = 0;
+  while (true) {
+    char header[IPI_HEADER_SIZE + 1] = {};
+    readSocket(socket, header, IPI_HEADER_SIZE);
+    std::string message(header);
+    message.erase(message.find_last_not_of(' ') + 1);
+    if (message == "STATUS") {
+      writeHeader(socket, hasData ? "HAVEDATA" : "READY");
+    } else if (message == "INIT") {
+      int32_t bead, size;
+      readSocket(socket, &bead, 4);
+      readSocket(socket, &size, 4);
+      std::vector<char> text(size);
+      readSocket(socket, text.data(), size);
+    } else if (message == "POSDATA") {
+      double cell[9], cellInverse[9];
+      int32_t number;
+      readSocket(socket, cell, sizeof(cell));
+      readSocket(socket, cellInverse, sizeof(cellInverse));
+      readSocket(socket, &number, 4);
+      if (number != atom.number) {
+        std::cout << "i-PI sent " << number << " atoms instead of "
+                  << atom.number << std::endl;
+        fail();
+      }
+      readSocket(socket, buffer.data(), buffer.size() * sizeof(double));
+      setIpiPositions(atom, cell, buffer.data());
+      if (atom.neighbor_flag != 0)
+        findNeighbor(atom);
+      findForce(atom);
+      findVirial(atom, virial);
+      hasData = true;
+      ++numRequests;
+    } else if (message == "GETFORCE") {
+      if (!hasData) {
+        std::cout << "i-PI asked for forces before sending positions."
+                  << std::endl;
+        fail();
+      }
+      const double pe = atom.pe / HARTREE;
+      const int32_t number = atom.number;
+      for (int n = 0; n < atom.number; ++n) {
+        buffer[n * 3 + 0] = atom.fx[n] * BOHR / HARTREE;
+        buffer[n * 3 + 1] = atom.fy[n] * BOHR / HARTREE;
+        buffer[n * 3 + 2] = atom.fz[n] * BOHR / HARTREE;
+      }
+      for (int k = 0; k < 9; ++k)
+        virial[k] /= HARTREE;
+      const int32_t extraSize = 0;
+      writeHeader(socket, "FORCEREADY");
+      writeSocket(socket, &pe, sizeof(pe));
+      writeSocket(socket, &number, 4);
+      writeSocket(socket, buffer.data(), buffer.size() * sizeof(double));
+      writeSocket(socket, virial, sizeof(virial));
+      writeSocket(socket, &extraSize, 4);
+      hasData = false;
+    } else if (message == "EXIT") {
+      break;
+    } else {
+      std::cout << "Unknown i-PI message " << message << std::endl;
+      fail();
+    }
+  }
+  close(socket);
+  std::cout << numRequests << " i-PI force requests, " << atom.numUpdates
+            << " neighbor list updates" << std::endl;
+}
+#else
+void runIpiClient(Atom& atom)
+{
+  std::cout << "ipi is not supported on Windows." << std::endl;
+  fail();
+}
+#endif
+
+// pressure in GPa from the kinetic energy and the virial of the last
+// findForce with atom.isVirial
+double findPressure(Atom& atom, const double kineticEnergy)
+{
+  double virial[9];
+  findVirial(atom, virial);
+  const double volume = std::abs(getDet(atom.box));
+  const double trace = 2.0 * kineticEnergy + virial[0] + virial[4] + virial[8];
+  return trace / (3.0 * volume) * PRESSURE_UNIT_CONVERSION;
+}
+
+// Live metrics for tools/mdtop.cpp in the POSIX shared memory /md_<name>,
+// with the layout of md_monitor.h
+#ifndef _WIN32
+struct Monitor {
+  std::string path;
+  size_t size;
+  MonitorHeader* header;
+  MonitorRecord* records;
+  std::chrono::steady_clock::time_point tLap, tRecord;
+  double phaseTime[4] = {0.0, 0.0, 0.0, 0.0};
+  double timeRecord = 0.0;
+
+  Monitor(const Atom& atom, const std::string& program, const int numSteps)
+    : path("/md_" + atom.monitorName)
+  {
+    size = sizeof(MonitorHeader) + sizeof(MonitorRecord) * MONITOR_SLOTS;
+    const int fd = shm_open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+      std::cout << "Failed to create the shared memory " << path << std::endl;
+      fail();
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      std::cout << "Failed to map the shared memory " << path << std::endl;
+      fail();
+    }
+    header = (MonitorHeader*)data; // zero-filled by ftruncate
+    records = (MonitorRecord*)(header + 1);
+    std::string("mdtop").copy(header->magic, sizeof(header->magic) - 1);
+    program.copy(header->program, sizeof(header->program) - 1);
+    header->numSlots = MONITOR_SLOTS;
+    header->recordSize = sizeof(MonitorRecord);
+    header->pid = getpid();
+    header->numAtoms = atom.number;
+    header->numSteps = numSteps;
+    header->isRunning.store(1);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->version = MONITOR_VERSION; // the reader checks this last
+    tLap = tRecord = std::chrono::steady_clock::now();
+    std::cout << "Metrics in the shared memory " << path << std::endl;
+  }
+
+  ~Monitor()
+  {
+    header->isRunning.store(0, std::memory_order_release);
+    munmap(header, size);
+    shm_unlink(path.c_str()); // a reader keeps its mapping
+  }
+
+  // adds the time since the previous lap to phase
+  void lap(const int phase)
+  {
+    const auto t = std::chrono::steady_clock::now();
+    phaseTime[phase] += std::chrono::duration<double>(t - tLap).count();
+    tLap = t;
+  }
+
+  void publish(
+    const Atom& atom, const int step, const double time, const double T,
+    const double pressure)
+  {
+    const auto t = std::chrono::steady_clock::now();
+    const double wallTime = std::chrono::duration<double>(t - tRecord).count();
+    const double fs = (time - timeRecord) * TIME_UNIT_CONVERSION;
+    tRecord = t;
+    timeRecord = time;
+
+    const uint64_t index = header->numRecords.load(std::memory_order_relaxed);
+    MonitorRecord& record = records[index % MONITOR_SLOTS];
+    const uint64_t sequence = record.sequence.load(std::memory_order_relaxed);
+    record.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.index = index;
+    record.step = step;
+    record.numUpdates = atom.numUpdates;
+    record.time = time * TIME_UNIT_CONVERSION / 1000.0;
+    record.temperature = T;
+    record.pe = atom.pe;
+    record.pressure = pressure;
+    record.nsPerDay = wallTime > 0.0 ? fs * 1.0e-6 / (wallTime / 86400.0) : 0.0;
+    std::copy(phaseTime, phaseTime + 4, record.phaseTime);
+    record.sequence.store(sequence + 2, std::memory_order_release);
+    header->numRecords.store(index + 1, std::memory_order_release);
+  }
+};
+#else
+struct Monitor {
+  Monitor(const Atom& atom, const std::string& program, const int numSteps)
+  {
+    std::cout << "monitor is not supported on Windows." << std::endl;
+    fail();
+  }
+  void lap(const int phase) {}
+  void publish(
+    const Atom& atom, const int step, const double time, const double T,
+    const double pressure)
+  {
+  }
+};
+#endif
+
+// the C interface in md3.h, with time in fs and other units as in run.in
+struct md3_system {
+  Atom atom;
+  int numSteps = 0;
+  double timeStep = 1.0; // fs
+  double temperature = 0.0;
+  bool isForceValid = false;
+};
+
+int md3_abi_version(void) { return MD3_ABI_VERSION; }
+
+md3_system* md3_create(void) { return new md3_system; }
+
+void md3_destroy(md3_system* system) { delete system; }
+
+int md3_command(md3_system* system, const char* line)
+{
+  try {
+    std::istringstream iss(line);
+    std::vector<std::string> tokens{
+      std::istream_iterator<std::string>{iss},
+      std::istream_iterator<std::string>{}};
+    if (tokens.size() == 0)
+      return 0;
+    // before parseRunLine, so that a rejected line leaves no state behind
+    const std::string& keyword = tokens[0];
+    if (
+      keyword == "lattice" || keyword == "basis" || keyword == "hnemd" ||
+      keyword == "ipi" || keyword == "monitor" ||
+      keyword == "adaptive_time_step") {
+      std::cout << tokens[0] << " is not supported in library mode."
+                << std::endl;
+      fail();
+    }
+    parseRunLine(
+      tokens, system->numSteps, system->timeStep, system->temperature,
+      system->atom);
+  } catch (const InputError&) {
+    return 1;
+  }
+  return 0;
+}
+
+int md3_set_atoms(
+  md3_system* system,
+  int number,
+  const double* box,
+  const int* pbc,
+  const int* type,
+  const double* mass,
+  const double* x,
+  const double* y,
+  const double* z)
+{
+  try {
+    Atom& atom = system->atom;
+    if (number < 1) {
+      std::cout << "number of atoms should >= 1." << std::endl;
+      fail();
+    }
+    atom.number = number;
+    allocateMemory(atom);
+    for (int d1 = 0; d1 < 3; ++d1) {
+      for (int d2 = 0; d2 < 3; ++d2) {
+        atom.box[d2 * 3 + d1] = box[d1 * 3 + d2];
+      }
+    }
+    getInverseBox(atom.box);
+    for (int d = 0; d < 3; ++d)
+      atom.pbc[d] = pbc ? pbc[d] : 1;
+    if (
+      (atom.neighbor_flag == 3) &&
+      (!atom.pbc[0] || !atom.pbc[1] || !atom.pbc[2])) {
+      std::cout << "neighbor_flag 3 needs a fully periodic box." << std::endl;
+      fail();
+    }
+    for (int n = 0; n < number; ++n) {
+      atom.type[n] = type ? type[n] : 0;
+      if (atom.type[n] < 0 || atom.type[n] >= std::max(atom.nep.numTypes, 1)) {
+        std::cout << "type " << atom.type[n] << " is not in the potential."
+                  << std::endl;
+        fail();
+      }
+    }
+    std::copy(mass, mass + number, atom.mass.begin());
+    std::copy(x, x + number, atom.x.begin());
+    std::copy(y, y + number, atom.y.begin());
+    std::copy(z, z + number, atom.z.begin());
+    // x0 of the last neighbor list update is far away to force the first one
+    std::fill(atom.x0.begin(), atom.x0.end(), 1.0e10);
+    initializeVelocity(system->temperature, atom);
+    system->isForceValid = false;
+  } catch (const InputError&) {
+    return 1;
+  }
+  return 0;
+}
+
+void md3_set_positions(
+  md3_system* system, const double* x, const double* y, const double* z)
+{
+  Atom& atom = system->atom;
+  std::copy(x, x + atom.number, atom.x.begin());
+  std::copy(y, y + atom.number, atom.y.begin());
+  std::copy(z, z + atom.number, atom.z.begin());
+  system->isForceValid = false;
+}
+
+double md3_compute(md3_system* system)
+{
+  Atom& atom = system->atom;
+  system->isForceValid = false;
+  try {
+    if (atom.neighbor_flag != 0)
+      findNeighbor(atom);
+    findForce(atom);
+  } catch (const InputError&) {
+    return NAN;
+  }
+  system->isForceValid = true;
+  return atom.pe;
+}
+
+double md3_step(md3_system* system, int num_steps)
+{
+  Atom& atom = system->atom;
+  if (atom.nhcLength > 0 && system->temperature <= 0.0) {
+    std::cout << "thermostat needs a temperature > 0." << std::endl;
+    return NAN;
+  }
+  if (!system->isForceValid && std::isnan(md3_compute(system)))
+    return NAN;
+  const double timeStep = system->timeStep / TIME_UNIT_CONVERSION;
+  system->isForceValid = false;
+  try {
+    for (int step = 0; step < num_steps; ++step) {
+      if (atom.neighbor_flag != 0)
+        findNeighbor(atom);
+      if (atom.nhcLength > 0)
+        applyMassiveNhc(atom, system->temperature, timeStep * 0.5);
+      integrate(true, timeStep, atom);
+      findForce(atom);
+      integrate(false, timeStep, atom);
+      if (atom.nhcLength > 0)
+        applyMassiveNhc(atom, system->temperature, timeStep * 0.5);
+    }
+  } catch (const InputError&) {
+    return NAN;
+  }
+  system->isForceValid = true;
+  return atom.pe;
+}
+
+double md3_kinetic_energy(md3_system* system)
+{
+  return findKineticEnergy(system->atom);
+}
+
+int md3_number(const md3_system* system) { return system->atom.number; }
+
+double* md3_array(md3_system* system, int name)
+{
+  Atom& atom = system->atom;
+  std::vector<double>* arrays[] = {
+    &atom.mass, &atom.x,  &atom.y,  &atom.z,  &atom.vx,    &atom.vy,
+    &atom.vz,   &atom.fx, &atom.fy, &atom.fz, &atom.energy};
+  if (name < MD3_MASS || name > MD3_ENERGY) {
+    std::cout << "md3_array has no array " << name << std::endl;
+    return nullptr;
+  }
+  return arrays[name]->data();
+}
+
+#ifndef MD3_LIBRARY
 int main(int argc, char** argv)
 {
   int numSteps;
@@ -824,30 +3060,136 @@ int main(int argc, char** argv)
   Atom atom;
   readRun(numSteps, timeStep, temperature, atom);
   timeStep /= TIME_UNIT_CONVERSION; // from fs to natural unit
-  readXyz(atom);
+  if (atom.lattice.name.empty())
+    readXyz(atom);
+  else
+    buildLattice(atom);
+  if (
+    (atom.neighbor_flag == 3) &&
+    (!atom.pbc[0] || !atom.pbc[1] || !atom.pbc[2])) {
+    std::cout << "neighbor_flag 3 needs a fully periodic box." << std::endl;
+    exit(1);
+  }
+  if (!atom.ipiAddress.empty()) {
+    runIpiClient(atom);
+    return 0;
+  }
   initializeVelocity(temperature, atom);
+  if (atom.nhcLength > 0 && temperature <= 0.0) {
+    std::cout << "thermostat needs a temperature > 0." << std::endl;
+    exit(1);
+  }
+  if (atom.isHnemd && temperature <= 0.0) {
+    std::cout << "hnemd needs a temperature > 0." << std::endl;
+    exit(1);
+  }
+  if (atom.isHnemd && atom.nhcLength > 0) {
+    std::cout << "hnemd has its own thermostat." << std::endl;
+    exit(1);
+  }
 
   const clock_t tStart = clock();
-  std::ofstream ofile("thermo.out");
-  ofile << std::fixed << std::setprecision(16);
-
-  for (int step = 0; step < numSteps; ++step) {
+  AsyncWriter thermo("thermo.out", atom.flushInterval);
+  std::signal(SIGINT, handleSignal); // stop cleanly and keep thermo.out
+  std::signal(SIGTERM, handleSignal);
+
+  // with an adaptive time step, the run covers the time numSteps * timeStep
+  // and thermo.out is resampled on the grid of the fixed-step run
+  const bool isAdaptive = atom.maxDisplacement > 0.0;
+  const double totalTime = numSteps * timeStep;
+  double sampleTime = timeStep;
+  double thermoOld[2] = {0.0, 0.0};
+  // HNEMD: velocity scaling throughout and the driving force after the
+  // equilibration, whose end is also the time origin of kappa.txt
+  const double equilibrationTime = atom.numEquilibrationSteps * timeStep;
+  std::unique_ptr<KappaWriter> kappa;
+  if (atom.isHnemd)
+    kappa.reset(new KappaWriter(atom, temperature, timeStep));
+  std::unique_ptr<Monitor> monitor;
+  if (!atom.monitorName.empty()) {
+    monitor.reset(new Monitor(atom, "md3", numSteps));
+    atom.virial.resize(atom.number * 9);
+  }
+  int step = 0;
+  for (double time = 0.0; time < totalTime - 1.0e-6 * timeStep; ++step) {
+    if (isInterrupted) {
+      std::cout << "Interrupted at step " << step << std::endl;
+      break;
+    }
+    double dt = timeStep;
+    if (isAdaptive)
+      dt = std::min(findTimeStep(atom, timeStep), totalTime - time);
+    const bool isDriven =
+      atom.isHnemd && time > equilibrationTime - 1.0e-6 * timeStep;
+    if (atom.isHnemd && !isDriven)
+      dt = std::min(dt, equilibrationTime - time);
+    if (isDriven)
+      atom.fe[atom.hnemdDirection] = atom.hnemdFe;
+    if (monitor)
+      monitor->lap(3); // output and the time step
     if (atom.neighbor_flag != 0)
       findNeighbor(atom);
-    integrate(true, timeStep, atom);  // step 1 in the book
-    findForce(atom);                  // step 2 in the book
-    integrate(false, timeStep, atom); // step 3 in the book
-    if (step % Ns == 0) {
+    if (monitor)
+      monitor->lap(0);
+    if (atom.nhcLength > 0)
+      applyMassiveNhc(atom, temperature, dt * 0.5);
+    integrate(true, dt, atom); // step 1 in the book
+    if (monitor)
+      monitor->lap(2);
+    atom.isVirial = monitor && step % atom.monitorInterval == 0;
+    findForce(atom); // step 2 in the book
+    if (monitor)
+      monitor->lap(1);
+    integrate(false, dt, atom); // step 3 in the book
+    if (atom.nhcLength > 0)
+      applyMassiveNhc(atom, temperature, dt * 0.5);
+    if (monitor)
+      monitor->lap(2);
+    time += dt;
+    if (atom.isHnemd)
+      scaleVelocity(temperature, atom);
+    if (isDriven) {
+      const double t = time - equilibrationTime;
+      kappa->sample(atom.hc, t - dt, t);
+    }
+    if (isAdaptive) {
+      const double kineticEnergy = findKineticEnergy(atom);
+      while (sampleTime < time + 1.0e-6 * timeStep) {
+        const double w = (sampleTime - time + dt) / dt;
+        const double ek = (1.0 - w) * thermoOld[0] + w * kineticEnergy;
+        const double pe = (1.0 - w) * thermoOld[1] + w * atom.pe;
+        const double T = ek / (1.5 * K_B * atom.number);
+        const double values[3] = {T, ek, pe};
+        thermo.writeLine(values, 3);
+        sampleTime += Ns * timeStep;
+      }
+      thermoOld[0] = kineticEnergy;
+      thermoOld[1] = atom.pe;
+    } else if (step % Ns == 0) {
+      const double kineticEnergy = findKineticEnergy(atom);
+      const double T = kineticEnergy / (1.5 * K_B * atom.number);
+      const double values[3] = {T, kineticEnergy, atom.pe};
+      thermo.writeLine(values, 3);
+    }
+    if (atom.isVirial) {
       const double kineticEnergy = findKineticEnergy(atom);
       const double T = kineticEnergy / (1.5 * K_B * atom.number);
-      ofile << T << " " << kineticEnergy << " " << atom.pe << std::endl;
+      monitor->publish(atom, step, time, T, findPressure(atom, kineticEnergy));
     }
   }
-  ofile.close();
+  monitor.reset();
+  thermo.close();
   const clock_t tStop = clock();
   const float tElapsed = float(tStop - tStart) / CLOCKS_PER_SEC;
   std::cout << atom.numUpdates << " neighbor list updates" << std::endl;
+  if (atom.neighbor_flag == 3)
+    std::cout << atom.numRepairs << " partial neighbor list repairs"
+              << std::endl;
+  if (isAdaptive)
+    std::cout << step << " steps, average time step = "
+              << totalTime / step * TIME_UNIT_CONVERSION << " fs" << std::endl;
   std::cout << "Time used = " << tElapsed << " s" << std::endl;
 
   return 0;
 }
+#endif
@@ -0,0 +1,95 @@
+/*----------------------------------------------------------------------------80
+    Copyright 2022 Zheyong Fan
+C interface of md3.cpp built as a library:
+    g++ md3.cpp -O3 -pthread -shared -fPIC -fvisibility=hidden \
+        -DMD3_LIBRARY -o libmd3.so
+Usage:
+    md3_create, md3_command with run.in lines (not lattice, basis, hnemd or
+    adaptive_time_step; potential before md3_set_atoms), md3_set_atoms and
+    then md3_compute and md3_step in any order. Invalid input prints a
+    message as in the program; md3_command and md3_set_atoms then return 1
+    instead of 0, md3_compute and md3_step NaN and md3_array NULL. After a
+    NaN, call md3_set_atoms before the next md3_compute or md3_step.
+------------------------------------------------------------------------------*/
+
+#ifndef MD3_H
+#define MD3_H
+
+#if defined(_WIN32) && defined(MD3_LIBRARY)
+#define MD3_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define MD3_API __declspec(dllimport)
+#else
+#define MD3_API __attribute__((visibility("default")))
+#endif
+
+#define MD3_ABI_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the per-atom arrays of md3_array
+enum md3_array_name {
+  MD3_MASS,
+  MD3_X,
+  MD3_Y,
+  MD3_Z,
+  MD3_VX,
+  MD3_VY,
+  MD3_VZ,
+  MD3_FX,
+  MD3_FY,
+  MD3_FZ,
+  MD3_ENERGY
+};
+
+typedef struct md3_system md3_system;
+
+MD3_API int md3_abi_version(void);
+
+MD3_API md3_system* md3_create(void);
+
+MD3_API void md3_destroy(md3_system* system);
+
+// one line of run.in, e.g. "time_step 5" or "neighbor_flag 1"
+MD3_API int md3_command(md3_system* system, const char* line);
+
+// box has the 3 cell vectors a, b and c as in xyz.in and pbc can be NULL
+// for a periodic box; type is the index in the elements of the NEP
+// potential and can be NULL for Tersoff; the velocities are drawn for the
+// temperature of the velocity command, or are zero
+MD3_API int md3_set_atoms(
+  md3_system* system,
+  int number,
+  const double* box,
+  const int* pbc,
+  const int* type,
+  const double* mass,
+  const double* x,
+  const double* y,
+  const double* z);
+
+MD3_API void md3_set_positions(
+  md3_system* system, const double* x, const double* y, const double* z);
+
+// forces and per-atom energies at the current positions; returns the
+// potential energy in eV
+MD3_API double md3_compute(md3_system* system);
+
+// num_steps velocity-Verlet steps; returns the potential energy in eV
+MD3_API double md3_step(md3_system* system, int num_steps);
+
+MD3_API double md3_kinetic_energy(md3_system* system);
+
+MD3_API int md3_number(const md3_system* system);
+
+// borrowed pointer to number elements, valid until md3_set_atoms or
+// md3_destroy; call md3_compute after writing positions through it
+MD3_API double* md3_array(md3_system* system, int name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -48,10 +48,13 @@ The units used in this program are as follows:
 #include <stdio.h>
 #include <math.h>
 #include <time.h>
+#include "../../../common/md_common.h" // state cache
 
 
 #define K_B                   8.617343e-5 // Boltzmann's constant in my unit
 #define TIME_UNIT_CONVERSION  1.018051e+1 // fs <-> my unit
+#define LJ_EPSILON            1.032e-2 // eV, LJ argon as in find_force
+#define LJ_SIGMA              3.405    // A
 
 
 // minimum image convention
@@ -82,41 +85,157 @@ void apply_pbc
 }
 
 
-// neighbor list construction (slow for large system, but ok for teaching)
-void find_neighbor
+// build the neighbor list, storing at most MN neighbors per atom, and
+// return the largest number of neighbors, which may exceed MN; a cell list
+// makes this O(N) if the box has at least 3 cells (of size >= cutoff) in
+// each direction, and smaller boxes use the O(N^2) loop over all pairs
+int build_neighbor
 (
-    int N, int *NN, int *NL, double *x, double *y, double *z, 
-    double lx, double ly, double lz, int MN, double cutoff
+    int N, int *NN, int *NL, int MN, double *x, double *y, double *z, 
+    double lx, double ly, double lz, double cutoff
 )              
 {
     double lxh = lx * 0.5;
     double lyh = ly * 0.5;
     double lzh = lz * 0.5; 
     double cutoff_square = cutoff * cutoff;
+    double box[3] = {lx, ly, lz};
+    int nc[3]; // number of cells in each direction
+    for (int d = 0; d < 3; d++) { nc[d] = (int) floor(box[d] / cutoff); }
     for (int n = 0; n < N; n++) {NN[n] = 0;}
-    for (int n1 = 0; n1 < N - 1; n1++)
-    {  
-        for (int n2 = n1 + 1; n2 < N; n2++)
-        {   
-            double x12 = x[n2] - x[n1];
-            double y12 = y[n2] - y[n1];
-            double z12 = z[n2] - z[n1];
-            apply_mic(lx, ly, lz, lxh, lyh, lzh, &x12, &y12, &z12);
-            double  distance_square = x12 * x12 + y12 * y12 + z12 * z12;
-            if (distance_square < cutoff_square)
-            {        
-                NL[n1 * MN + NN[n1]] = n2;
-                NN[n1]++;
-                NL[n2 * MN + NN[n2]] = n1;
-                NN[n2]++;
+
+    if (nc[0] < 3 || nc[1] < 3 || nc[2] < 3)
+    {
+        for (int n1 = 0; n1 < N - 1; n1++)
+        {  
+            for (int n2 = n1 + 1; n2 < N; n2++)
+            {   
+                double x12 = x[n2] - x[n1];
+                double y12 = y[n2] - y[n1];
+                double z12 = z[n2] - z[n1];
+                apply_mic(lx, ly, lz, lxh, lyh, lzh, &x12, &y12, &z12);
+                double  distance_square = x12 * x12 + y12 * y12 + z12 * z12;
+                if (distance_square < cutoff_square)
+                {
+                    if (NN[n1] < MN) { NL[n1 * MN + NN[n1]] = n2; }
+                    if (NN[n2] < MN) { NL[n2 * MN + NN[n2]] = n1; }
+                    NN[n1]++;
+                    NN[n2]++;
+                }
             }
-            if (NN[n1] > MN)
+        }
+    }
+    else
+    {
+        // sort the atoms by cell; cell_start[c] is the first one in cell c
+        int num_cells = nc[0] * nc[1] * nc[2];
+        int *cell_of = (int*) malloc(N * sizeof(int));
+        int *cell_atoms = (int*) malloc(N * sizeof(int));
+        int *cell_start = (int*) calloc(num_cells + 1, sizeof(int));
+        int *cell_count = (int*) calloc(num_cells, sizeof(int));
+        for (int n = 0; n < N; n++)
+        {
+            double r[3] = {x[n], y[n], z[n]};
+            int c[3];
+            for (int d = 0; d < 3; d++)
             {
-                printf("Error: cutoff for neighbor list is too large.\n");
-                exit(1);
+                c[d] = (int) floor(r[d] / box[d] * nc[d]) % nc[d];
+                if (c[d] < 0) { c[d] += nc[d]; } // atoms outside the box
             }
+            cell_of[n] = c[0] + nc[0] * (c[1] + nc[1] * c[2]);
+            cell_start[cell_of[n] + 1]++;
         }
-    } 
+        for (int c = 0; c < num_cells; c++) 
+        { cell_start[c + 1] += cell_start[c]; }
+        for (int n = 0; n < N; n++)
+        {
+            int c = cell_of[n];
+            cell_atoms[cell_start[c] + cell_count[c]++] = n;
+        }
+
+        for (int n1 = 0; n1 < N; n1++)
+        {
+            int c1 = cell_of[n1];
+            int c[3] = {c1 % nc[0], c1 / nc[0] % nc[1], c1 / (nc[0] * nc[1])};
+            for (int k = 0; k < 27; k++) // the cell itself and its neighbors
+            {
+                int c2[3] =
+                {c[0] + k % 3 - 1, c[1] + k / 3 % 3 - 1, c[2] + k / 9 - 1};
+                for (int d = 0; d < 3; d++)
+                {
+                    if (c2[d] < 0) { c2[d] += nc[d]; }
+                    else if (c2[d] >= nc[d]) { c2[d] -= nc[d]; }
+                }
+                int cell = c2[0] + nc[0] * (c2[1] + nc[1] * c2[2]);
+                for (int i = cell_start[cell]; i < cell_start[cell + 1]; i++)
+                {
+                    int n2 = cell_atoms[i];
+                    if (n2 == n1) { continue; }
+                    double x12 = x[n2] - x[n1];
+                    double y12 = y[n2] - y[n1];
+                    double z12 = z[n2] - z[n1];
+                    apply_mic(lx, ly, lz, lxh, lyh, lzh, &x12, &y12, &z12);
+                    double d12_square = x12 * x12 + y12 * y12 + z12 * z12;
+                    if (d12_square < cutoff_square)
+                    {
+                        if (NN[n1] < MN) { NL[n1 * MN + NN[n1]] = n2; }
+                        NN[n1]++;
+                    }
+                }
+            }
+        }
+        free(cell_of); free(cell_atoms); free(cell_start); free(cell_count);
+    }
+
+    int max_nn = 0;
+    for (int n = 0; n < N; n++) { if (NN[n] > max_nn) { max_nn = NN[n]; } }
+    return max_nn;
+}
+
+
+// build the neighbor list, with more room (*MN) per atom if needed, and
+// keep the positions in x0, y0 and z0 for need_neighbor_update
+void find_neighbor
+(
+    int N, int *NN, int **NL, int *MN, double *x, double *y, double *z, 
+    double *x0, double *y0, double *z0, double lx, double ly, double lz, 
+    double cutoff
+)
+{
+    int max_nn = build_neighbor(N, NN, *NL, *MN, x, y, z, lx, ly, lz, cutoff);
+    if (max_nn > *MN)
+    {
+        *MN = max_nn + max_nn / 4 + 1;
+        free(*NL);
+        *NL = (int*) malloc(N * *MN * sizeof(int));
+        fprintf(stderr, "MN is increased to %d\n", *MN);
+        build_neighbor(N, NN, *NL, *MN, x, y, z, lx, ly, lz, cutoff);
+    }
+    for (int n = 0; n < N; n++) { x0[n] = x[n]; y0[n] = y[n]; z0[n] = z[n]; }
+}
+
+
+// the neighbor list of cutoff rc can be used with a force cutoff rc - skin
+// until an atom has moved by more than skin / 2 since the list was built
+int need_neighbor_update
+(
+    int N, double *x, double *y, double *z, double *x0, double *y0, 
+    double *z0, double lx, double ly, double lz, double skin
+)
+{
+    double lxh = lx * 0.5;
+    double lyh = ly * 0.5;
+    double lzh = lz * 0.5;
+    double limit_square = skin * skin * 0.25;
+    for (int n = 0; n < N; n++)
+    {
+        double dx = x[n] - x0[n];
+        double dy = y[n] - y0[n];
+        double dz = z[n] - z0[n];
+        apply_mic(lx, ly, lz, lxh, lyh, lzh, &dx, &dy, &dz);
+        if (dx * dx + dy * dy + dz * dz > limit_square) { return 1; }
+    }
+    return 0;
 }
 
 
@@ -205,8 +324,8 @@ void find_force
 )
 {
     // precompute something (a trick to make the code faster)
-    const double epsilon = 1.032e-2;
-    const double sigma = 3.405;
+    const double epsilon = LJ_EPSILON;
+    const double sigma = LJ_SIGMA;
     const double sigma_3 = sigma * sigma * sigma;
     const double sigma_6 = sigma_3 * sigma_3;
     const double sigma_12 = sigma_6 * sigma_6;
@@ -303,12 +422,15 @@ int main(int argc, char *argv[])
 
     double rcn = 12.0;     // cutoff distance for neighbor list
     double rcf = 10.0;     // cutoff distance for force
-    int neighbor_update_interval = 5; // interval of neighbor list update
-    int MN = 256;                     // amximal number of neighbors 
+    int MN = 256;          // initial room for neighbors
     
     // memory for neighbor list
     int *NN = (int*) malloc(N * sizeof(int));
     int *NL = (int*) malloc(N * MN * sizeof(int));
+    double *x0 = (double*) malloc(N * sizeof(double)); // at the last update
+    double *y0 = (double*) malloc(N * sizeof(double));
+    double *z0 = (double*) malloc(N * sizeof(double));
+    int num_updates = 0;
 
     // major data for the particles
     double *m  = (double*) malloc(N * sizeof(double)); // mass
@@ -327,20 +449,39 @@ int main(int argc, char *argv[])
     initialize_position(n0, nx, ny, nz, ax, ay, az, x, y, z);
     initialize_velocity(N, T_0, m, vx, vy, vz);
 
+
+    // start from a cached equilibrated state of the same system if there is
+    // one at a close temperature; then a short re-equilibration is enough
+    int use_cache = 1;
+    // N, box, mass, and the LJ parameters as in find_force
+    double params[] = {(double) N, lx, ly, lz, 40.0, LJ_EPSILON, LJ_SIGMA, rcf};
+    int num_params = sizeof(params) / sizeof(double);
+    unsigned long long key = find_state_key(num_params, params);
+    double T_cached = -1.0;
+    if (use_cache) 
+    { T_cached = load_state(key, N, T_0, x, y, z, vx, vy, vz); }
+    if (T_cached > 0.0)
+    {
+        scale_velocity(N, T_0, m, vx, vy, vz);
+        Ne /= 10;
+        fprintf(stderr, "start from the cached state at T = %g K\n", T_cached);
+    }
+
     // initialize neighbor list and force
-    find_neighbor(N, NN, NL, x, y, z, lx, ly, lz, MN, rcn);
+    find_neighbor(N, NN, &NL, &MN, x, y, z, x0, y0, z0, lx, ly, lz, rcn);
     find_force(N, NN, NL, MN, lx, ly, lz, x, y, z, fx, fy, fz, rcf);
  
     // equilibration
     clock_t time_begin = clock();
     for (int step = 0; step < Ne; ++step)
     { 
-        if (0 == step % neighbor_update_interval)
+        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (need_neighbor_update(N, x, y, z, x0, y0, z0, lx, ly, lz, rcn - rcf))
         {
-            find_neighbor(N, NN, NL, x, y, z, lx, ly, lz, MN, rcn);
+            find_neighbor
+            (N, NN, &NL, &MN, x, y, z, x0, y0, z0, lx, ly, lz, rcn);
+            num_updates++;
         }
-
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
         find_force(N, NN, NL, MN, lx, ly, lz, x, y, z, fx, fy, fz, rcf);
         integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
 
@@ -352,6 +493,9 @@ int main(int argc, char *argv[])
     double time_used = (time_finish - time_begin) / (double) CLOCKS_PER_SEC;
     fprintf(stderr, "time use for equilibration = %f s\n", time_used); 
 
+    if (use_cache && T_cached != T_0) 
+    { save_state(key, N, T_0, x, y, z, vx, vy, vz); }
+
     // open file
     FILE *fid = fopen("r.txt", "w");
 
@@ -359,12 +503,13 @@ int main(int argc, char *argv[])
     time_begin = clock();
     for (int step = 0; step < Np; ++step)
     {  
-        if (0 == step % neighbor_update_interval)
+        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (need_neighbor_update(N, x, y, z, x0, y0, z0, lx, ly, lz, rcn - rcf))
         {
-            find_neighbor(N, NN, NL, x, y, z, lx, ly, lz, MN, rcn);
+            find_neighbor
+            (N, NN, &NL, &MN, x, y, z, x0, y0, z0, lx, ly, lz, rcn);
+            num_updates++;
         }
-
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
         find_force(N, NN, NL, MN, lx, ly, lz, x, y, z, fx, fy, fz, rcf);
         integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
 
@@ -387,6 +532,8 @@ int main(int argc, char *argv[])
     fclose(fid);
 
     // free memory
+    fprintf(stderr, "number of neighbor list updates = %d\n", num_updates);
+    free(x0); free(y0); free(z0);
     free(NN); free(NL); free(m);  free(x);  free(y);  free(z);
     free(vx); free(vy); free(vz); free(fx); free(fy); free(fz);
 
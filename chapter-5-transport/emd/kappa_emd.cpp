@@ -2,10 +2,18 @@
 #include <stdio.h>
 #include <math.h>
 #include <time.h>
+#include "../../common/md_common.h" // add_to_sum, push_block, state cache
 
 #define K_B                   8.617343e-5 // Boltzmann's constant  
 #define TIME_UNIT_CONVERSION  1.018051e+1 // fs     <-> my natural unit
 #define KAPPA_UNIT_CONVERSION 1.573769e+5 // W/(mK) <-> my natural unit
+#define LJ_EPSILON            1.032e-2 // eV, LJ argon as in find_force
+#define LJ_SIGMA              3.405    // A
+#define LJ_CUTOFF             (3.0 * LJ_SIGMA) // A
+
+
+// atoms per block in the heat current sum of find_force
+#define REDUCTION_BLOCK 64
 
 
 void apply_mic
@@ -20,40 +28,157 @@ void apply_mic
 }
 
 
-void find_neighbor
+// build the neighbor list, storing at most MN neighbors per atom, and
+// return the largest number of neighbors, which may exceed MN; a cell list
+// makes this O(N) if the box has at least 3 cells (of size >= cutoff) in
+// each direction, and smaller boxes use the O(N^2) loop over all pairs
+int build_neighbor
 (
-    int N, int *NN, int *NL, double *x, double *y, double *z, 
-    double lx, double ly, double lz, int MN, double cutoff
+    int N, int *NN, int *NL, int MN, double *x, double *y, double *z, 
+    double lx, double ly, double lz, double cutoff
 )              
 {
     double lxh = lx * 0.5;
     double lyh = ly * 0.5;
     double lzh = lz * 0.5; 
     double cutoff_square = cutoff * cutoff;
+    double box[3] = {lx, ly, lz};
+    int nc[3]; // number of cells in each direction
+    for (int d = 0; d < 3; d++) { nc[d] = (int) floor(box[d] / cutoff); }
     for (int n = 0; n < N; n++) {NN[n] = 0;}
-    for (int n1 = 0; n1 < N - 1; n1++)
-    {  
-        for (int n2 = n1 + 1; n2 < N; n2++)
-        {   
-            double x12 = x[n2] - x[n1];
-            double y12 = y[n2] - y[n1];
-            double z12 = z[n2] - z[n1];
-            apply_mic(lx, ly, lz, lxh, lyh, lzh, &x12, &y12, &z12);
-            double  distance_square = x12 * x12 + y12 * y12 + z12 * z12;
-            if (distance_square < cutoff_square)
-            {        
-                NL[n1 * MN + NN[n1]] = n2;
-                NN[n1]++;
-                NL[n2 * MN + NN[n2]] = n1;
-                NN[n2]++;
+
+    if (nc[0] < 3 || nc[1] < 3 || nc[2] < 3)
+    {
+        for (int n1 = 0; n1 < N - 1; n1++)
+        {  
+            for (int n2 = n1 + 1; n2 < N; n2++)
+            {   
+                double x12 = x[n2] - x[n1];
+                double y12 = y[n2] - y[n1];
+                double z12 = z[n2] - z[n1];
+                apply_mic(lx, ly, lz, lxh, lyh, lzh, &x12, &y12, &z12);
+                double  distance_square = x12 * x12 + y12 * y12 + z12 * z12;
+                if (distance_square < cutoff_square)
+                {
+                    if (NN[n1] < MN) { NL[n1 * MN + NN[n1]] = n2; }
+                    if (NN[n2] < MN) { NL[n2 * MN + NN[n2]] = n1; }
+                    NN[n1]++;
+                    NN[n2]++;
+                }
             }
-            if (NN[n1] > MN)
+        }
+    }
+    else
+    {
+        // sort the atoms by cell; cell_start[c] is the first one in cell c
+        int num_cells = nc[0] * nc[1] * nc[2];
+        int *cell_of = (int*) malloc(N * sizeof(int));
+        int *cell_atoms = (int*) malloc(N * sizeof(int));
+        int *cell_start = (int*) calloc(num_cells + 1, sizeof(int));
+        int *cell_count = (int*) calloc(num_cells, sizeof(int));
+        for (int n = 0; n < N; n++)
+        {
+            double r[3] = {x[n], y[n], z[n]};
+            int c[3];
+            for (int d = 0; d < 3; d++)
             {
-                printf("Error: cutoff for neighbor list is too large.\n");
-                exit(1);
+                c[d] = (int) floor(r[d] / box[d] * nc[d]) % nc[d];
+                if (c[d] < 0) { c[d] += nc[d]; } // atoms outside the box
             }
+            cell_of[n] = c[0] + nc[0] * (c[1] + nc[1] * c[2]);
+            cell_start[cell_of[n] + 1]++;
         }
-    } 
+        for (int c = 0; c < num_cells; c++) 
+        { cell_start[c + 1] += cell_start[c]; }
+        for (int n = 0; n < N; n++)
+        {
+            int c = cell_of[n];
+            cell_atoms[cell_start[c] + cell_count[c]++] = n;
+        }
+
+        for (int n1 = 0; n1 < N; n1++)
+        {
+            int c1 = cell_of[n1];
+            int c[3] = {c1 % nc[0], c1 / nc[0] % nc[1], c1 / (nc[0] * nc[1])};
+            for (int k = 0; k < 27; k++) // the cell itself and its neighbors
+            {
+                int c2[3] =
+                {c[0] + k % 3 - 1, c[1] + k / 3 % 3 - 1, c[2] + k / 9 - 1};
+                for (int d = 0; d < 3; d++)
+                {
+                    if (c2[d] < 0) { c2[d] += nc[d]; }
+                    else if (c2[d] >= nc[d]) { c2[d] -= nc[d]; }
+                }
+                int cell = c2[0] + nc[0] * (c2[1] + nc[1] * c2[2]);
+                for (int i = cell_start[cell]; i < cell_start[cell + 1]; i++)
+                {
+                    int n2 = cell_atoms[i];
+                    if (n2 == n1) { continue; }
+                    double x12 = x[n2] - x[n1];
+                    double y12 = y[n2] - y[n1];
+                    double z12 = z[n2] - z[n1];
+                    apply_mic(lx, ly, lz, lxh, lyh, lzh, &x12, &y12, &z12);
+                    double d12_square = x12 * x12 + y12 * y12 + z12 * z12;
+                    if (d12_square < cutoff_square)
+                    {
+                        if (NN[n1] < MN) { NL[n1 * MN + NN[n1]] = n2; }
+                        NN[n1]++;
+                    }
+                }
+            }
+        }
+        free(cell_of); free(cell_atoms); free(cell_start); free(cell_count);
+    }
+
+    int max_nn = 0;
+    for (int n = 0; n < N; n++) { if (NN[n] > max_nn) { max_nn = NN[n]; } }
+    return max_nn;
+}
+
+
+// build the neighbor list, with more room (*MN) per atom if needed, and
+// keep the positions in x0, y0 and z0 for need_neighbor_update
+void find_neighbor
+(
+    int N, int *NN, int **NL, int *MN, double *x, double *y, double *z, 
+    double *x0, double *y0, double *z0, double lx, double ly, double lz, 
+    double cutoff
+)
+{
+    int max_nn = build_neighbor(N, NN, *NL, *MN, x, y, z, lx, ly, lz, cutoff);
+    if (max_nn > *MN)
+    {
+        *MN = max_nn + max_nn / 4 + 1;
+        free(*NL);
+        *NL = (int*) malloc(N * *MN * sizeof(int));
+        fprintf(stderr, "MN is increased to %d\n", *MN);
+        build_neighbor(N, NN, *NL, *MN, x, y, z, lx, ly, lz, cutoff);
+    }
+    for (int n = 0; n < N; n++) { x0[n] = x[n]; y0[n] = y[n]; z0[n] = z[n]; }
+}
+
+
+// the neighbor list of cutoff rc can be used with a force cutoff rc - skin
+// until an atom has moved by more than skin / 2 since the list was built
+int need_neighbor_update
+(
+    int N, double *x, double *y, double *z, double *x0, double *y0, 
+    double *z0, double lx, double ly, double lz, double skin
+)
+{
+    double lxh = lx * 0.5;
+    double lyh = ly * 0.5;
+    double lzh = lz * 0.5;
+    double limit_square = skin * skin * 0.25;
+    for (int n = 0; n < N; n++)
+    {
+        double dx = x[n] - x0[n];
+        double dy = y[n] - y0[n];
+        double dz = z[n] - z0[n];
+        apply_mic(lx, ly, lz, lxh, lyh, lzh, &dx, &dy, &dz);
+        if (dx * dx + dy * dy + dz * dz > limit_square) { return 1; }
+    }
+    return 0;
 }
 
 
@@ -137,9 +262,9 @@ void find_force
     double *vx, double *vy, double *vz, double *hc
 )
 {
-    const double epsilon = 1.032e-2;
-    const double sigma = 3.405;
-    const double cutoff = sigma * 3.0;
+    const double epsilon = LJ_EPSILON;
+    const double sigma = LJ_SIGMA;
+    const double cutoff = LJ_CUTOFF;
     const double cutoff_square = cutoff * cutoff;
     const double sigma_3 = sigma * sigma * sigma;
     const double sigma_6 = sigma_3 * sigma_3;
@@ -147,15 +272,19 @@ void find_force
     const double factor_1 = 24.0 * epsilon * sigma_6; 
     const double factor_2 = 48.0 * epsilon * sigma_12;
 
-    // initialize heat current and force
-    hc[0] = hc[1] = hc[2] = 0.0; 
+    // initialize force; the heat current is summed per atom, per block of
+    // atoms and then over the blocks, in an order that only depends on N
     for (int n = 0; n < N; ++n) { fx[n]=fy[n]=fz[n]=0.0; }
+    double stack[32][3]; int size[32]; int top = 0;
+    double block[3] = {0.0, 0.0, 0.0};
+    double error[3] = {0.0, 0.0, 0.0};
 
     double lxh = lx * 0.5;
     double lyh = ly * 0.5;
     double lzh = lz * 0.5;
     for (int i = 0; i < N; ++i)
     {
+        double hc_i[3] = {0.0, 0.0, 0.0};
         for (int k = 0; k < NN[i]; k++)
         {
             int j = NL[i * MN + k];
@@ -179,11 +308,23 @@ void find_force
             double f_dot_v
                 = x_ij*(vx[i]+vx[j])+y_ij*(vy[i]+vy[j])+z_ij*(vz[i]+vz[j]);
             f_dot_v *= f_ij * 0.5;
-            hc[0] -= x_ij * f_dot_v; // calculate heat current
-            hc[1] -= y_ij * f_dot_v;
-            hc[2] -= z_ij * f_dot_v;
+            hc_i[0] -= x_ij * f_dot_v; // calculate heat current
+            hc_i[1] -= y_ij * f_dot_v;
+            hc_i[2] -= z_ij * f_dot_v;
         }
+        for (int d = 0; d < 3; ++d)
+        { add_to_sum(&block[d], &error[d], hc_i[d]); }
+        if ((i + 1) % REDUCTION_BLOCK == 0 || i == N - 1)
+        {
+            push_block(stack, size, &top, block);
+            for (int d = 0; d < 3; ++d) { block[d] = error[d] = 0.0; }
+        }
+    }
+    for (; top > 1; --top)
+    {
+        for (int d = 0; d < 3; ++d) { stack[top - 2][d] += stack[top - 1][d]; }
     }
+    for (int d = 0; d < 3; ++d) { hc[d] = top > 0 ? stack[0][d] : 0.0; }
 }
 
 
@@ -214,6 +355,39 @@ void integrate
 }
 
 
+// largest time step (not above time_step_max) for which no atom moves more 
+// than max_displacement and no atom changes its kinetic energy by more than 
+// max_energy_change (if > 0), estimated from the current velocities and forces
+double find_time_step
+(
+    int N, double time_step_max, double max_displacement, 
+    double max_energy_change, double *m, double *vx, double *vy, double *vz,
+    double *fx, double *fy, double *fz
+)
+{
+    double v2_max = 0.0; double a2_max = 0.0; double power_max = 0.0;
+    for (int n = 0; n < N; ++n)
+    {
+        double v2 = vx[n] * vx[n] + vy[n] * vy[n] + vz[n] * vz[n];
+        double a2 = (fx[n] * fx[n] + fy[n] * fy[n] + fz[n] * fz[n]) 
+                  / (m[n] * m[n]);
+        double power = fabs(fx[n] * vx[n] + fy[n] * vy[n] + fz[n] * vz[n]);
+        if (v2 > v2_max) { v2_max = v2; }
+        if (a2 > a2_max) { a2_max = a2; }
+        if (power > power_max) { power_max = power; }
+    }
+    double time_step = time_step_max;
+    if (v2_max > 0.0 && max_displacement / sqrt(v2_max) < time_step)
+    { time_step = max_displacement / sqrt(v2_max); }
+    if (a2_max > 0.0 && sqrt(2.0 * max_displacement / sqrt(a2_max)) < time_step)
+    { time_step = sqrt(2.0 * max_displacement / sqrt(a2_max)); }
+    if (max_energy_change > 0.0 && power_max > 0.0 
+        && max_energy_change / power_max < time_step)
+    { time_step = max_energy_change / power_max; }
+    return time_step;
+}
+
+
 void find_hac
 (
     int Nc, int M, double *hx, double *hy, double *hz, double *hac_x, 
@@ -271,6 +445,7 @@ void find_hac_kappa
     find_rtc(Nc, factor, hac_x, hac_y, hac_z, rtc_x, rtc_y, rtc_z);
 
     FILE *fid = fopen("kappa.txt", "a");
+    setvbuf(fid, NULL, _IOFBF, 1 << 20); // write in large blocks
     for (int nc = 0; nc < Nc; nc++) 
     {
         fprintf
@@ -301,7 +476,7 @@ int main(int argc, char *argv[])
     int Ns = 10;      // sampling interval
     int Nd = Np / Ns; // number of heat current data
     int Nc = Nd / 10;   // number of correlation data
-    int MN = 200;     // maximum number of neighbors for one particle
+    int MN = 200;     // initial room for the neighbors of a particle
 
     // For LJ argon
     // Temperature (K)      20       30       40       50       60    
@@ -314,12 +489,22 @@ int main(int argc, char *argv[])
     double ly = ay * ny;  // box length in the y direction
     double lz = az * nz;  // box length in the z direction
     double cutoff = 12.0; // cutoff distance for neighbor list
+    double skin = cutoff - LJ_CUTOFF;
     
     double time_step = 10.0 / TIME_UNIT_CONVERSION; // time step
     
-    // fixed neighbor list
+    // adaptive time step (not above time_step) if max_displacement > 0; 
+    // the heat current is then interpolated to the fixed sampling grid
+    double max_displacement = 0.0;  // A
+    double max_energy_change = 0.0; // eV, not used if 0
+    
+    // neighbor list, updated when an atom has moved by more than skin / 2
     int *NN = (int*) malloc(N * sizeof(int));
     int *NL = (int*) malloc(N * MN * sizeof(int));
+    double *x0 = (double*) malloc(N * sizeof(double)); // at the last update
+    double *y0 = (double*) malloc(N * sizeof(double));
+    double *z0 = (double*) malloc(N * sizeof(double));
+    int num_updates = 0;
 
     // major data for the particles
     double *m  = (double*) malloc(N * sizeof(double)); // mass
@@ -341,36 +526,100 @@ int main(int argc, char *argv[])
     initialize_position(n0, nx, ny, nz, ax, ay, az, x, y, z);
     initialize_velocity(N, T_0, m, vx, vy, vz);
 
+
+    // start from a cached equilibrated state of the same system if there is
+    // one at a close temperature; then a short re-equilibration is enough
+    int use_cache = 1;
+    // N, box, mass, and the LJ parameters as in find_force
+    double params[] = {(double) N, lx, ly, lz, 40.0, LJ_EPSILON, LJ_SIGMA, LJ_CUTOFF};
+    int num_params = sizeof(params) / sizeof(double);
+    unsigned long long key = find_state_key(num_params, params);
+    double T_cached = -1.0;
+    if (use_cache) 
+    { T_cached = load_state(key, N, T_0, x, y, z, vx, vy, vz); }
+    if (T_cached > 0.0)
+    {
+        // fresh velocities keep runs with different seeds independent
+        initialize_velocity(N, T_0, m, vx, vy, vz);
+        Ne /= 10;
+        fprintf(stderr, "start from the cached state at T = %g K\n", T_cached);
+    }
+
     // initialize neighbor list and force
-    find_neighbor(N, NN, NL, x, y, z, lx, ly, lz, MN, cutoff);
+    find_neighbor(N, NN, &NL, &MN, x, y, z, x0, y0, z0, lx, ly, lz, cutoff);
     double hc[3]; // heat current at a specific time point
     find_force(N, NN, NL, MN, lx, ly, lz, x, y, z, fx, fy, fz, vx, vy, vz, hc);
  
     // equilibration
     clock_t time_begin = clock();
-    for (int step = 0; step < Ne; ++step)
+    double dt = time_step;
+    for (double t = 0.0; t < (Ne - 1.0e-6) * time_step; t += dt)
     { 
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (max_displacement > 0.0)
+        {
+            dt = find_time_step
+            (
+                N, time_step, max_displacement, max_energy_change, 
+                m, vx, vy, vz, fx, fy, fz
+            );
+        }
+        integrate(N, dt, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (need_neighbor_update(N, x, y, z, x0, y0, z0, lx, ly, lz, skin))
+        {
+            find_neighbor
+            (N, NN, &NL, &MN, x, y, z, x0, y0, z0, lx, ly, lz, cutoff);
+            num_updates++;
+        }
         find_force
         (N, NN, NL, MN, lx, ly, lz, x, y, z, fx, fy, fz, vx, vy, vz, hc);
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
+        integrate(N, dt, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
         scale_velocity(N, T_0, m, vx, vy, vz); // control temperature
     } 
     clock_t time_finish = clock();
     double time_used = (time_finish - time_begin) / (double) CLOCKS_PER_SEC;
     fprintf(stderr, "time use for equilibration = %f s\n", time_used); 
 
+    if (use_cache && T_cached != T_0) 
+    { save_state(key, N, T_0, x, y, z, vx, vy, vz); }
+
     // production
     time_begin = clock();
     int count = 0;
-    for (int step = 0; step < Np; ++step)
+    double t = 0.0; // elapsed time in the production stage
+    dt = time_step;
+    while (count < Nd)
     {  
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (max_displacement > 0.0)
+        {
+            dt = find_time_step
+            (
+                N, time_step, max_displacement, max_energy_change, 
+                m, vx, vy, vz, fx, fy, fz
+            );
+        }
+        double hc_old[3] = {hc[0], hc[1], hc[2]};
+        integrate(N, dt, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (need_neighbor_update(N, x, y, z, x0, y0, z0, lx, ly, lz, skin))
+        {
+            find_neighbor
+            (N, NN, &NL, &MN, x, y, z, x0, y0, z0, lx, ly, lz, cutoff);
+            num_updates++;
+        }
         find_force
         (N, NN, NL, MN, lx, ly, lz, x, y, z, fx, fy, fz, vx, vy, vz, hc);
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
-        if (0 == step % Ns) 
-        { hx[count] = hc[0]; hy[count] = hc[1]; hz[count] = hc[2]; count++; }
+        integrate(N, dt, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
+        t += dt;
+        // sample at t = (count * Ns + 1) * time_step, as with a fixed step
+        double t_sample = (count * Ns + 1) * time_step;
+        while (count < Nd && t_sample < t + 1.0e-6 * time_step)
+        { 
+            double w = (t_sample - t + dt) / dt; // linear interpolation
+            hx[count] = (1.0 - w) * hc_old[0] + w * hc[0]; 
+            hy[count] = (1.0 - w) * hc_old[1] + w * hc[1]; 
+            hz[count] = (1.0 - w) * hc_old[2] + w * hc[2]; 
+            count++;
+            t_sample = (count * Ns + 1) * time_step;
+        }
     } 
     time_finish = clock();
     time_used = (time_finish - time_begin) / (double) CLOCKS_PER_SEC;
@@ -379,6 +628,8 @@ int main(int argc, char *argv[])
     // calculate heat current autocorrelation function and thermal conductivity
     find_hac_kappa(Nd, Nc, time_step * Ns, T_0, lx * ly * lz, hx, hy, hz);
 
+    fprintf(stderr, "number of neighbor list updates = %d\n", num_updates);
+    free(x0); free(y0); free(z0);
     free(NN); free(NL); free(m);  free(x);  free(y);  free(z);
     free(vx); free(vy); free(vz); free(fx); free(fy); free(fz);
     free(hx); free(hy); free(hz);
@@ -2,16 +2,24 @@
 #include <stdio.h>
 #include <math.h>
 #include <time.h>
+#include "../../common/md_common.h" // add_to_sum, push_block, state cache
 
 #define K_B                   8.617343e-5 // Boltzmann's constant  
 #define TIME_UNIT_CONVERSION  1.018051e+1 // fs     <-> my natural unit
 #define KAPPA_UNIT_CONVERSION 1.573769e+5 // W/(mK) <-> my natural unit
+#define LJ_EPSILON            1.032e-2 // eV, LJ argon as in find_force
+#define LJ_SIGMA              3.405    // A
+#define LJ_CUTOFF             (3.0 * LJ_SIGMA) // A
 
 // For LJ argon
 // Temperature (K)      20       30       40       50       60    
 // lattice constant (A) 5.284    5.305    5.329    5.356    5.385
 
 
+// atoms per block in the heat current sum of find_force
+#define REDUCTION_BLOCK 64
+
+
 void apply_mic
 (
     double lx, double ly, double lz, double lxh, double lyh, 
@@ -24,30 +32,155 @@ void apply_mic
 }
 
 
-void find_neighbor
+// build the neighbor list, storing at most MN neighbors per atom, and
+// return the largest number of neighbors, which may exceed MN; a cell list
+// makes this O(N) if the box has at least 3 cells (of size >= cutoff) in
+// each direction, and smaller boxes use the O(N^2) loop over all pairs
+int build_neighbor
 (
-    int N, int *NN, int *NL, double *x, double *y, double *z, 
-    double lx, double ly, double lz, int MN, double cutoff
+    int N, int *NN, int *NL, int MN, double *x, double *y, double *z, 
+    double lx, double ly, double lz, double cutoff
 )              
 {
     double lxh = lx * 0.5;
     double lyh = ly * 0.5;
     double lzh = lz * 0.5; 
     double cutoff_square = cutoff * cutoff;
+    double box[3] = {lx, ly, lz};
+    int nc[3]; // number of cells in each direction
+    for (int d = 0; d < 3; d++) { nc[d] = (int) floor(box[d] / cutoff); }
     for (int n = 0; n < N; n++) {NN[n] = 0;}
-    for (int n1 = 0; n1 < N - 1; n1++)
-    {  
-        for (int n2 = n1 + 1; n2 < N; n2++)
-        {   
-            double x12 = x[n2] - x[n1];
-            double y12 = y[n2] - y[n1];
-            double z12 = z[n2] - z[n1];
-            apply_mic(lx, ly, lz, lxh, lyh, lzh, &x12, &y12, &z12);
-            double  distance_square = x12 * x12 + y12 * y12 + z12 * z12;
-            if (distance_square < cutoff_square) NL[n1 * MN + NN[n1]++] = n2;
+
+    if (nc[0] < 3 || nc[1] < 3 || nc[2] < 3)
+    {
+        for (int n1 = 0; n1 < N - 1; n1++)
+        {  
+            for (int n2 = n1 + 1; n2 < N; n2++)
+            {   
+                double x12 = x[n2] - x[n1];
+                double y12 = y[n2] - y[n1];
+                double z12 = z[n2] - z[n1];
+                apply_mic(lx, ly, lz, lxh, lyh, lzh, &x12, &y12, &z12);
+                double  distance_square = x12 * x12 + y12 * y12 + z12 * z12;
+                if (distance_square < cutoff_square)
+                {
+                    if (NN[n1] < MN) { NL[n1 * MN + NN[n1]] = n2; }
+                    NN[n1]++;
+                }
+            }
         }
-        if (NN[n1] > MN) {printf("Error: MN is too small.\n"); exit(1);}
-    } 
+    }
+    else
+    {
+        // sort the atoms by cell; cell_start[c] is the first one in cell c
+        int num_cells = nc[0] * nc[1] * nc[2];
+        int *cell_of = (int*) malloc(N * sizeof(int));
+        int *cell_atoms = (int*) malloc(N * sizeof(int));
+        int *cell_start = (int*) calloc(num_cells + 1, sizeof(int));
+        int *cell_count = (int*) calloc(num_cells, sizeof(int));
+        for (int n = 0; n < N; n++)
+        {
+            double r[3] = {x[n], y[n], z[n]};
+            int c[3];
+            for (int d = 0; d < 3; d++)
+            {
+                c[d] = (int) floor(r[d] / box[d] * nc[d]) % nc[d];
+                if (c[d] < 0) { c[d] += nc[d]; } // atoms outside the box
+            }
+            cell_of[n] = c[0] + nc[0] * (c[1] + nc[1] * c[2]);
+            cell_start[cell_of[n] + 1]++;
+        }
+        for (int c = 0; c < num_cells; c++) 
+        { cell_start[c + 1] += cell_start[c]; }
+        for (int n = 0; n < N; n++)
+        {
+            int c = cell_of[n];
+            cell_atoms[cell_start[c] + cell_count[c]++] = n;
+        }
+
+        for (int n1 = 0; n1 < N; n1++)
+        {
+            int c1 = cell_of[n1];
+            int c[3] = {c1 % nc[0], c1 / nc[0] % nc[1], c1 / (nc[0] * nc[1])};
+            for (int k = 0; k < 27; k++) // the cell itself and its neighbors
+            {
+                int c2[3] =
+                {c[0] + k % 3 - 1, c[1] + k / 3 % 3 - 1, c[2] + k / 9 - 1};
+                for (int d = 0; d < 3; d++)
+                {
+                    if (c2[d] < 0) { c2[d] += nc[d]; }
+                    else if (c2[d] >= nc[d]) { c2[d] -= nc[d]; }
+                }
+                int cell = c2[0] + nc[0] * (c2[1] + nc[1] * c2[2]);
+                for (int i = cell_start[cell]; i < cell_start[cell + 1]; i++)
+                {
+                    int n2 = cell_atoms[i];
+                if (n2 <= n1) { continue; } // half list
+                    double x12 = x[n2] - x[n1];
+                    double y12 = y[n2] - y[n1];
+                    double z12 = z[n2] - z[n1];
+                    apply_mic(lx, ly, lz, lxh, lyh, lzh, &x12, &y12, &z12);
+                    double d12_square = x12 * x12 + y12 * y12 + z12 * z12;
+                    if (d12_square < cutoff_square)
+                    {
+                        if (NN[n1] < MN) { NL[n1 * MN + NN[n1]] = n2; }
+                        NN[n1]++;
+                    }
+                }
+            }
+        }
+        free(cell_of); free(cell_atoms); free(cell_start); free(cell_count);
+    }
+
+    int max_nn = 0;
+    for (int n = 0; n < N; n++) { if (NN[n] > max_nn) { max_nn = NN[n]; } }
+    return max_nn;
+}
+
+
+// build the neighbor list, with more room (*MN) per atom if needed, and
+// keep the positions in x0, y0 and z0 for need_neighbor_update
+void find_neighbor
+(
+    int N, int *NN, int **NL, int *MN, double *x, double *y, double *z, 
+    double *x0, double *y0, double *z0, double lx, double ly, double lz, 
+    double cutoff
+)
+{
+    int max_nn = build_neighbor(N, NN, *NL, *MN, x, y, z, lx, ly, lz, cutoff);
+    if (max_nn > *MN)
+    {
+        *MN = max_nn + max_nn / 4 + 1;
+        free(*NL);
+        *NL = (int*) malloc(N * *MN * sizeof(int));
+        fprintf(stderr, "MN is increased to %d\n", *MN);
+        build_neighbor(N, NN, *NL, *MN, x, y, z, lx, ly, lz, cutoff);
+    }
+    for (int n = 0; n < N; n++) { x0[n] = x[n]; y0[n] = y[n]; z0[n] = z[n]; }
+}
+
+
+// the neighbor list of cutoff rc can be used with a force cutoff rc - skin
+// until an atom has moved by more than skin / 2 since the list was built
+int need_neighbor_update
+(
+    int N, double *x, double *y, double *z, double *x0, double *y0, 
+    double *z0, double lx, double ly, double lz, double skin
+)
+{
+    double lxh = lx * 0.5;
+    double lyh = ly * 0.5;
+    double lzh = lz * 0.5;
+    double limit_square = skin * skin * 0.25;
+    for (int n = 0; n < N; n++)
+    {
+        double dx = x[n] - x0[n];
+        double dy = y[n] - y0[n];
+        double dz = z[n] - z0[n];
+        apply_mic(lx, ly, lz, lxh, lyh, lzh, &dx, &dy, &dz);
+        if (dx * dx + dy * dy + dz * dz > limit_square) { return 1; }
+    }
+    return 0;
 }
 
 
@@ -131,9 +264,9 @@ void find_force
     double *vx, double *vy, double *vz, double *hc, double Fe
 )
 {
-    const double epsilon = 1.032e-2;
-    const double sigma = 3.405;
-    const double cutoff = sigma * 3.0;
+    const double epsilon = LJ_EPSILON;
+    const double sigma = LJ_SIGMA;
+    const double cutoff = LJ_CUTOFF;
     const double cutoff_square = cutoff * cutoff;
     const double sigma_3 = sigma * sigma * sigma;
     const double sigma_6 = sigma_3 * sigma_3;
@@ -141,15 +274,19 @@ void find_force
     const double factor_1 = 24.0 * epsilon * sigma_6; 
     const double factor_2 = 48.0 * epsilon * sigma_12;
 
-    // initialize heat current and force
-    hc[0] = hc[1] = hc[2] = 0.0; 
+    // initialize force; the heat current is summed per atom, per block of
+    // atoms and then over the blocks, in an order that only depends on N
     for (int n = 0; n < N; ++n) { fx[n]=fy[n]=fz[n]=0.0; }
+    double stack[32][3]; int size[32]; int top = 0;
+    double block[3] = {0.0, 0.0, 0.0};
+    double error[3] = {0.0, 0.0, 0.0};
 
     double lxh = lx * 0.5;
     double lyh = ly * 0.5;
     double lzh = lz * 0.5;
     for (int i = 0; i < N; ++i)
     {
+        double hc_i[3] = {0.0, 0.0, 0.0};
         for (int k = 0; k < NN[i]; k++)
         {
             int j = NL[i * MN + k];
@@ -187,11 +324,23 @@ void find_force
                            + y_ij * (vy[i] + vy[j])
                            + z_ij * (vz[i] + vz[j]);
             f_dot_v *= f_ij * 0.5;
-            hc[0] -= x_ij * f_dot_v; // calculate heat current
-            hc[1] -= y_ij * f_dot_v;
-            hc[2] -= z_ij * f_dot_v;
+            hc_i[0] -= x_ij * f_dot_v; // calculate heat current
+            hc_i[1] -= y_ij * f_dot_v;
+            hc_i[2] -= z_ij * f_dot_v;
+        }
+        for (int d = 0; d < 3; ++d)
+        { add_to_sum(&block[d], &error[d], hc_i[d]); }
+        if ((i + 1) % REDUCTION_BLOCK == 0 || i == N - 1)
+        {
+            push_block(stack, size, &top, block);
+            for (int d = 0; d < 3; ++d) { block[d] = error[d] = 0.0; }
         }
     }
+    for (; top > 1; --top)
+    {
+        for (int d = 0; d < 3; ++d) { stack[top - 2][d] += stack[top - 1][d]; }
+    }
+    for (int d = 0; d < 3; ++d) { hc[d] = top > 0 ? stack[0][d] : 0.0; }
 
     // correct total force:
     double fx_ave = 0.0; double fy_ave = 0.0; double fz_ave = 0.0;
@@ -231,6 +380,39 @@ void integrate
 }
 
 
+// largest time step (not above time_step_max) for which no atom moves more 
+// than max_displacement and no atom changes its kinetic energy by more than 
+// max_energy_change (if > 0), estimated from the current velocities and forces
+double find_time_step
+(
+    int N, double time_step_max, double max_displacement, 
+    double max_energy_change, double *m, double *vx, double *vy, double *vz,
+    double *fx, double *fy, double *fz
+)
+{
+    double v2_max = 0.0; double a2_max = 0.0; double power_max = 0.0;
+    for (int n = 0; n < N; ++n)
+    {
+        double v2 = vx[n] * vx[n] + vy[n] * vy[n] + vz[n] * vz[n];
+        double a2 = (fx[n] * fx[n] + fy[n] * fy[n] + fz[n] * fz[n]) 
+                  / (m[n] * m[n]);
+        double power = fabs(fx[n] * vx[n] + fy[n] * vy[n] + fz[n] * vz[n]);
+        if (v2 > v2_max) { v2_max = v2; }
+        if (a2 > a2_max) { a2_max = a2; }
+        if (power > power_max) { power_max = power; }
+    }
+    double time_step = time_step_max;
+    if (v2_max > 0.0 && max_displacement / sqrt(v2_max) < time_step)
+    { time_step = max_displacement / sqrt(v2_max); }
+    if (a2_max > 0.0 && sqrt(2.0 * max_displacement / sqrt(a2_max)) < time_step)
+    { time_step = sqrt(2.0 * max_displacement / sqrt(a2_max)); }
+    if (max_energy_change > 0.0 && power_max > 0.0 
+        && max_energy_change / power_max < time_step)
+    { time_step = max_energy_change / power_max; }
+    return time_step;
+}
+
+
 int main(void)
 {
     srand(time(NULL));
@@ -260,6 +442,13 @@ int main(void)
     if (count != 2) { printf("input error\n"); exit(1);}
     count = scanf("%s%lf", name, &Fe);
     if (count != 2) { printf("input error\n"); exit(1);}
+
+    // optional line for an adaptive time step (not above time_step):
+    // adaptive max_displacement (A) max_energy_change (eV, 0 to disable)
+    double max_displacement = 0.0;
+    double max_energy_change = 0.0;
+    count = scanf("%s%lf%lf", name, &max_displacement, &max_energy_change);
+    if (count != EOF && count != 3) { printf("input error\n"); exit(1);}
     
     // unit conversion 
     time_step /= TIME_UNIT_CONVERSION;
@@ -267,8 +456,9 @@ int main(void)
     // soem fixed parameters:
     int Ns = 1000;        // output the heat current data every so many steps
     int n0 = 4;           // number of particles in the unit cell (FCC crystal)
-    int MN = 200;         // maximum number of neighbors for one particle
+    int MN = 200;         // initial room for the neighbors of a particle
     double cutoff = 12.0; // cutoff distance for neighbor list
+    double skin = cutoff - LJ_CUTOFF;
 
     // determine other parameters
     int ny = nx; // number of unit cells in the y-direction
@@ -280,9 +470,13 @@ int main(void)
     double ly = ay * ny;  // box length in the y direction
     double lz = az * nz;  // box length in the z direction
  
-    // fixed neighbor list
+    // neighbor list, updated when an atom has moved by more than skin / 2
     int *NN = (int*) malloc(N * sizeof(int));
     int *NL = (int*) malloc(N * MN * sizeof(int));
+    double *x0 = (double*) malloc(N * sizeof(double)); // at the last update
+    double *y0 = (double*) malloc(N * sizeof(double));
+    double *z0 = (double*) malloc(N * sizeof(double));
+    int num_updates = 0;
 
     // major data for the particles
     double *m  = (double*) malloc(N * sizeof(double)); // mass
@@ -301,49 +495,118 @@ int main(void)
     initialize_position(n0, nx, ny, nz, ax, ay, az, x, y, z);
     initialize_velocity(N, T_0, m, vx, vy, vz);
 
+
+    // start from a cached equilibrated state of the same system if there is
+    // one at a close temperature; then a short re-equilibration is enough
+    int use_cache = 1;
+    // N, box, mass, and the LJ parameters as in find_force
+    double params[] = {(double) N, lx, ly, lz, 40.0, LJ_EPSILON, LJ_SIGMA, LJ_CUTOFF};
+    int num_params = sizeof(params) / sizeof(double);
+    unsigned long long key = find_state_key(num_params, params);
+    double T_cached = -1.0;
+    if (use_cache) 
+    { T_cached = load_state(key, N, T_0, x, y, z, vx, vy, vz); }
+    if (T_cached > 0.0)
+    {
+        // fresh velocities keep runs with different seeds independent
+        initialize_velocity(N, T_0, m, vx, vy, vz);
+        Ne /= 10;
+        fprintf(stderr, "start from the cached state at T = %g K\n", T_cached);
+    }
+
     // initialize neighbor list and force
-    find_neighbor(N, NN, NL, x, y, z, lx, ly, lz, MN, cutoff);
+    find_neighbor(N, NN, &NL, &MN, x, y, z, x0, y0, z0, lx, ly, lz, cutoff);
     double hc[3]; // heat current at a specific time point
     find_force(N, NN, NL, MN, lx, ly, lz, x, y, z, fx, fy, fz, vx, vy, vz, hc, 0.0);
  
     // equilibration
     clock_t time_begin = clock();
-    for (int step = 0; step < Ne; ++step)
+    double dt = time_step;
+    for (double t = 0.0; t < (Ne - 1.0e-6) * time_step; t += dt)
     { 
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (max_displacement > 0.0)
+        {
+            dt = find_time_step
+            (
+                N, time_step, max_displacement, max_energy_change, 
+                m, vx, vy, vz, fx, fy, fz
+            );
+        }
+        integrate(N, dt, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (need_neighbor_update(N, x, y, z, x0, y0, z0, lx, ly, lz, skin))
+        {
+            find_neighbor
+            (N, NN, &NL, &MN, x, y, z, x0, y0, z0, lx, ly, lz, cutoff);
+            num_updates++;
+        }
         find_force(N, NN, NL, MN, lx, ly, lz, x, y, z, fx, fy, fz, vx, vy, vz, hc, 0.0);
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
+        integrate(N, dt, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
         scale_velocity(N, T_0, m, vx, vy, vz); // control temperature
     } 
     clock_t time_finish = clock();
     double time_used = (time_finish - time_begin) / (double) CLOCKS_PER_SEC;
     fprintf(stderr, "time used for equilibration = %f s\n", time_used); 
 
+    if (use_cache && T_cached != T_0) 
+    { save_state(key, N, T_0, x, y, z, vx, vy, vz); }
+
     // production
     time_begin = clock();
     double dt_in_ps = time_step * TIME_UNIT_CONVERSION / 1000.0; // ps
     double factor = KAPPA_UNIT_CONVERSION / (T_0 * lx * ly * lz * Fe);
     FILE *fid = fopen("kappa.txt", "a");
+    setvbuf(fid, NULL, _IOFBF, 1 << 20); // write in large blocks
     double hc_sum[3] = {0.0, 0.0, 0.0};
-    for (int step = 0; step < Np; ++step)
+    // each step contributes hc * dt to the block(s) of Ns * time_step it
+    // covers, so a variable step gives time averages on the fixed grid
+    int num_blocks = 0;
+    double t = 0.0; // elapsed time in the production stage
+    dt = time_step;
+    while (num_blocks < Np / Ns)
     {  
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (max_displacement > 0.0)
+        {
+            dt = find_time_step
+            (
+                N, time_step, max_displacement, max_energy_change, 
+                m, vx, vy, vz, fx, fy, fz
+            );
+        }
+        integrate(N, dt, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        if (need_neighbor_update(N, x, y, z, x0, y0, z0, lx, ly, lz, skin))
+        {
+            find_neighbor
+            (N, NN, &NL, &MN, x, y, z, x0, y0, z0, lx, ly, lz, cutoff);
+            num_updates++;
+        }
         find_force(N, NN, NL, MN, lx, ly, lz, x, y, z, fx, fy, fz, vx, vy, vz, hc, Fe);
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
+        integrate(N, dt, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
         scale_velocity(N, T_0, m, vx, vy, vz); // control temperature
-        for (int i = 0; i < 3; i++) hc_sum[i] += hc[i] * factor;
-        if ((step+1) % Ns == 0) 
+        double t_old = t;
+        t += dt;
+        double t_block = (num_blocks + 1) * Ns * time_step;
+        while (num_blocks < Np / Ns && t_block < t + 1.0e-6 * time_step)
         {
-            fprintf(fid, "%25.15e%25.15e%25.15e%25.15e\n", (step+1)*dt_in_ps, 
-                    hc_sum[0]/Ns, hc_sum[1]/Ns, hc_sum[2]/Ns);
+            for (int i = 0; i < 3; i++) 
+                hc_sum[i] += hc[i] * factor * (t_block - t_old);
+            fprintf(fid, "%25.15e%25.15e%25.15e%25.15e\n", 
+                    (num_blocks + 1) * Ns * dt_in_ps, 
+                    hc_sum[0] / (Ns * time_step), hc_sum[1] / (Ns * time_step), 
+                    hc_sum[2] / (Ns * time_step));
             for (int i = 0; i < 3; i++) hc_sum[i] = 0.0;
+            num_blocks++;
+            t_old = t_block;
+            t_block = (num_blocks + 1) * Ns * time_step;
         }
+        for (int i = 0; i < 3; i++) hc_sum[i] += hc[i] * factor * (t - t_old);
     } 
     fclose(fid);
     time_finish = clock();
     time_used = (time_finish - time_begin) / (double) CLOCKS_PER_SEC;
     fprintf(stderr, "time used for production = %f s\n", time_used); 
 
+    fprintf(stderr, "number of neighbor list updates = %d\n", num_updates);
+    free(x0); free(y0); free(z0);
     free(NN); free(NL); free(m);  free(x);  free(y);  free(z);
     free(vx); free(vy); free(vz); free(fx); free(fy); free(fz); 
     return 0;
@@ -0,0 +1,84 @@
+/*----------------------------------------------------------------------------80
+    Copyright 2022 Zheyong Fan
+thermo.out writer and interrupt flag shared by md2.cpp and md3.cpp, which
+include this file; nothing to compile separately
+------------------------------------------------------------------------------*/
+
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <charconv> // std::to_chars
+#include <chrono>   // std::chrono::duration
+#include <condition_variable>
+#include <csignal> // std::sig_atomic_t
+#include <fstream> // file
+#include <mutex>   // std::mutex
+#include <string>  // string
+#include <thread>  // std::thread
+
+// Output file whose lines are formatted into memory by the MD thread and
+// written to disk by a helper thread every flushInterval seconds. The text
+// is the same as with std::fixed and std::setprecision(16).
+struct AsyncWriter {
+  std::ofstream file;
+  std::string buffer;
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::thread worker;
+  bool isDone = false;
+
+  AsyncWriter(const char* fileName, const double flushInterval)
+    : file(fileName)
+  {
+    worker = std::thread([this, flushInterval]() {
+      std::string text;
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!isDone) {
+        condition.wait_for(lock, std::chrono::duration<double>(flushInterval));
+        text.swap(buffer);
+        lock.unlock();
+        file << text;
+        file.flush();
+        text.clear();
+        lock.lock();
+      }
+      file << buffer;
+      file.close();
+    });
+  }
+
+  ~AsyncWriter() { close(); }
+
+  void writeLine(const double* values, const int numValues)
+  {
+    char text[400]; // enough for any double in fixed notation
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int n = 0; n < numValues; ++n) {
+      if (n > 0)
+        buffer += ' ';
+      const auto result = std::to_chars(
+        text, text + sizeof(text), values[n], std::chars_format::fixed, 16);
+      buffer.append(text, result.ptr);
+    }
+    buffer += '\n';
+  }
+
+  void close()
+  {
+    if (!worker.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      isDone = true;
+    }
+    condition.notify_one();
+    worker.join();
+  }
+};
+
+// set by SIGINT and SIGTERM so that the run stops cleanly after a step
+inline volatile std::sig_atomic_t isInterrupted = 0;
+
+inline void handleSignal(int) { isInterrupted = 1; }
+
+#endif
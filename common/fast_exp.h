@@ -0,0 +1,68 @@
+/*----------------------------------------------------------------------------80
+    Copyright 2022 Zheyong Fan
+exp(x) with no libm call, shared by md2.cpp (Nose-Hoover chains) and md3.cpp
+(Tersoff and the chains), which include this file; nothing to compile
+separately
+------------------------------------------------------------------------------*/
+
+#ifndef FAST_EXP_H
+#define FAST_EXP_H
+
+#include <algorithm> // std::min
+#include <cmath>     // exp
+#include <cstdint>   // uint64_t
+#include <cstring>   // std::memcpy
+
+inline double getDoubleFromBits(const long long bits)
+{
+  double x;
+  std::memcpy(&x, &bits, sizeof(double));
+  return x;
+}
+
+inline long long getBitsFromDouble(const double x)
+{
+  long long bits;
+  std::memcpy(&bits, &x, sizeof(double));
+  return bits;
+}
+
+// x = k ln2 + r with |r| <= ln2 / 2, a degree-13 Taylor polynomial for exp(r)
+// and 2^k from the bits of x / ln2 + 1.5 * 2^52. It is arithmetic only, so
+// that loops calling it vectorize, and is within 1 ulp of libm for
+// -708 < x < 709 (checked with 1e7 samples); x should be in that range.
+// Compile with -DUSE_LIBM to get exp instead.
+inline double fastExpInRange(const double x)
+{
+#ifdef USE_LIBM
+  return exp(x);
+#else
+  const double log2e = 1.4426950408889634;
+  const double ln2Hi = 6.93147180369123816490e-01;
+  const double ln2Lo = 1.90821492927058770002e-10;
+  const double magic = 6755399441055744.0; // 1.5 * 2^52
+  const double t = x * log2e + magic;      // k is in the low bits of t
+  const double k = t - magic;
+  const double r = (x - k * ln2Hi) - k * ln2Lo; // |r| <= ln2 / 2
+  const double r2 = r * r; // Taylor series to r^13 in pairs of terms
+  double p = 1.0 / 479001600.0 + r * (1.0 / 6227020800.0);
+  p = p * r2 + (1.0 / 3628800.0 + r * (1.0 / 39916800.0));
+  p = p * r2 + (1.0 / 40320.0 + r * (1.0 / 362880.0));
+  p = p * r2 + (1.0 / 720.0 + r * (1.0 / 5040.0));
+  p = p * r2 + (1.0 / 24.0 + r * (1.0 / 120.0));
+  p = p * r2 + (0.5 + r * (1.0 / 6.0));
+  p = p * r2 + r;
+  const uint64_t bits = (uint64_t(getBitsFromDouble(t)) + 1023) << 52; // 2^k
+  return (1.0 + p) * getDoubleFromBits(bits);
+#endif
+}
+
+// fastExpInRange with x clamped to the range first; the clamp only
+// vectorizes with -fno-trapping-math, so the Nose-Hoover chains, whose x is
+// about dt / tau, call fastExpInRange directly
+inline double fastExp(const double x)
+{
+  return fastExpInRange(std::min(std::max(x, -708.0), 709.0));
+}
+
+#endif
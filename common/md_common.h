@@ -0,0 +1,167 @@
+/*----------------------------------------------------------------------------80
+    Helpers shared by the C drivers of chapters 4 and 5 (md_rdf, md_diffusion,
+    kappa_emd and kappa_hnemd). Each driver includes this file, so it is still
+    compiled as a single file, e.g. g++ -O3 kappa_emd.cpp
+------------------------------------------------------------------------------*/
+
+#ifndef MD_COMMON_H
+#define MD_COMMON_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#ifdef _WIN32
+#include <process.h> // _getpid
+#define getpid _getpid
+#else
+#include <unistd.h>  // getpid
+#endif
+
+
+// sum += value, with Kahan compensation if compiled with -DCOMPENSATED_SUM
+static inline void add_to_sum(double *sum, double *error, double value)
+{
+#ifdef COMPENSATED_SUM
+    double y = value - *error;
+    double s = *sum + y;
+    *error = (s - *sum) - y;
+    *sum = s;
+#else
+    (void) error;
+    *sum += value;
+#endif
+}
+
+
+// push the sum of one block of atoms onto a stack of partial sums which are
+// merged pairwise like the digits of a binary counter; with the final fold
+// in find_force this adds the blocks in a binary tree fixed by N alone
+static inline void push_block
+(double stack[][3], int *size, int *top, double *block)
+{
+    for (int d = 0; d < 3; ++d) { stack[*top][d] = block[d]; }
+    size[(*top)++] = 1;
+    while (*top > 1 && size[*top - 1] == size[*top - 2])
+    {
+        --(*top);
+        for (int d = 0; d < 3; ++d) { stack[*top - 1][d] += stack[*top][d]; }
+        size[*top - 1] *= 2;
+    }
+}
+
+
+// FNV-1a hash of the numbers that define the system (not the temperature)
+static inline unsigned long long find_state_key(int num_params, double *params)
+{
+    unsigned long long key = 14695981039346656037ULL;
+    unsigned char *bytes = (unsigned char *) params;
+    for (int i = 0; i < num_params * (int) sizeof(double); ++i)
+    {
+        key ^= bytes[i];
+        key *= 1099511628211ULL;
+    }
+    return key;
+}
+
+
+// The file state_<key>.bin holds equilibrated states of one system, each
+// stored as T, x, y, z, vx, vy, vz. Load the state with the temperature
+// closest to T_0 (within 20%) and return its temperature, or -1 if none.
+static inline double load_state
+(
+    unsigned long long key, int N, double T_0, double *x, double *y,
+    double *z, double *vx, double *vy, double *vz
+)
+{
+    char file_name[100];
+    sprintf(file_name, "state_%016llx.bin", key);
+    FILE *fid = fopen(file_name, "rb");
+    if (fid == NULL) { return -1.0; }
+
+    long record_size = sizeof(double) * (1 + 6 * N);
+    long offset = 0;
+    long offset_best = 0;
+    double T_best = -1.0;
+    double T;
+    while
+    (
+        fseek(fid, offset, SEEK_SET) == 0 && fread(&T, sizeof(double), 1, fid)
+    )
+    {
+        double error = fabs(T - T_0);
+        double error_best = fabs(T_best - T_0);
+        if (error <= 0.2 * T_0 && (T_best < 0.0 || error < error_best))
+        {
+            T_best = T;
+            offset_best = offset;
+        }
+        offset += record_size;
+    }
+
+    if (T_best > 0.0)
+    {
+        double *data[6] = {x, y, z, vx, vy, vz};
+        fseek(fid, offset_best + sizeof(double), SEEK_SET);
+        for (int d = 0; d < 6; ++d)
+        {
+            if (fread(data[d], sizeof(double), N, fid) != (size_t) N)
+            {
+                printf("Error: %s is truncated.\n", file_name);
+                exit(1);
+            }
+        }
+    }
+    fclose(fid);
+    return T_best;
+}
+
+
+// Add a record to state_<key>.bin. The old records and the new one are
+// written to a file of this process, which then replaces state_<key>.bin with
+// rename(), so a concurrent run of the same system never sees a partly
+// written file; if two runs save at the same time, one of the new records is
+// lost, which only costs a longer equilibration later.
+static inline void save_state
+(
+    unsigned long long key, int N, double T_0, double *x, double *y,
+    double *z, double *vx, double *vy, double *vz
+)
+{
+    char file_name[100];
+    char temp_name[130];
+    sprintf(file_name, "state_%016llx.bin", key);
+    sprintf(temp_name, "%s.%d.tmp", file_name, (int) getpid());
+    FILE *fid = fopen(temp_name, "wb");
+    if (fid == NULL) { return; } // the cache is only an optimization
+
+    int is_ok = 1;
+    FILE *fid_old = fopen(file_name, "rb");
+    if (fid_old != NULL)
+    {
+        char buffer[65536];
+        size_t size;
+        while ((size = fread(buffer, 1, sizeof(buffer), fid_old)) > 0)
+        {
+            if (fwrite(buffer, 1, size, fid) != size) { is_ok = 0; }
+        }
+        fclose(fid_old);
+    }
+    double *data[6] = {x, y, z, vx, vy, vz};
+    if (fwrite(&T_0, sizeof(double), 1, fid) != 1) { is_ok = 0; }
+    for (int d = 0; d < 6; ++d)
+    {
+        if (fwrite(data[d], sizeof(double), N, fid) != (size_t) N)
+        { is_ok = 0; }
+    }
+    if (fclose(fid) != 0) { is_ok = 0; }
+
+    if (is_ok && rename(temp_name, file_name) != 0)
+    {
+        remove(file_name); // rename() does not replace a file on Windows
+        is_ok = rename(temp_name, file_name) == 0;
+    }
+    if (!is_ok) { remove(temp_name); }
+}
+
+
+#endif
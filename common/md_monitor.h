@@ -0,0 +1,50 @@
+/*----------------------------------------------------------------------------80
+    Copyright 2022 Zheyong Fan
+layout of the live metrics that md2.cpp and md3.cpp write to the POSIX
+shared memory /md_<name> and tools/mdtop.cpp reads; all three include this
+file, so change MONITOR_VERSION with the layout
+------------------------------------------------------------------------------*/
+
+#ifndef MD_MONITOR_H
+#define MD_MONITOR_H
+
+#include <atomic>  // std::atomic
+#include <cstdint> // uint64_t
+
+const uint32_t MONITOR_VERSION = 1;
+const int MONITOR_SLOTS = 64;
+
+// The shared memory holds a header and a ring of the latest MONITOR_SLOTS
+// records, written by the run only. The sequence number of a record is odd
+// while it is written, and a reader copies the record again if the number
+// changes (a seqlock), so the run never waits for a reader.
+struct MonitorRecord {
+  std::atomic<uint64_t> sequence;
+  uint64_t index; // records before this one
+  int64_t step;
+  int64_t numUpdates;  // neighbor list updates so far
+  double time;         // ps
+  double temperature;  // K
+  double pe;           // eV
+  double pressure;     // GPa
+  double nsPerDay;     // since the previous record
+  double phaseTime[4]; // s in neighbor, force, integrate and other so far
+};
+
+struct MonitorHeader {
+  char magic[8]; // "mdtop"
+  uint32_t version;
+  uint32_t numSlots;
+  uint32_t recordSize;
+  int32_t pid;
+  int64_t numAtoms;
+  int64_t numSteps;
+  char program[8];
+  std::atomic<uint64_t> numRecords;
+  std::atomic<uint32_t> isRunning;
+};
+
+static_assert(
+  std::atomic<uint64_t>::is_always_lock_free, "no lock-free 64-bit atomics");
+
+#endif
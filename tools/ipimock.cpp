@@ -0,0 +1,284 @@
+/*----------------------------------------------------------------------------80
+    Copyright 2022 Zheyong Fan
+Compile:
+    g++ ipimock.cpp -O3 -o ipimock
+Run:
+    ipimock name xyz.in &
+    path/to/md2.out # or md3, with the line "ipi unix name" in run.in
+Inputs:
+    xyz.in of the client: the number of atoms on the first line, the cell
+    vectors a, b and c (and optionally pbc) on the second and then a line
+    "element x y z ..." per atom
+Outputs:
+    a mock i-PI server on the UNIX socket /tmp/ipi_name: it sends positions
+    near those of xyz.in and checks the answers against finite differences
+    of the energy (the forces of 4 components and the 9 components of the
+    virial) and, if a is periodic, against moves of an atom by a; prints the
+    errors and exits with 1 if one of them is too large
+------------------------------------------------------------------------------*/
+
+#include <algorithm> // std::copy
+#include <cmath>    // std::abs
+#include <cstdint>  // int32_t
+#include <cstdio>   // remove
+#include <cstdlib>  // exit
+#include <fstream>  // file
+#include <iostream> // input/output
+#include <random>   // std::mt19937
+#include <sstream>  // std::istringstream
+#include <string>   // string
+#include <vector>   // vector
+#ifdef _WIN32
+int main(int argc, char** argv)
+{
+  std::cout << "ipimock is not supported on Windows." << std::endl;
+  return 1;
+}
+#else
+#include <sys/socket.h> // socket
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>     // close
+
+const double BOHR = 0.52917721067;    // A
+const double HARTREE = 27.21138602;   // eV
+const int HEADER_SIZE = 12;
+const double FORCE_TOLERANCE = 1e-4;  // eV/A
+const double VIRIAL_TOLERANCE = 1e-3; // eV
+
+int client = -1;
+
+void readSocket(void* data, const size_t size)
+{
+  char* p = (char*)data;
+  for (size_t done = 0; done < size;) {
+    const ssize_t n = recv(client, p + done, size - done, 0);
+    if (n <= 0) {
+      std::cout << "The client closed the socket." << std::endl;
+      exit(1);
+    }
+    done += n;
+  }
+}
+
+void writeSocket(const void* data, const size_t size)
+{
+  if (send(client, data, size, 0) != ssize_t(size)) {
+    std::cout << "Failed to write to the client." << std::endl;
+    exit(1);
+  }
+}
+
+void writeHeader(const std::string& message)
+{
+  std::string header = message;
+  header.resize(HEADER_SIZE, ' ');
+  writeSocket(header.data(), HEADER_SIZE);
+}
+
+void expectHeader(const std::string& message)
+{
+  char header[HEADER_SIZE + 1] = {};
+  readSocket(header, HEADER_SIZE);
+  std::string text(header);
+  text.erase(text.find_last_not_of(' ') + 1);
+  if (text != message) {
+    std::cout << "Expected " << message << " but got " << text << std::endl;
+    exit(1);
+  }
+}
+
+// h has the cell vectors as columns and r is x, y, z of each atom, in A;
+// returns the energy in eV and the forces (eV/A) and virial (eV) of the client
+double compute(
+  const double* h, const std::vector<double>& r, std::vector<double>& f,
+  double* virial)
+{
+  const int32_t number = r.size() / 3;
+  double cell[18] = {}; // and its inverse, which the clients do not read
+  for (int k = 0; k < 9; ++k)
+    cell[k] = h[k] / BOHR;
+  std::vector<double> buffer(r.size());
+  for (size_t k = 0; k < r.size(); ++k)
+    buffer[k] = r[k] / BOHR;
+  writeHeader("STATUS");
+  expectHeader("READY");
+  writeHeader("POSDATA");
+  writeSocket(cell, sizeof(cell));
+  writeSocket(&number, 4);
+  writeSocket(buffer.data(), buffer.size() * sizeof(double));
+  writeHeader("STATUS");
+  expectHeader("HAVEDATA");
+  writeHeader("GETFORCE");
+  expectHeader("FORCEREADY");
+  double energy;
+  int32_t numberBack, extraSize;
+  readSocket(&energy, 8);
+  readSocket(&numberBack, 4);
+  if (numberBack != number) {
+    std::cout << "The client sent " << numberBack << " forces." << std::endl;
+    exit(1);
+  }
+  readSocket(buffer.data(), buffer.size() * sizeof(double));
+  readSocket(virial, 9 * sizeof(double));
+  readSocket(&extraSize, 4);
+  std::vector<char> extra(extraSize);
+  readSocket(extra.data(), extraSize);
+  f.resize(r.size());
+  for (size_t k = 0; k < r.size(); ++k)
+    f[k] = buffer[k] * HARTREE / BOHR;
+  for (int k = 0; k < 9; ++k)
+    virial[k] *= HARTREE;
+  return energy * HARTREE;
+}
+
+// h' = (1 + eps) h and r' = (1 + eps) r for the strain eps = delta e_a e_b
+void applyStrain(
+  const int a, const int b, const double delta, double* h,
+  std::vector<double>& r)
+{
+  for (int j = 0; j < 3; ++j)
+    h[a * 3 + j] += delta * h[b * 3 + j];
+  for (size_t n = 0; n < r.size() / 3; ++n)
+    r[n * 3 + a] += delta * r[n * 3 + b];
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 3) {
+    std::cout << "Usage: ipimock name xyz.in" << std::endl;
+    exit(1);
+  }
+  std::ifstream input(argv[2]);
+  int number;
+  double box[9]; // a, b and c as rows, as in xyz.in
+  std::string line;
+  if (!(input >> number) || !std::getline(input, line)) {
+    std::cout << "Cannot read " << argv[2] << std::endl;
+    exit(1);
+  }
+  int pbc[3] = {1, 1, 1};
+  std::getline(input, line);
+  std::istringstream boxLine(line);
+  for (int k = 0; k < 9; ++k)
+    boxLine >> box[k];
+  for (int d = 0; d < 3; ++d)
+    boxLine >> pbc[d];
+  double h[9]; // a, b and c as columns, as in POSDATA
+  for (int i = 0; i < 3; ++i)
+    for (int j = 0; j < 3; ++j)
+      h[i * 3 + j] = box[j * 3 + i];
+  std::mt19937 random(1);
+  std::normal_distribution<double> noise(0.0, 0.05);
+  std::vector<double> r(number * 3);
+  for (int n = 0; n < number; ++n) {
+    std::string element;
+    input >> element >> r[n * 3] >> r[n * 3 + 1] >> r[n * 3 + 2];
+    std::getline(input, line);
+    for (int d = 0; d < 3; ++d)
+      r[n * 3 + d] += noise(random);
+  }
+  if (!input) {
+    std::cout << "Cannot read " << argv[2] << std::endl;
+    exit(1);
+  }
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  const std::string path = "/tmp/ipi_" + std::string(argv[1]);
+  if (path.size() >= sizeof(address.sun_path)) {
+    std::cout << "The socket name is too long." << std::endl;
+    exit(1);
+  }
+  std::copy(path.begin(), path.end(), address.sun_path);
+  remove(path.c_str());
+  const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (
+    bind(server, (sockaddr*)&address, sizeof(address)) != 0 ||
+    listen(server, 1) != 0) {
+    std::cout << "Cannot listen on " << path << std::endl;
+    exit(1);
+  }
+  client = accept(server, nullptr, nullptr);
+  writeHeader("STATUS");
+  expectHeader("READY");
+  writeHeader("INIT");
+  const int32_t init[2] = {0, 3};
+  writeSocket(init, sizeof(init));
+  writeSocket("abc", 3);
+
+  std::vector<double> f0, f;
+  double virial0[9], virial[9];
+  const double e0 = compute(h, r, f0, virial0);
+  double sumForce[3] = {0.0, 0.0, 0.0};
+  for (int n = 0; n < number; ++n)
+    for (int d = 0; d < 3; ++d)
+      sumForce[d] += f0[n * 3 + d];
+  std::cout << "energy = " << e0 << " eV, total force = " << sumForce[0]
+            << " " << sumForce[1] << " " << sumForce[2] << " eV/A"
+            << std::endl;
+
+  // -dU/dr by central differences for a few components
+  double forceError = 0.0;
+  const double dr = 1e-4;
+  for (const int k : {0, 16, 53, 300}) {
+    const int component = k % (number * 3);
+    std::vector<double> rShifted = r;
+    rShifted[component] += dr;
+    const double ePlus = compute(h, rShifted, f, virial);
+    rShifted[component] -= 2.0 * dr;
+    const double eMinus = compute(h, rShifted, f, virial);
+    const double numeric = -(ePlus - eMinus) / (2.0 * dr);
+    forceError = std::max(forceError, std::abs(numeric - f0[component]));
+  }
+  std::cout << "force error = " << forceError << " eV/A" << std::endl;
+
+  // -dU/d(strain) by central differences for each component
+  double virialError = 0.0;
+  const double strain = 1e-5;
+  for (int a = 0; a < 3; ++a) {
+    for (int b = 0; b < 3; ++b) {
+      double hStrained[9];
+      std::copy(h, h + 9, hStrained);
+      std::vector<double> rStrained = r;
+      applyStrain(a, b, strain, hStrained, rStrained);
+      const double ePlus = compute(hStrained, rStrained, f, virial);
+      std::copy(h, h + 9, hStrained);
+      rStrained = r;
+      applyStrain(a, b, -strain, hStrained, rStrained);
+      const double eMinus = compute(hStrained, rStrained, f, virial);
+      const double numeric = -(ePlus - eMinus) / (2.0 * strain);
+      std::cout << "virial " << a << b << " = " << virial0[a * 3 + b]
+                << " eV, numeric " << numeric << " eV" << std::endl;
+      virialError =
+        std::max(virialError, std::abs(numeric - virial0[a * 3 + b]));
+    }
+  }
+  std::cout << "virial error = " << virialError << " eV" << std::endl;
+
+  // small moves with atom 3 sent one cell vector a away if a is periodic,
+  // which the client should wrap back without changing the energy
+  std::normal_distribution<double> move(0.0, 0.002);
+  std::vector<double> rMoved = r;
+  double e = 0.0;
+  for (int step = 0; step < 20; ++step) {
+    for (double& x : rMoved)
+      x += move(random);
+    std::vector<double> rSent = rMoved;
+    for (int d = 0; d < 3; ++d)
+      rSent[3 * 3 + d] += pbc[0] ? h[d * 3] : 0.0;
+    e = compute(h, rSent, f, virial);
+  }
+  double wrapError = std::abs(e - compute(h, rMoved, f, virial));
+  std::cout << "energy after 20 moves = " << e << " eV, wrap error = "
+            << wrapError << " eV" << std::endl;
+
+  writeHeader("EXIT");
+  close(client);
+  close(server);
+  remove(path.c_str());
+  const bool isOk = forceError < FORCE_TOLERANCE &&
+                    virialError < VIRIAL_TOLERANCE && wrapError < 1e-8;
+  std::cout << (isOk ? "PASSED" : "FAILED") << std::endl;
+  return isOk ? 0 : 1;
+}
+#endif
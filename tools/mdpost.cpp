@@ -0,0 +1,699 @@
+/*----------------------------------------------------------------------------80
+    Copyright 2022 Zheyong Fan
+Compile:
+    g++ mdpost.cpp -O3 -pthread -o mdpost
+Run:
+    mdpost rdf  file N box [-pbc a b c] [-bins Ng] [-rc rc] [-types t1 t2]
+    mdpost msd  file N dt Nc
+    mdpost vacf file N dt Nc
+    mdpost pdos file N dt Nc omega_max Nw
+    mdpost hac  file dt Nc T V
+    Each command also takes -threads T (default: all cores).
+Inputs:
+    rdf: frames of N lines "x y z" (r.txt) or "type x y z" (r.xyz); the box
+         is 3 lengths or 9 numbers (a, b and c vectors as in xyz.in)
+    msd, vacf, pdos: frames of N lines "x y z" (unwrapped positions or
+         velocities); dt is the time between two frames
+    hac: lines "Jx Jy Jz" of the heat current in natural units, dt in fs
+Outputs (the columns the Matlab scripts expect):
+    rdf.txt:   r g(r)                       (test_rdf.m)
+    msd.txt:   t msd_x msd_y msd_z          (md_diffusion.c, plot_results.m)
+    vac.txt:   t vac_x vac_y vac_z          (md_diffusion.c, plot_results.m)
+    pdos.txt:  omega pdos vacf              (find_pdos.m; vacf column over
+                                             the first Nc lines only)
+    kappa.txt: t hac_x hac_y hac_z kappa_x kappa_y kappa_z (plot_kappa.m)
+------------------------------------------------------------------------------*/
+
+#include <cctype>   // isalpha
+#include <charconv> // std::from_chars
+#include <cmath>    // sqrt() function
+#include <cstdio>   // fprintf
+#include <cstdlib>  // exit
+#include <cstring>  // memchr
+#include <fstream>  // file
+#include <iostream> // input/output
+#include <string>   // string
+#include <thread>   // std::thread
+#include <vector>   // vector
+#ifdef _WIN32
+#include <sstream> // std::stringstream
+#else
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
+#endif
+
+const double K_B = 8.617343e-5; // Boltzmann's constant in natural unit
+const double TIME_UNIT_CONVERSION = 1.018051e+1;  // from natural unit to fs
+const double KAPPA_UNIT_CONVERSION = 1.573769e+5; // W/(mK) <-> natural unit
+const double PI = 3.141592653589793;
+
+// read-only view of a whole text file, memory-mapped where possible
+struct MappedFile {
+  const char* data = nullptr;
+  size_t size = 0;
+  std::vector<size_t> lines; // start of each non-empty line
+#ifdef _WIN32
+  std::string content;
+#else
+  int fd = -1;
+#endif
+
+  explicit MappedFile(const char* fileName)
+  {
+#ifdef _WIN32
+    std::ifstream input(fileName, std::ios::binary);
+    if (!input.is_open()) {
+      std::cout << "Failed to open " << fileName << std::endl;
+      exit(1);
+    }
+    std::stringstream stream;
+    stream << input.rdbuf();
+    content = stream.str();
+    data = content.data();
+    size = content.size();
+#else
+    fd = open(fileName, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+      std::cout << "Failed to open " << fileName << std::endl;
+      exit(1);
+    }
+    size = status.st_size;
+    if (size > 0) {
+      void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (address == MAP_FAILED) {
+        std::cout << "Failed to map " << fileName << std::endl;
+        exit(1);
+      }
+      madvise(address, size, MADV_SEQUENTIAL);
+      data = static_cast<const char*>(address);
+    }
+#endif
+    findLines();
+  }
+
+  ~MappedFile()
+  {
+#ifndef _WIN32
+    if (size > 0)
+      munmap(const_cast<char*>(data), size);
+    if (fd >= 0)
+      close(fd);
+#endif
+  }
+
+  void findLines()
+  {
+    const char* end = data + size;
+    for (const char* p = data; p < end;) {
+      const char* newline =
+        static_cast<const char*>(memchr(p, '\n', end - p));
+      if (newline == nullptr)
+        newline = end;
+      for (const char* q = p; q < newline; ++q) {
+        if (*q != ' ' && *q != '\t' && *q != '\r') {
+          lines.push_back(p - data);
+          break;
+        }
+      }
+      p = newline + 1;
+    }
+  }
+
+  const char* lineEnd(const int line) const
+  {
+    const char* p = data + lines[line];
+    const char* newline =
+      static_cast<const char*>(memchr(p, '\n', data + size - p));
+    return newline == nullptr ? data + size : newline;
+  }
+
+  // read numColumns numbers from each of numLines lines starting at firstLine
+  void readColumns(
+    const int firstLine,
+    const int numLines,
+    const int numColumns,
+    double** columns) const
+  {
+    for (int n = 0; n < numLines; ++n) {
+      const char* p = data + lines[firstLine + n];
+      const char* end = lineEnd(firstLine + n);
+      for (int c = 0; c < numColumns; ++c) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '+'))
+          ++p;
+        const auto result = std::from_chars(p, end, columns[c][n]);
+        if (result.ec != std::errc()) {
+          std::cout << "Error: cannot read line " << firstLine + n + 1
+                    << std::endl;
+          exit(1);
+        }
+        p = result.ptr;
+      }
+    }
+  }
+
+  int countColumns() const
+  {
+    int numColumns = 0;
+    const char* end = lineEnd(0);
+    for (const char* p = data + lines[0]; p < end;) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        ++p;
+      if (p == end)
+        break;
+      ++numColumns;
+      while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+        ++p;
+    }
+    return numColumns;
+  }
+};
+
+// run task(k) for k = 0, 1, ..., numTasks - 1 on numThreads threads
+template <typename Task>
+void runParallel(const int numTasks, const int numThreads, const Task& task)
+{
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; ++t) {
+    threads.emplace_back([=, &task]() {
+      for (int k = t; k < numTasks; k += numThreads)
+        task(k, t);
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+}
+
+int getInt(const char* token)
+{
+  int value = 0;
+  try {
+    value = std::stoi(token);
+  } catch (const std::exception& e) {
+    std::cout << "Standard exception:" << e.what() << std::endl;
+    exit(1);
+  }
+  return value;
+}
+
+double getDouble(const char* token)
+{
+  double value = 0;
+  try {
+    value = std::stod(token);
+  } catch (const std::exception& e) {
+    std::cout << "Standard exception:" << e.what() << std::endl;
+    exit(1);
+  }
+  return value;
+}
+
+double getDet(const double* box)
+{
+  return box[0] * (box[4] * box[8] - box[5] * box[7]) +
+         box[1] * (box[5] * box[6] - box[3] * box[8]) +
+         box[2] * (box[3] * box[7] - box[4] * box[6]);
+}
+
+void getInverseBox(double* box)
+{
+  box[9] = box[4] * box[8] - box[5] * box[7];
+  box[10] = box[2] * box[7] - box[1] * box[8];
+  box[11] = box[1] * box[5] - box[2] * box[4];
+  box[12] = box[5] * box[6] - box[3] * box[8];
+  box[13] = box[0] * box[8] - box[2] * box[6];
+  box[14] = box[2] * box[3] - box[0] * box[5];
+  box[15] = box[3] * box[7] - box[4] * box[6];
+  box[16] = box[1] * box[6] - box[0] * box[7];
+  box[17] = box[0] * box[4] - box[1] * box[3];
+  double det = getDet(box);
+  for (int n = 9; n < 18; ++n) {
+    box[n] /= det;
+  }
+}
+
+double getArea(const double* a, const double* b)
+{
+  const double s1 = a[1] * b[2] - a[2] * b[1];
+  const double s2 = a[2] * b[0] - a[0] * b[2];
+  const double s3 = a[0] * b[1] - a[1] * b[0];
+  return sqrt(s1 * s1 + s2 * s2 + s3 * s3);
+}
+
+void getThickness(const double* box, double* thickness)
+{
+  double volume = std::abs(getDet(box));
+  const double a[3] = {box[0], box[3], box[6]};
+  const double b[3] = {box[1], box[4], box[7]};
+  const double c[3] = {box[2], box[5], box[8]};
+  thickness[0] = volume / getArea(b, c);
+  thickness[1] = volume / getArea(c, a);
+  thickness[2] = volume / getArea(a, b);
+}
+
+struct RdfInput {
+  int number;
+  int numBins = 100;
+  int type1 = -1; // all atoms if negative
+  int type2 = -1;
+  int pbc[3] = {1, 1, 1};
+  double rc = 0.0;
+  double box[18];
+};
+
+// pair counts of one frame with a cell list; r12 is taken from the fractional
+// coordinates so that triclinic boxes work as in find_rdf.m
+void accumulateRdf(
+  const RdfInput& input,
+  const double* type,
+  const double* x,
+  const double* y,
+  const double* z,
+  std::vector<double>& count)
+{
+  const int N = input.number;
+  const double* box = input.box;
+  const double rcSquare = input.rc * input.rc;
+  const double binInverse = input.numBins / input.rc;
+  double thickness[3];
+  getThickness(box, thickness);
+  int numCells[3];
+  for (int d = 0; d < 3; ++d) {
+    numCells[d] = floor(thickness[d] / input.rc);
+    if (numCells[d] < 3) // one cell covers all atoms then
+      numCells[d] = 1;
+  }
+
+  std::vector<double> s(N * 3);
+  std::vector<int> cellOfAtom(N);
+  const int numCellsTotal = numCells[0] * numCells[1] * numCells[2];
+  std::vector<int> cellCount(numCellsTotal + 1, 0);
+  for (int n = 0; n < N; ++n) {
+    const double r[3] = {x[n], y[n], z[n]};
+    int cell[3];
+    for (int d = 0; d < 3; ++d) {
+      const double* g = box + 9 + d * 3;
+      double sd = g[0] * r[0] + g[1] * r[1] + g[2] * r[2];
+      if (input.pbc[d])
+        sd -= floor(sd);
+      s[n * 3 + d] = sd;
+      cell[d] = floor(sd * numCells[d]);
+      if (cell[d] < 0)
+        cell[d] = 0;
+      if (cell[d] >= numCells[d])
+        cell[d] = numCells[d] - 1;
+    }
+    cellOfAtom[n] = cell[0] + numCells[0] * (cell[1] + numCells[1] * cell[2]);
+    ++cellCount[cellOfAtom[n] + 1];
+  }
+  for (int c = 0; c < numCellsTotal; ++c)
+    cellCount[c + 1] += cellCount[c]; // now the start of each cell
+  std::vector<int> cellContents(N);
+  std::vector<int> filled(cellCount.begin(), cellCount.end() - 1);
+  for (int n = 0; n < N; ++n)
+    cellContents[filled[cellOfAtom[n]]++] = n;
+
+  for (int n1 = 0; n1 < N; ++n1) {
+    if (input.type1 >= 0 && int(type[n1]) != input.type1)
+      continue;
+    const int c1 = cellOfAtom[n1];
+    const int cell[3] = {
+      c1 % numCells[0], c1 / numCells[0] % numCells[1],
+      c1 / (numCells[0] * numCells[1])};
+    for (int offset = 0; offset < 27; ++offset) {
+      const int shift[3] = {offset % 3 - 1, offset / 3 % 3 - 1, offset / 9 - 1};
+      int neighbor[3];
+      bool isValid = true;
+      for (int d = 0; d < 3; ++d) {
+        if (numCells[d] == 1 && shift[d] != 0)
+          isValid = false;
+        neighbor[d] = cell[d] + shift[d];
+        if (neighbor[d] < 0 || neighbor[d] >= numCells[d]) {
+          if (input.pbc[d])
+            neighbor[d] = (neighbor[d] + numCells[d]) % numCells[d];
+          else
+            isValid = false;
+        }
+      }
+      if (!isValid)
+        continue;
+      const int c2 =
+        neighbor[0] + numCells[0] * (neighbor[1] + numCells[1] * neighbor[2]);
+      for (int k = cellCount[c2]; k < cellCount[c2 + 1]; ++k) {
+        const int n2 = cellContents[k];
+        if (n2 == n1 || (input.type2 >= 0 && int(type[n2]) != input.type2))
+          continue;
+        double s12[3];
+        for (int d = 0; d < 3; ++d) {
+          s12[d] = s[n2 * 3 + d] - s[n1 * 3 + d];
+          if (input.pbc[d])
+            s12[d] -= round(s12[d]);
+        }
+        const double x12 = box[0] * s12[0] + box[1] * s12[1] + box[2] * s12[2];
+        const double y12 = box[3] * s12[0] + box[4] * s12[1] + box[5] * s12[2];
+        const double z12 = box[6] * s12[0] + box[7] * s12[1] + box[8] * s12[2];
+        const double d2 = x12 * x12 + y12 * y12 + z12 * z12;
+        if (d2 < rcSquare && d2 > 0.0) {
+          const int bin = ceil(sqrt(d2) * binInverse) - 1; // as in find_rdf.m
+          count[bin] += 1.0;
+        }
+      }
+    }
+  }
+}
+
+void findRdf(int argc, char** argv, const int numThreads)
+{
+  if (argc < 7) {
+    std::cout << "Usage: mdpost rdf file N box [options]" << std::endl;
+    exit(1);
+  }
+  MappedFile file(argv[2]);
+  RdfInput input;
+  input.number = getInt(argv[3]);
+  int arg = 4;
+  int numBoxValues = 0;
+  while (arg + numBoxValues < argc &&
+         !(argv[arg + numBoxValues][0] == '-' &&
+           isalpha(argv[arg + numBoxValues][1])))
+    ++numBoxValues;
+  if (numBoxValues != 3 && numBoxValues != 9) {
+    std::cout << "Error: the box needs 3 or 9 numbers." << std::endl;
+    exit(1);
+  }
+  std::fill(input.box, input.box + 9, 0.0);
+  if (numBoxValues == 3) {
+    for (int d = 0; d < 3; ++d)
+      input.box[d * 4] = getDouble(argv[arg + d]);
+  } else {
+    for (int d1 = 0; d1 < 3; ++d1) {
+      for (int d2 = 0; d2 < 3; ++d2) {
+        input.box[d2 * 3 + d1] = getDouble(argv[arg + d1 * 3 + d2]);
+      }
+    }
+  }
+  arg += numBoxValues;
+  getInverseBox(input.box);
+  for (; arg < argc; ++arg) {
+    const std::string option = argv[arg];
+    if (option == "-pbc" && arg + 3 < argc) {
+      for (int d = 0; d < 3; ++d)
+        input.pbc[d] = getInt(argv[++arg]);
+    } else if (option == "-bins" && arg + 1 < argc) {
+      input.numBins = getInt(argv[++arg]);
+    } else if (option == "-rc" && arg + 1 < argc) {
+      input.rc = getDouble(argv[++arg]);
+    } else if (option == "-types" && arg + 2 < argc) {
+      input.type1 = getInt(argv[++arg]);
+      input.type2 = getInt(argv[++arg]);
+    } else if (option == "-threads") {
+      ++arg;
+    } else {
+      std::cout << option << " is not a valid option." << std::endl;
+      exit(1);
+    }
+  }
+  double thickness[3];
+  getThickness(input.box, thickness);
+  const double maxRc =
+    0.5 * std::min(std::min(thickness[0], thickness[1]), thickness[2]);
+  if (input.rc <= 0.0 || input.rc > maxRc)
+    input.rc = maxRc; // the largest radius the minimum image allows
+
+  const int N = input.number;
+  const int numColumns = file.countColumns();
+  if (numColumns != 3 && numColumns != 4) {
+    std::cout << "Error: rdf needs 3 or 4 columns." << std::endl;
+    exit(1);
+  }
+  if (input.type1 >= 0 && numColumns != 4) {
+    std::cout << "Error: -types needs a type column." << std::endl;
+    exit(1);
+  }
+  const int numFrames = file.lines.size() / N;
+  std::vector<std::vector<double>> counts(
+    numThreads, std::vector<double>(input.numBins, 0.0));
+  std::vector<int> numType(2, 0);
+
+  runParallel(numFrames, numThreads, [&](const int frame, const int thread) {
+    std::vector<double> data(N * 4, 0.0);
+    double* columns[4] = {&data[0], &data[N], &data[N * 2], &data[N * 3]};
+    double** xyz = numColumns == 4 ? columns : columns + 1;
+    file.readColumns(frame * N, N, numColumns, xyz);
+    accumulateRdf(
+      input, columns[0], columns[1], columns[2], columns[3], counts[thread]);
+    if (frame == 0) {
+      for (int n = 0; n < N; ++n) {
+        numType[0] += input.type1 < 0 || int(columns[0][n]) == input.type1;
+        numType[1] += input.type2 < 0 || int(columns[0][n]) == input.type2;
+      }
+    }
+  });
+
+  const double volume = std::abs(getDet(input.box));
+  const double rho = numType[1] / volume;
+  const double dr = input.rc / input.numBins;
+  FILE* fid = fopen("rdf.txt", "w");
+  for (int n = 0; n < input.numBins; ++n) {
+    double g = 0.0;
+    for (int t = 0; t < numThreads; ++t)
+      g += counts[t][n];
+    const double dV = 4.0 * PI * (dr * (n + 1)) * (dr * (n + 1)) * dr;
+    g /= numFrames * double(numType[0]) * dV * rho;
+    fprintf(fid, "%25.15e%25.15e\n", dr * (n + 1), g);
+  }
+  fclose(fid);
+  std::cout << "rdf.txt written from " << numFrames << " frames" << std::endl;
+}
+
+// all frames of an N-line, 3-column file as x[frame * N + n], ...
+int readFrames(
+  const MappedFile& file,
+  const int N,
+  const int numThreads,
+  std::vector<double>& x,
+  std::vector<double>& y,
+  std::vector<double>& z)
+{
+  if (file.countColumns() != 3) {
+    std::cout << "Error: 3 columns are needed." << std::endl;
+    exit(1);
+  }
+  const int numFrames = file.lines.size() / N;
+  x.resize(size_t(numFrames) * N);
+  y.resize(size_t(numFrames) * N);
+  z.resize(size_t(numFrames) * N);
+  runParallel(numFrames, numThreads, [&](const int frame, const int) {
+    const size_t offset = size_t(frame) * N;
+    double* columns[3] = {&x[offset], &y[offset], &z[offset]};
+    file.readColumns(frame * N, N, 3, columns);
+  });
+  return numFrames;
+}
+
+// msd and vac in the conventions of find_msd and find_vac in md_diffusion.c
+void findCorrelation(
+  int argc, char** argv, const int numThreads, const bool isMsd)
+{
+  if (argc < 6) {
+    std::cout << "Usage: mdpost " << argv[1] << " file N dt Nc" << std::endl;
+    exit(1);
+  }
+  MappedFile file(argv[2]);
+  const int N = getInt(argv[3]);
+  const double dt = getDouble(argv[4]);
+  const int Nc = getInt(argv[5]);
+  std::vector<double> x, y, z;
+  const int Nd = readFrames(file, N, numThreads, x, y, z);
+  const int M = Nd - Nc;
+  if (M < 1) {
+    std::cout << "Error: Nc should be smaller than " << Nd << std::endl;
+    exit(1);
+  }
+
+  std::vector<double> result(Nc * 3, 0.0);
+  runParallel(Nc, numThreads, [&](const int nc, const int) {
+    const size_t lag = size_t(isMsd ? nc + 1 : nc) * N;
+    double sum[3] = {0.0, 0.0, 0.0};
+    for (int m = 0; m < M; ++m) {
+      const size_t offset = size_t(m) * N;
+      for (int i = 0; i < N; ++i) {
+        const size_t n1 = offset + i;
+        const size_t n2 = n1 + lag;
+        if (isMsd) {
+          const double dx = x[n1] - x[n2];
+          const double dy = y[n1] - y[n2];
+          const double dz = z[n1] - z[n2];
+          sum[0] += dx * dx;
+          sum[1] += dy * dy;
+          sum[2] += dz * dz;
+        } else {
+          sum[0] += x[n1] * x[n2];
+          sum[1] += y[n1] * y[n2];
+          sum[2] += z[n1] * z[n2];
+        }
+      }
+    }
+    for (int d = 0; d < 3; ++d)
+      result[nc * 3 + d] = sum[d] / (double(N) * M);
+  });
+
+  const char* fileName = isMsd ? "msd.txt" : "vac.txt";
+  FILE* fid = fopen(fileName, "w");
+  for (int nc = 0; nc < Nc; ++nc) {
+    fprintf(
+      fid, "%25.15e%25.15e%25.15e%25.15e\n", nc * dt, result[nc * 3],
+      result[nc * 3 + 1], result[nc * 3 + 2]);
+  }
+  fclose(fid);
+  std::cout << fileName << " written from " << Nd << " frames" << std::endl;
+}
+
+// find_pdos.m: normalized VACF, Hann-type window, discrete cosine transform
+void findPdos(int argc, char** argv, const int numThreads)
+{
+  if (argc < 8) {
+    std::cout << "Usage: mdpost pdos file N dt Nc omega_max Nw" << std::endl;
+    exit(1);
+  }
+  MappedFile file(argv[2]);
+  const int N = getInt(argv[3]);
+  const double dt = getDouble(argv[4]); // ps
+  const int Nc = getInt(argv[5]);
+  const double omegaMax = getDouble(argv[6]); // THz
+  const int Nw = getInt(argv[7]);
+  std::vector<double> x, y, z;
+  const int Nf = readFrames(file, N, numThreads, x, y, z);
+  const int M = Nf - Nc;
+  if (M < 1) {
+    std::cout << "Error: Nc should be smaller than " << Nf << std::endl;
+    exit(1);
+  }
+
+  std::vector<double> vacf(Nc, 0.0);
+  runParallel(Nc, numThreads, [&](const int nc, const int) {
+    double sum = 0.0;
+    for (int m = 0; m < M; ++m) {
+      const size_t offset = size_t(m) * N;
+      const size_t lag = size_t(nc) * N;
+      for (int i = 0; i < N; ++i) {
+        const size_t n1 = offset + i;
+        sum += x[n1] * x[n1 + lag] + y[n1] * y[n1 + lag] + z[n1] * z[n1 + lag];
+      }
+    }
+    vacf[nc] = sum;
+  });
+  const double vacf0 = vacf[0];
+  std::vector<double> weighted(Nc);
+  for (int nc = 0; nc < Nc; ++nc) {
+    vacf[nc] /= vacf0;
+    weighted[nc] = vacf[nc] * (cos(PI * nc / Nc) + 1.0) * 0.5;
+    if (nc > 0)
+      weighted[nc] *= 2.0; // C(t) = C(-t)
+  }
+
+  FILE* fid = fopen("pdos.txt", "w");
+  for (int n = 0; n < std::max(Nw, Nc); ++n) {
+    double omega = 0.0;
+    double pdos = 0.0;
+    if (n < Nw) {
+      omega = Nw > 1 ? omegaMax * n / (Nw - 1) : omegaMax;
+      for (int nc = 0; nc < Nc; ++nc)
+        pdos += weighted[nc] * cos(omega * nc * dt);
+      pdos *= dt;
+    }
+    fprintf(
+      fid, "%25.15e%25.15e%25.15e\n", omega, pdos, n < Nc ? vacf[n] : 0.0);
+  }
+  fclose(fid);
+  std::cout << "pdos.txt written from " << Nf << " frames" << std::endl;
+}
+
+// find_hac_kappa in kappa_emd.cpp, from a file of heat current samples
+void findHac(int argc, char** argv, const int numThreads)
+{
+  if (argc < 7) {
+    std::cout << "Usage: mdpost hac file dt Nc T V" << std::endl;
+    exit(1);
+  }
+  MappedFile file(argv[2]);
+  const double dt = getDouble(argv[3]) / TIME_UNIT_CONVERSION;
+  const int Nc = getInt(argv[4]);
+  const double T = getDouble(argv[5]);
+  const double V = getDouble(argv[6]);
+  std::vector<double> hx, hy, hz;
+  const int Nd = readFrames(file, 1, numThreads, hx, hy, hz);
+  const int M = Nd - Nc;
+  if (M < 1) {
+    std::cout << "Error: Nc should be smaller than " << Nd << std::endl;
+    exit(1);
+  }
+
+  std::vector<double> hac(Nc * 3, 0.0);
+  runParallel(Nc, numThreads, [&](const int nc, const int) {
+    double sum[3] = {0.0, 0.0, 0.0};
+    for (int m = 0; m < M; ++m) {
+      sum[0] += hx[m] * hx[m + nc];
+      sum[1] += hy[m] * hy[m + nc];
+      sum[2] += hz[m] * hz[m + nc];
+    }
+    for (int d = 0; d < 3; ++d)
+      hac[nc * 3 + d] = sum[d] / M;
+  });
+
+  const double factor = dt * 0.5 * KAPPA_UNIT_CONVERSION / (K_B * T * T * V);
+  std::vector<double> rtc(Nc * 3, 0.0);
+  for (int nc = 1; nc < Nc; ++nc) {
+    for (int d = 0; d < 3; ++d) {
+      rtc[nc * 3 + d] = rtc[(nc - 1) * 3 + d] +
+                        (hac[(nc - 1) * 3 + d] + hac[nc * 3 + d]) * factor;
+    }
+  }
+
+  const double dtInPs = dt * TIME_UNIT_CONVERSION / 1000.0;
+  FILE* fid = fopen("kappa.txt", "a");
+  for (int nc = 0; nc < Nc; ++nc) {
+    fprintf(
+      fid, "%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e\n", nc * dtInPs,
+      hac[nc * 3], hac[nc * 3 + 1], hac[nc * 3 + 2], rtc[nc * 3],
+      rtc[nc * 3 + 1], rtc[nc * 3 + 2]);
+  }
+  fclose(fid);
+  std::cout << "kappa.txt appended from " << Nd << " samples" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cout << "Usage: mdpost rdf|msd|vacf|pdos|hac file ..." << std::endl;
+    exit(1);
+  }
+
+  int numThreads = std::thread::hardware_concurrency();
+  for (int arg = 2; arg + 1 < argc; ++arg) {
+    if (std::string(argv[arg]) == "-threads")
+      numThreads = getInt(argv[arg + 1]);
+  }
+  if (numThreads < 1)
+    numThreads = 1;
+
+  const std::string command = argv[1];
+  if (command == "rdf") {
+    findRdf(argc, argv, numThreads);
+  } else if (command == "msd") {
+    findCorrelation(argc, argv, numThreads, true);
+  } else if (command == "vacf") {
+    findCorrelation(argc, argv, numThreads, false);
+  } else if (command == "pdos") {
+    findPdos(argc, argv, numThreads);
+  } else if (command == "hac") {
+    findHac(argc, argv, numThreads);
+  } else {
+    std::cout << command << " is not a valid command." << std::endl;
+    exit(1);
+  }
+
+  return 0;
+}
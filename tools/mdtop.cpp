@@ -0,0 +1,194 @@
+/*----------------------------------------------------------------------------80
+    Copyright 2022 Zheyong Fan
+Compile:
+    g++ mdtop.cpp -O3 -o mdtop
+Run:
+    mdtop name [-interval s] [-once]
+    name is that of the line "monitor name [interval]" in run.in of md2 or
+    md3; new metrics are printed every s seconds (default: 1) until the run
+    ends, or only the latest ones with -once
+Inputs:
+    the POSIX shared memory /md_name of the running md2 or md3
+Outputs:
+    a line per record on the screen: step, time (ps), T (K), PE (eV),
+    pressure (GPa), ns/day, neighbor list updates and the shares of the run
+    time in neighbor, force, integrate and other
+------------------------------------------------------------------------------*/
+
+#include <atomic>   // std::atomic
+#include <cerrno>   // errno
+#include <chrono>   // std::chrono::duration
+#include <csignal>  // kill
+#include <cstdint>  // uint64_t
+#include <cstdio>   // printf
+#include <cstdlib>  // exit
+#include <iostream> // input/output
+#include <string>   // string
+#include <thread>   // std::this_thread::sleep_for
+
+#include "../common/md_monitor.h" // MonitorRecord and MonitorHeader
+#ifdef _WIN32
+int main(int argc, char** argv)
+{
+  std::cout << "mdtop needs POSIX shared memory." << std::endl;
+  return 1;
+}
+#else
+#include <fcntl.h>    // O_RDONLY
+#include <sys/mman.h> // shm_open
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
+
+const int MAX_READ_ATTEMPTS = 1000000; // of a record that stays odd
+
+// a copy of a record made outside of the shared memory
+struct Metrics {
+  uint64_t index;
+  int64_t step, numUpdates;
+  double time, temperature, pe, pressure, nsPerDay, phaseTime[4];
+};
+
+// seqlock read: copy and accept the copy if the sequence number was even and
+// did not change; false if the record was overwritten by a later one, or if
+// its number stays odd because the run pid died while writing it
+bool readRecord(
+  const MonitorRecord& record, const uint64_t index, const int pid, Metrics& m)
+{
+  for (int attempt = 0; attempt < MAX_READ_ATTEMPTS; ++attempt) {
+    const uint64_t sequence = record.sequence.load(std::memory_order_acquire);
+    if (sequence % 2 == 1) {
+      if (attempt % 1000 == 999 && kill(pid, 0) != 0 && errno == ESRCH)
+        return false;
+      std::this_thread::yield();
+      continue;
+    }
+    m.index = record.index;
+    m.step = record.step;
+    m.numUpdates = record.numUpdates;
+    m.time = record.time;
+    m.temperature = record.temperature;
+    m.pe = record.pe;
+    m.pressure = record.pressure;
+    m.nsPerDay = record.nsPerDay;
+    for (int k = 0; k < 4; ++k)
+      m.phaseTime[k] = record.phaseTime[k];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (record.sequence.load(std::memory_order_relaxed) == sequence)
+      return m.index == index;
+  }
+  return false;
+}
+
+void printRecord(const Metrics& m)
+{
+  double total = 0.0;
+  for (int k = 0; k < 4; ++k)
+    total += m.phaseTime[k];
+  double share[4] = {0.0, 0.0, 0.0, 0.0};
+  for (int k = 0; k < 4; ++k)
+    share[k] = total > 0.0 ? 100.0 * m.phaseTime[k] / total : 0.0;
+  printf(
+    "%10lld %10.3f %9.2f %14.6f %9.4f %9.3f %8lld %6.1f %6.1f %6.1f %6.1f\n",
+    (long long)m.step, m.time, m.temperature, m.pe, m.pressure, m.nsPerDay,
+    (long long)m.numUpdates, share[0], share[1], share[2], share[3]);
+  fflush(stdout);
+}
+
+const MonitorHeader* openMonitor(const std::string& path)
+{
+  const int fd = shm_open(path.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    std::cout << "No run publishes to " << path << std::endl;
+    exit(1);
+  }
+  struct stat status;
+  void* data = MAP_FAILED;
+  if (
+    fstat(fd, &status) == 0 && size_t(status.st_size) >= sizeof(MonitorHeader))
+    data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cout << "Failed to map " << path << std::endl;
+    exit(1);
+  }
+  const MonitorHeader* header = (const MonitorHeader*)data;
+  for (int n = 0; n < 100 && header->version == 0; ++n) // run starting
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (
+    std::string(header->magic) != "mdtop" ||
+    header->version != MONITOR_VERSION ||
+    header->recordSize != sizeof(MonitorRecord) ||
+    size_t(status.st_size) <
+      sizeof(MonitorHeader) + header->numSlots * sizeof(MonitorRecord)) {
+    std::cout << path << " is not a monitor of version " << MONITOR_VERSION
+              << std::endl;
+    exit(1);
+  }
+  return header;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    std::cout << "Usage: mdtop name [-interval s] [-once]" << std::endl;
+    exit(1);
+  }
+  double interval = 1.0;
+  bool isOnce = false;
+  for (int n = 2; n < argc; ++n) {
+    const std::string option = argv[n];
+    if (option == "-interval" && n + 1 < argc) {
+      interval = atof(argv[++n]);
+    } else if (option == "-once") {
+      isOnce = true;
+    } else {
+      std::cout << "Unknown option " << option << std::endl;
+      exit(1);
+    }
+  }
+  if (interval <= 0.0) {
+    std::cout << "The interval should > 0." << std::endl;
+    exit(1);
+  }
+
+  const std::string path = std::string("/md_") + argv[1];
+  const MonitorHeader* header = openMonitor(path);
+  const MonitorRecord* records = (const MonitorRecord*)(header + 1);
+  std::cout << header->program << " (pid " << header->pid << "): "
+            << header->numAtoms << " atoms, " << header->numSteps << " steps"
+            << std::endl;
+  printf(
+    "%10s %10s %9s %14s %9s %9s %8s %6s %6s %6s %6s\n", "step", "time/ps",
+    "T/K", "PE/eV", "P/GPa", "ns/day", "updates", "neigh%", "force%", "integ%",
+    "other%");
+
+  uint64_t next = header->numRecords.load(std::memory_order_acquire);
+  next = next > 0 ? next - 1 : 0; // start from the latest record
+  while (true) {
+    const bool isRunning = header->isRunning.load(std::memory_order_acquire);
+    const uint64_t numRecords =
+      header->numRecords.load(std::memory_order_acquire);
+    if (numRecords > next + header->numSlots) // the reader fell behind
+      next = numRecords - header->numSlots;
+    for (; next < numRecords; ++next) {
+      Metrics metrics;
+      if (readRecord(
+            records[next % header->numSlots], next, header->pid, metrics))
+        printRecord(metrics);
+    }
+    if (!isRunning) {
+      std::cout << "The run has ended." << std::endl;
+      break;
+    }
+    if (kill(header->pid, 0) != 0 && errno == ESRCH) {
+      std::cout << "The run stopped without closing " << path << std::endl;
+      break;
+    }
+    if (isOnce)
+      break;
+    std::this_thread::sleep_for(std::chrono::duration<double>(interval));
+  }
+  return 0;
+}
+#endif